@@ -13,81 +13,111 @@
  *
  */
 
-#include <asm/atomic.h>
-
 #include <linux/err.h>
+#include <linux/hardirq.h>
+#include <linux/hash.h>
 #include <linux/init.h>
 #include <linux/kernel.h>
 #include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/stat.h>
 #include <linux/uid_stat.h>
 #include <net/activity_stats.h>
 
+#define UID_HASH_BITS	8
+
+/*
+ * Entries are never freed, so lookups only need RCU to see a fully
+ * initialized entry. Creation is serialized by uid_create_lock, which
+ * also keeps two CPUs from creating the same uid twice.
+ */
 static DEFINE_SPINLOCK(uid_lock);
-static LIST_HEAD(uid_list);
+static DEFINE_MUTEX(uid_create_lock);
+static struct hlist_head uid_hash[1 << UID_HASH_BITS];
 static struct proc_dir_entry *parent;
 
+/* Per-CPU byte counts, summed when read */
+struct uid_stat_cpu {
+	unsigned long bytes[UID_STAT_PROTO_COUNT][2];
+};
+
+#define UID_STAT_SND	0
+#define UID_STAT_RCV	1
+
 struct uid_stat {
-	struct list_head link;
+	struct hlist_node hash;
 	uid_t uid;
-	atomic_t tcp_rcv;
-	atomic_t tcp_snd;
+	struct uid_stat_cpu __percpu *stats;
 };
 
+static inline struct hlist_head *uid_hash_head(uid_t uid)
+{
+	return &uid_hash[hash_long(uid, UID_HASH_BITS)];
+}
+
 static struct uid_stat *find_uid_stat(uid_t uid) {
-	unsigned long flags;
 	struct uid_stat *entry;
+	struct hlist_node *node;
 
-	spin_lock_irqsave(&uid_lock, flags);
-	list_for_each_entry(entry, &uid_list, link) {
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(entry, node, uid_hash_head(uid), hash) {
 		if (entry->uid == uid) {
-			spin_unlock_irqrestore(&uid_lock, flags);
+			rcu_read_unlock();
 			return entry;
 		}
 	}
-	spin_unlock_irqrestore(&uid_lock, flags);
+	rcu_read_unlock();
 	return NULL;
 }
 
-static int tcp_snd_read_proc(char *page, char **start, off_t off,
-				int count, int *eof, void *data)
+static unsigned long uid_stat_sum(struct uid_stat *uid_entry, int proto,
+				  int dir)
 {
-	int len;
-	unsigned int bytes;
-	char *p = page;
-	struct uid_stat *uid_entry = (struct uid_stat *) data;
-	if (!data)
-		return 0;
+	unsigned long bytes = 0;
+	int cpu;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_snd) + INT_MIN);
-	p += sprintf(p, "%u\n", bytes);
-	len = (p - page) - off;
-	*eof = (len <= count) ? 1 : 0;
-	*start = page + off;
-	return len;
+	for_each_possible_cpu(cpu)
+		bytes += per_cpu_ptr(uid_entry->stats, cpu)->bytes[proto][dir];
+	return bytes;
 }
 
-static int tcp_rcv_read_proc(char *page, char **start, off_t off,
-				int count, int *eof, void *data)
+static int uid_stat_read_proc(char *page, char **start, off_t off,
+				int count, int *eof, void *data,
+				int proto, int dir)
 {
 	int len;
-	unsigned int bytes;
 	char *p = page;
 	struct uid_stat *uid_entry = (struct uid_stat *) data;
 	if (!data)
 		return 0;
 
-	bytes = (unsigned int) (atomic_read(&uid_entry->tcp_rcv) + INT_MIN);
-	p += sprintf(p, "%u\n", bytes);
+	p += sprintf(p, "%lu\n", uid_stat_sum(uid_entry, proto, dir));
 	len = (p - page) - off;
 	*eof = (len <= count) ? 1 : 0;
 	*start = page + off;
 	return len;
 }
 
+#define UID_STAT_READ_PROC(name, proto, dir)				\
+static int name##_read_proc(char *page, char **start, off_t off,	\
+				int count, int *eof, void *data)	\
+{									\
+	return uid_stat_read_proc(page, start, off, count, eof, data,	\
+				  proto, dir);				\
+}
+
+UID_STAT_READ_PROC(tcp_snd, UID_STAT_TCP, UID_STAT_SND)
+UID_STAT_READ_PROC(tcp_rcv, UID_STAT_TCP, UID_STAT_RCV)
+UID_STAT_READ_PROC(udp_snd, UID_STAT_UDP, UID_STAT_SND)
+UID_STAT_READ_PROC(udp_rcv, UID_STAT_UDP, UID_STAT_RCV)
+UID_STAT_READ_PROC(other_snd, UID_STAT_OTHER, UID_STAT_SND)
+UID_STAT_READ_PROC(other_rcv, UID_STAT_OTHER, UID_STAT_RCV)
+
 /* Create a new entry for tracking the specified uid. */
 static struct uid_stat *create_stat(uid_t uid) {
 	unsigned long flags;
@@ -95,17 +125,28 @@ static struct uid_stat *create_stat(uid_t uid) {
 	struct uid_stat *new_uid;
 	struct proc_dir_entry *entry;
 
-	/* Create the uid stat struct and append it to the list. */
-	if ((new_uid = kmalloc(sizeof(struct uid_stat), GFP_KERNEL)) == NULL)
+	/* Allocating the per-CPU counters and proc entries may sleep. */
+	if (in_interrupt())
 		return NULL;
 
+	mutex_lock(&uid_create_lock);
+	new_uid = find_uid_stat(uid);
+	if (new_uid)
+		goto out;
+
+	/* Create the uid stat struct and add it to the hash. */
+	if ((new_uid = kmalloc(sizeof(struct uid_stat), GFP_KERNEL)) == NULL)
+		goto out;
+	new_uid->stats = alloc_percpu(struct uid_stat_cpu);
+	if (!new_uid->stats) {
+		kfree(new_uid);
+		new_uid = NULL;
+		goto out;
+	}
 	new_uid->uid = uid;
-	/* Counters start at INT_MIN, so we can track 4GB of network traffic. */
-	atomic_set(&new_uid->tcp_rcv, INT_MIN);
-	atomic_set(&new_uid->tcp_snd, INT_MIN);
 
 	spin_lock_irqsave(&uid_lock, flags);
-	list_add_tail(&new_uid->link, &uid_list);
+	hlist_add_head_rcu(&new_uid->hash, uid_hash_head(uid));
 	spin_unlock_irqrestore(&uid_lock, flags);
 
 	sprintf(uid_s, "%d", uid);
@@ -118,33 +159,49 @@ static struct uid_stat *create_stat(uid_t uid) {
 	create_proc_read_entry("tcp_rcv", S_IRUGO, entry, tcp_rcv_read_proc,
 		(void *) new_uid);
 
+	create_proc_read_entry("udp_snd", S_IRUGO, entry, udp_snd_read_proc,
+		(void *) new_uid);
+
+	create_proc_read_entry("udp_rcv", S_IRUGO, entry, udp_rcv_read_proc,
+		(void *) new_uid);
+
+	create_proc_read_entry("other_snd", S_IRUGO, entry,
+		other_snd_read_proc, (void *) new_uid);
+
+	create_proc_read_entry("other_rcv", S_IRUGO, entry,
+		other_rcv_read_proc, (void *) new_uid);
+out:
+	mutex_unlock(&uid_create_lock);
 	return new_uid;
 }
 
-int uid_stat_tcp_snd(uid_t uid, int size) {
+static int uid_stat_add(uid_t uid, int proto, int dir, int size) {
 	struct uid_stat *entry;
-	activity_stats_update();
+	activity_stats_update(uid);
 	if ((entry = find_uid_stat(uid)) == NULL &&
 		((entry = create_stat(uid)) == NULL)) {
 			return -1;
 	}
-	atomic_add(size, &entry->tcp_snd);
+	/* The receive paths may also run from softirq context */
+	irqsafe_cpu_add(entry->stats->bytes[proto][dir], size);
 	return 0;
 }
 
-int uid_stat_tcp_rcv(uid_t uid, int size) {
-	struct uid_stat *entry;
-	activity_stats_update();
-	if ((entry = find_uid_stat(uid)) == NULL &&
-		((entry = create_stat(uid)) == NULL)) {
-			return -1;
-	}
-	atomic_add(size, &entry->tcp_rcv);
-	return 0;
+int uid_stat_snd(uid_t uid, int proto, int size) {
+	return uid_stat_add(uid, proto, UID_STAT_SND, size);
+}
+
+int uid_stat_rcv(uid_t uid, int proto, int size) {
+	return uid_stat_add(uid, proto, UID_STAT_RCV, size);
 }
 
 static int __init uid_stat_init(void)
 {
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(uid_hash); i++)
+		INIT_HLIST_HEAD(&uid_hash[i]);
+
 	parent = proc_mkdir("uid_stat", NULL);
 	if (!parent) {
 		pr_err("uid_stat: failed to create proc entry\n");
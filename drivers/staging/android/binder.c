@@ -147,9 +147,12 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
+	int sg_transactions;
+	int sg_segments;
+	u64 sg_data_bytes;	/* data_size summed over sg transactions */
 };
 
 static struct binder_stats binder_stats;
@@ -198,6 +201,19 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	return e;
 }
 
+/*
+ * A scheduling policy and a priority on the kernel's internal scale, so
+ * that real-time and normal priorities compare directly: lower is more
+ * important.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
+#define BINDER_NICE_TO_PRIO(nice)	(MAX_RT_PRIO + (nice) + 20)
+#define BINDER_PRIO_TO_NICE(prio)	((prio) - MAX_RT_PRIO - 20)
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -222,6 +238,7 @@ struct binder_node {
 	int internal_strong_refs;
 	int local_weak_refs;
 	int local_strong_refs;
+	int tmp_refs;	/* transactions copying to it without binder_lock */
 	void __user *ptr;
 	void __user *cookie;
 	unsigned has_strong_ref:1;
@@ -230,6 +247,7 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
+	unsigned inherit_rt:1;
 	unsigned min_priority:8;
 	struct list_head async_todo;
 };
@@ -298,6 +316,13 @@ struct binder_proc {
 	struct rb_root free_buffers;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
+	size_t free_async_space_min;
+	size_t allocated_space;
+	size_t allocated_space_max;
+	int pages_allocated;
+	int pages_allocated_max;
+	int alloc_failed;
+	int async_alloc_failed;
 
 	struct page **pages;
 	size_t buffer_size;
@@ -310,8 +335,9 @@ struct binder_proc {
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
 	struct dentry *debugfs_entry;
+	int tmp_ref;
+	unsigned is_dead:1;
 };
 
 enum {
@@ -336,6 +362,9 @@ struct binder_thread {
 		/* we are also waiting on */
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	/* priority before binder first changed it, restored when idle */
+	struct binder_priority saved_priority;
+	int priority_changed;
 };
 
 struct binder_transaction {
@@ -352,13 +381,14 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
+static void binder_proc_dec_tmpref(struct binder_proc *proc);
 
 /*
  * copied from get_unused_fd_flags
@@ -515,6 +545,99 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	if (binder_is_rt_policy(task->policy)) {
+		p.sched_policy = task->policy;
+		p.prio = MAX_RT_PRIO - 1 - task->rt_priority;
+	} else {
+		p.sched_policy = SCHED_NORMAL;
+		p.prio = BINDER_NICE_TO_PRIO(task_nice(task));
+	}
+	return p;
+}
+
+static void binder_set_priority(struct binder_priority desired)
+{
+	struct sched_param params;
+
+	if (binder_is_rt_policy(desired.sched_policy)) {
+		params.sched_priority = MAX_RT_PRIO - 1 - desired.prio;
+		if (current->policy == desired.sched_policy &&
+		    current->rt_priority == params.sched_priority)
+			return;
+		if (sched_setscheduler_nocheck(current, desired.sched_policy,
+					       &params))
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: failed to set policy %d "
+				     "prio %d\n", current->pid,
+				     desired.sched_policy,
+				     params.sched_priority);
+		return;
+	}
+	if (binder_is_rt_policy(current->policy)) {
+		params.sched_priority = 0;
+		sched_setscheduler_nocheck(current, SCHED_NORMAL, &params);
+	}
+	binder_set_nice(BINDER_PRIO_TO_NICE(desired.prio));
+}
+
+static int binder_priority_equal(struct binder_priority a,
+				 struct binder_priority b)
+{
+	return a.sched_policy == b.sched_policy && a.prio == b.prio;
+}
+
+/*
+ * Give back the priority the thread had before binder changed it for
+ * incoming work. Threads binder never touched keep whatever userspace
+ * gave them, including a real-time policy.
+ */
+static void binder_restore_priority(struct binder_thread *thread)
+{
+	if (!thread->priority_changed)
+		return;
+	binder_set_priority(thread->saved_priority);
+	thread->priority_changed = 0;
+}
+
+/*
+ * Run the current thread at the priority of the transaction it is about
+ * to handle: the caller's priority, raised to the node's minimum.  A
+ * real-time caller only passes its policy on to nodes that asked for it
+ * with FLAT_BINDER_FLAG_INHERIT_RT.
+ */
+static void binder_transaction_priority(struct binder_transaction *t,
+					struct binder_node *node)
+{
+	struct binder_priority desired = t->priority;
+	struct binder_priority node_prio;
+
+	if (binder_is_rt_policy(desired.sched_policy) && !node->inherit_rt) {
+		desired.sched_policy = SCHED_NORMAL;
+		desired.prio = BINDER_NICE_TO_PRIO(0);
+	}
+	node_prio.sched_policy = SCHED_NORMAL;
+	node_prio.prio = BINDER_NICE_TO_PRIO(node->min_priority);
+
+	if (t->flags & TF_ONE_WAY) {
+		/* async work only gets raised to the node minimum */
+		if (t->saved_priority.prio > node_prio.prio)
+			binder_set_priority(node_prio);
+		return;
+	}
+	if (node_prio.prio < desired.prio)
+		desired = node_prio;
+	binder_set_priority(desired);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -549,7 +672,9 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (new_buffer_size < buffer_size)
+		/* equal sizes are kept in address order, see binder_alloc_buf */
+		if (new_buffer_size < buffer_size ||
+		    (new_buffer_size == buffer_size && new_buffer < buffer))
 			p = &parent->rb_left;
 		else
 			p = &parent->rb_right;
@@ -615,7 +740,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
 	struct page **page;
+	struct page **page_array_ptr;
 	struct mm_struct *mm;
+	int ret;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -641,12 +768,11 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
-		goto err_no_vma;
+		ret = -ENOMEM;
+		goto out;
 	}
 
 	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
 		BUG_ON(*page);
@@ -657,17 +783,23 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-			       "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
+	}
+
+	/* map the whole range into the kernel with a single page walk */
+	tmp_area.addr = start;
+	tmp_area.size = end - start + PAGE_SIZE /* guard page? */;
+	page_array_ptr = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		binder_debug(BINDER_DEBUG_TOP_ERRORS,
+		       "binder: %d: binder_alloc_buf failed "
+		       "to map pages %p-%p in kernel\n",
+		       proc->pid, start, end);
+		goto err_map_kernel_failed;
+	}
+
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
 		ret = vm_insert_page(vma, user_page_addr, page[0]);
@@ -680,33 +812,45 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		/* vm_insert_page does not seem to increment the refcount */
 	}
-	if (mm) {
-		up_write(&mm->mmap_sem);
-		mmput(mm);
-	}
-	return 0;
+	proc->pages_allocated += (end - start) / PAGE_SIZE;
+	if (proc->pages_allocated > proc->pages_allocated_max)
+		proc->pages_allocated_max = proc->pages_allocated;
+	ret = 0;
+	goto out;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+	/* one zap and one kernel unmap, so one tlb flush each */
+	if (vma)
+		zap_page_range(vma, (uintptr_t)start +
+			proc->user_buffer_offset, end - start, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
+	proc->pages_allocated -= (end - start) / PAGE_SIZE;
+	page_addr = end;
+	ret = 0;
+	goto free_pages;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	if (page_addr > start)
+		zap_page_range(vma, (uintptr_t)start +
+			proc->user_buffer_offset, page_addr - start, NULL);
 err_map_kernel_failed:
+	unmap_kernel_range((unsigned long)start, end - start);
+	page_addr = end;
+err_alloc_page_failed:
+	ret = -ENOMEM;
+free_pages:
+	while (page_addr > start) {
+		page_addr -= PAGE_SIZE;
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 		__free_page(*page);
 		*page = NULL;
-err_alloc_page_failed:
-		;
 	}
-err_no_vma:
+out:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
-	return -ENOMEM;
+	return ret;
 }
 
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
@@ -739,37 +883,43 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
+		proc->async_alloc_failed++;
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-			     "binder: %d: binder_alloc_buf size %zd"
-			     "failed, no async space left\n", proc->pid, size);
+			     "binder: %d: binder_alloc_buf size %zd "
+			     "failed, no async space left (%zd of %zd "
+			     "allocated)\n", proc->pid, size,
+			     proc->buffer_size / 2 - proc->free_async_space,
+			     proc->buffer_size / 2);
 		return NULL;
 	}
 
+	/*
+	 * Free buffers are sorted by size and then by address, so this
+	 * finds the smallest fitting buffer and, among equal sizes, the
+	 * lowest one.  Keeping allocations low leaves the large free
+	 * extent at the end of the area intact.
+	 */
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(!buffer->free);
 		buffer_size = binder_buffer_size(proc, buffer);
 
-		if (size < buffer_size) {
+		if (size <= buffer_size) {
 			best_fit = n;
 			n = n->rb_left;
-		} else if (size > buffer_size)
+		} else
 			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
 	}
 	if (best_fit == NULL) {
+		proc->alloc_failed++;
 		binder_debug(BINDER_DEBUG_TOP_ERRORS,
 		       "binder: %d: binder_alloc_buf size %zd failed, "
-		       "no address space\n", proc->pid, size);
+		       "no address space (%zd free)\n", proc->pid, size,
+		       proc->buffer_size - proc->allocated_space);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -777,12 +927,10 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
-		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
-			buffer_size = size; /* no room for other buffers */
-		else
-			buffer_size = size + sizeof(struct binder_buffer);
-	}
+	if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
+		buffer_size = size; /* no room for other buffers */
+	else
+		buffer_size = size + sizeof(struct binder_buffer);
 	end_page_addr =
 		(void *)PAGE_ALIGN((uintptr_t)buffer->data + buffer_size);
 	if (end_page_addr > has_page_addr)
@@ -806,8 +954,14 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
 	buffer->async_transaction = is_async;
+	proc->allocated_space += sizeof(struct binder_buffer) +
+		binder_buffer_size(proc, buffer);
+	if (proc->allocated_space > proc->allocated_space_max)
+		proc->allocated_space_max = proc->allocated_space;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
+		if (proc->free_async_space < proc->free_async_space_min)
+			proc->free_async_space_min = proc->free_async_space;
 		binder_debug(BINDER_DEBUG_BUFFER_ALLOC_ASYNC,
 			     "binder: %d: binder_alloc_buf size %zd "
 			     "async free %zd\n", proc->pid, size,
@@ -894,6 +1048,7 @@ static void binder_free_buf(struct binder_proc *proc,
 	BUG_ON((void *)buffer < proc->buffer);
 	BUG_ON((void *)buffer > proc->buffer + proc->buffer_size);
 
+	proc->allocated_space -= sizeof(struct binder_buffer) + buffer_size;
 	if (buffer->async_transaction) {
 		proc->free_async_space += size + sizeof(struct binder_buffer);
 
@@ -1394,9 +1549,79 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Transactions on a proc todo list are kept sorted by caller priority, so
+ * the next idle looper picks up the most important one.  A transaction
+ * is never moved ahead of other work, such as node or death
+ * notifications, that was queued before it.
+ */
+static void binder_enqueue_proc_transaction(struct binder_proc *proc,
+					    struct binder_transaction *t)
+{
+	struct list_head *pos;
+
+	for (pos = proc->todo.prev; pos != &proc->todo; pos = pos->prev) {
+		struct binder_work *w = list_entry(pos, struct binder_work,
+						   entry);
+		if (w->type != BINDER_WORK_TRANSACTION ||
+		    container_of(w, struct binder_transaction,
+				 work)->priority.prio <= t->priority.prio)
+			break;
+	}
+	list_add(&t->work.entry, pos);
+}
+
+/*
+ * Copy in and check the segment list of a BC_TRANSACTION_SG or BC_REPLY_SG.
+ * Returns NULL if it is unusable, the caller then fails the transaction.
+ */
+static struct binder_data_segment *binder_get_data_segments(
+	struct binder_proc *proc, struct binder_thread *thread,
+	struct binder_transaction_data_sg *sg)
+{
+	struct binder_data_segment *segs;
+	size_t total, i;
+
+	if (sg->segments_count == 0 ||
+	    sg->segments_count > BINDER_MAX_DATA_SEGMENTS) {
+		binder_user_error("binder: %d:%d got sg transaction with %zd "
+				  "segments\n", proc->pid, thread->pid,
+				  sg->segments_count);
+		return NULL;
+	}
+	segs = kmalloc(sizeof(*segs) * sg->segments_count, GFP_KERNEL);
+	if (segs == NULL)
+		return NULL;
+	if (copy_from_user(segs, sg->segments,
+			   sizeof(*segs) * sg->segments_count)) {
+		binder_user_error("binder: %d:%d got sg transaction with "
+				  "invalid segments ptr\n",
+				  proc->pid, thread->pid);
+		kfree(segs);
+		return NULL;
+	}
+	total = 0;
+	for (i = 0; i < sg->segments_count; i++) {
+		if (segs[i].size > sg->transaction_data.data_size - total)
+			break;
+		total += segs[i].size;
+	}
+	if (i != sg->segments_count ||
+	    total != sg->transaction_data.data_size) {
+		binder_user_error("binder: %d:%d got sg transaction with "
+				  "segments not matching data size %zd\n",
+				  proc->pid, thread->pid,
+				  sg->transaction_data.data_size);
+		kfree(segs);
+		return NULL;
+	}
+	return segs;
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       struct binder_transaction_data_sg *sg)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1408,7 +1633,10 @@ static void binder_transaction(struct binder_proc *proc,
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
 	struct binder_transaction_log_entry *e;
+	struct binder_data_segment *segs = NULL;
 	uint32_t return_error;
+	int copy_failed = 0;
+	size_t i;
 
 	e = binder_transaction_log_add(&binder_transaction_log);
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
@@ -1427,7 +1655,7 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		binder_set_priority(in_reply_to->saved_priority);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1507,16 +1735,16 @@ static void binder_transaction(struct binder_proc *proc,
 			}
 		}
 	}
-	if (target_thread) {
-		e->to_thread = target_thread->pid;
-		target_list = &target_thread->todo;
-		target_wait = &target_thread->wait;
-	} else {
-		target_list = &target_proc->todo;
-		target_wait = &target_proc->wait;
-	}
 	e->to_proc = target_proc->pid;
 
+	if (sg) {
+		segs = binder_get_data_segments(proc, thread, sg);
+		if (segs == NULL) {
+			return_error = BR_FAILED_REPLY;
+			goto err_bad_data_segments;
+		}
+	}
+
 	/* TODO: reuse incoming transaction for reply */
 	t = kzalloc(sizeof(*t), GFP_KERNEL);
 	if (t == NULL) {
@@ -1561,7 +1789,7 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1577,15 +1805,91 @@ static void binder_transaction(struct binder_proc *proc,
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
-		binder_user_error("binder: %d:%d got transaction with invalid "
-			"data ptr\n", proc->pid, thread->pid);
-		return_error = BR_FAILED_REPLY;
-		goto err_copy_data_failed;
+	/*
+	 * The payload copy can fault on the sender's pages, so it is done
+	 * without binder_lock.  The tmp_ref keeps target_proc and its buffer
+	 * space around; anything else we looked up has to be checked again
+	 * once the lock is retaken.
+	 */
+	target_proc->tmp_ref++;
+	if (target_node)
+		target_node->tmp_refs++;
+	mutex_unlock(&binder_lock);
+	if (segs) {
+		uint8_t *dst = t->buffer->data;
+
+		for (i = 0; i < sg->segments_count; i++) {
+			if (copy_from_user(dst, segs[i].buffer,
+					   segs[i].size)) {
+				copy_failed = 1;
+				break;
+			}
+			dst += segs[i].size;
+		}
+		kfree(segs);
+		segs = NULL;
+	} else if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				  tr->data_size))
+		copy_failed = 1;
+	if (!copy_failed &&
+	    copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size))
+		copy_failed = 2;
+	mutex_lock(&binder_lock);
+
+	if (target_node)
+		target_node->tmp_refs--;
+	if (target_proc->is_dead) {
+		/* binder_deferred_release() left our ref on target_node */
+		t->buffer->target_node = NULL;
+		if (target_node)
+			binder_dec_node(target_node, 1, 0);
+		t->buffer->transaction = NULL;
+		binder_free_buf(target_proc, t->buffer);
+		binder_proc_dec_tmpref(target_proc);
+		return_error = BR_DEAD_REPLY;
+		goto err_target_proc_dead;
 	}
-	if (copy_from_user(offp, tr->data.ptr.offsets, tr->offsets_size)) {
+	binder_proc_dec_tmpref(target_proc);
+
+	if (reply) {
+		if (in_reply_to->from != target_thread) {
+			return_error = BR_DEAD_REPLY;
+			goto err_target_thread_dead;
+		}
+		if (target_thread->transaction_stack != in_reply_to) {
+			binder_user_error("binder: %d:%d reply target %d:%d "
+				"changed transaction stack during copy\n",
+				proc->pid, thread->pid, target_proc->pid,
+				target_thread->pid);
+			return_error = BR_FAILED_REPLY;
+			in_reply_to = NULL;
+			goto err_target_thread_dead;
+		}
+	} else if (target_thread) {
+		/* the thread picked from our call stack may have exited */
+		struct binder_transaction *tmp;
+
+		target_thread = NULL;
+		for (tmp = thread->transaction_stack; tmp;
+		     tmp = tmp->from_parent) {
+			if (tmp->from && tmp->from->proc == target_proc)
+				target_thread = tmp->from;
+		}
+		t->to_thread = target_thread;
+	}
+	if (target_thread) {
+		e->to_thread = target_thread->pid;
+		target_list = &target_thread->todo;
+		target_wait = &target_thread->wait;
+	} else {
+		target_list = &target_proc->todo;
+		target_wait = &target_proc->wait;
+	}
+
+	if (copy_failed) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
-			"offsets ptr\n", proc->pid, thread->pid);
+			"%s ptr\n", proc->pid, thread->pid,
+			copy_failed == 1 ? "data" : "offsets");
 		return_error = BR_FAILED_REPLY;
 		goto err_copy_data_failed;
 	}
@@ -1626,6 +1930,8 @@ static void binder_transaction(struct binder_proc *proc,
 						FLAT_BINDER_FLAG_PRIORITY_MASK;
 				node->accept_fds = !!(fp->flags &
 						FLAT_BINDER_FLAG_ACCEPTS_FDS);
+				node->inherit_rt = !!(fp->flags &
+						FLAT_BINDER_FLAG_INHERIT_RT);
 			}
 			if (fp->cookie != node->cookie) {
 				binder_user_error("binder: %d:%d sending u%p "
@@ -1633,6 +1939,7 @@ static void binder_transaction(struct binder_proc *proc,
 					proc->pid, thread->pid,
 					fp->binder, node->debug_id,
 					fp->cookie, node->cookie);
+				return_error = BR_FAILED_REPLY;
 				goto err_binder_get_ref_for_node_failed;
 			}
 			ref = binder_get_ref_for_node(target_proc, node);
@@ -1773,8 +2080,22 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	if (sg) {
+		binder_stats.sg_transactions++;
+		binder_stats.sg_segments += sg->segments_count;
+		binder_stats.sg_data_bytes += tr->data_size;
+		proc->stats.sg_transactions++;
+		proc->stats.sg_segments += sg->segments_count;
+		proc->stats.sg_data_bytes += tr->data_size;
+		thread->stats.sg_transactions++;
+		thread->stats.sg_segments += sg->segments_count;
+		thread->stats.sg_data_bytes += tr->data_size;
+	}
 	t->work.type = BINDER_WORK_TRANSACTION;
-	list_add_tail(&t->work.entry, target_list);
+	if (target_list == &target_proc->todo)
+		binder_enqueue_proc_transaction(target_proc, t);
+	else
+		list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
 	if (target_wait)
@@ -1790,9 +2111,11 @@ err_binder_new_node_failed:
 err_bad_object_type:
 err_bad_offset:
 err_copy_data_failed:
+err_target_thread_dead:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
 	t->buffer->transaction = NULL;
 	binder_free_buf(target_proc, t->buffer);
+err_target_proc_dead:
 err_binder_alloc_buf_failed:
 	kfree(tcomplete);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION_COMPLETE);
@@ -1800,6 +2123,8 @@ err_alloc_tcomplete_failed:
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
+	kfree(segs);
+err_bad_data_segments:
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
@@ -1816,6 +2141,12 @@ err_no_context_mgr_node:
 		*fe = *e;
 	}
 
+	if (thread->return_error != BR_OK &&
+	    thread->return_error2 == BR_OK) {
+		/* a failed reply reached us while binder_lock was dropped */
+		thread->return_error2 = thread->return_error;
+		thread->return_error = BR_OK;
+	}
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
 		thread->return_error = BR_TRANSACTION_COMPLETE;
@@ -2024,7 +2355,20 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   NULL);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			binder_transaction(proc, thread, &tr.transaction_data,
+					   cmd == BC_REPLY_SG, &tr);
 			break;
 		}
 
@@ -2297,7 +2641,7 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_restore_priority(thread);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
@@ -2460,13 +2804,14 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
-			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+			t->saved_priority = binder_get_priority(current);
+			binder_transaction_priority(t, target_node);
+			if (!thread->priority_changed &&
+			    !binder_priority_equal(t->saved_priority,
+						   binder_get_priority(current))) {
+				thread->saved_priority = t->saved_priority;
+				thread->priority_changed = 1;
+			}
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2911,6 +3256,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
 	proc->free_async_space = proc->buffer_size / 2;
+	proc->free_async_space_min = proc->free_async_space;
 	barrier();
 	proc->files = get_files_struct(current);
 	proc->vma = vma;
@@ -2949,7 +3295,6 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
 	mutex_lock(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
@@ -3005,12 +3350,80 @@ static int binder_release(struct inode *nodp, struct file *filp)
 	return 0;
 }
 
+static void binder_free_proc(struct binder_proc *proc)
+{
+	struct binder_transaction *t;
+	struct rb_node *n;
+	int buffers, page_count;
+
+	BUG_ON(!proc->is_dead);
+	BUG_ON(proc->tmp_ref);
+
+	buffers = 0;
+	while ((n = rb_first(&proc->allocated_buffers))) {
+		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
+							rb_node);
+		t = buffer->transaction;
+		if (t) {
+			t->buffer = NULL;
+			buffer->transaction = NULL;
+			binder_debug(BINDER_DEBUG_TOP_ERRORS,
+				"binder: release proc %d, "
+			       "transaction %d, not freed\n",
+			       proc->pid, t->debug_id);
+			/*BUG();*/
+		}
+		binder_free_buf(proc, buffer);
+		buffers++;
+	}
+
+	page_count = 0;
+	if (proc->pages) {
+		int i;
+		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+			if (proc->pages[i]) {
+				void *page_addr = proc->buffer + i * PAGE_SIZE;
+				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+					     "binder_release: %d: "
+					     "page %d at %p not freed\n",
+					     proc->pid, i,
+					     page_addr);
+				unmap_kernel_range((unsigned long)page_addr,
+					PAGE_SIZE);
+				__free_page(proc->pages[i]);
+				page_count++;
+			}
+		}
+		kfree(proc->pages);
+		vfree(proc->buffer);
+	}
+
+	put_task_struct(proc->tsk);
+
+	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
+		     "binder_release: %d buffers %d, pages %d\n",
+		     proc->pid, buffers, page_count);
+
+	kfree(proc);
+}
+
+/*
+ * Drop a reference taken while binder_lock was released.  The last one
+ * on a proc that went away in the meantime frees it.
+ */
+static void binder_proc_dec_tmpref(struct binder_proc *proc)
+{
+	BUG_ON(proc->tmp_ref <= 0);
+	proc->tmp_ref--;
+	if (proc->is_dead && proc->tmp_ref == 0)
+		binder_free_proc(proc);
+}
+
 static void binder_deferred_release(struct binder_proc *proc)
 {
 	struct hlist_node *pos;
-	struct binder_transaction *t;
 	struct rb_node *n;
-	int threads, nodes, incoming_refs, outgoing_refs, buffers, active_transactions, page_count;
+	int threads, nodes, incoming_refs, outgoing_refs, active_transactions;
 
 	BUG_ON(proc->vma);
 	BUG_ON(proc->files);
@@ -3038,15 +3451,20 @@ static void binder_deferred_release(struct binder_proc *proc)
 		nodes++;
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
-		if (hlist_empty(&node->refs)) {
+		if (hlist_empty(&node->refs) && !node->tmp_refs) {
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
 			struct binder_ref *ref;
 			int death = 0;
 
+			/*
+			 * The buffers of this proc go away with it. A
+			 * transaction still copying its payload drops its own
+			 * strong ref, which may free the node.
+			 */
 			node->proc = NULL;
-			node->local_strong_refs = 0;
+			node->local_strong_refs = node->tmp_refs;
 			node->local_weak_refs = 0;
 			hlist_add_head(&node->dead_node, &binder_dead_nodes);
 
@@ -3076,58 +3494,18 @@ static void binder_deferred_release(struct binder_proc *proc)
 		binder_delete_ref(ref);
 	}
 	binder_release_work(&proc->todo);
-	buffers = 0;
-
-	while ((n = rb_first(&proc->allocated_buffers))) {
-		struct binder_buffer *buffer = rb_entry(n, struct binder_buffer,
-							rb_node);
-		t = buffer->transaction;
-		if (t) {
-			t->buffer = NULL;
-			buffer->transaction = NULL;
-			binder_debug(BINDER_DEBUG_TOP_ERRORS,
-				"binder: release proc %d, "
-			       "transaction %d, not freed\n",
-			       proc->pid, t->debug_id);
-			/*BUG();*/
-		}
-		binder_free_buf(proc, buffer);
-		buffers++;
-	}
 
 	binder_stats_deleted(BINDER_STAT_PROC);
 
-	page_count = 0;
-	if (proc->pages) {
-		int i;
-		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
-				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
-				unmap_kernel_range((unsigned long)page_addr,
-					PAGE_SIZE);
-				__free_page(proc->pages[i]);
-				page_count++;
-			}
-		}
-		kfree(proc->pages);
-		vfree(proc->buffer);
-	}
-
-	put_task_struct(proc->tsk);
-
 	binder_debug(BINDER_DEBUG_OPEN_CLOSE,
 		     "binder_release: %d threads %d, nodes %d (ref %d), "
-		     "refs %d, active transactions %d, buffers %d, "
-		     "pages %d\n",
+		     "refs %d, active transactions %d\n",
 		     proc->pid, threads, nodes, incoming_refs, outgoing_refs,
-		     active_transactions, buffers, page_count);
+		     active_transactions);
 
-	kfree(proc);
+	proc->is_dead = 1;
+	if (proc->tmp_ref == 0)
+		binder_free_proc(proc);
 }
 
 static void binder_deferred_func(struct work_struct *work)
@@ -3162,7 +3540,7 @@ static void binder_deferred_func(struct work_struct *work)
 			binder_deferred_flush(proc);
 
 		if (defer & BINDER_DEFERRED_RELEASE)
-			binder_deferred_release(proc); /* frees proc */
+			binder_deferred_release(proc); /* may free proc */
 
 		mutex_unlock(&binder_lock);
 		if (files)
@@ -3188,13 +3566,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3396,7 +3775,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3441,6 +3822,12 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 				stats->obj_created[i] - stats->obj_deleted[i],
 				stats->obj_created[i]);
 	}
+
+	if (stats->sg_transactions)
+		seq_printf(m, "%ssg transactions: %d segments %d data "
+			   "bytes %llu\n", prefix, stats->sg_transactions,
+			   stats->sg_segments,
+			   (unsigned long long)stats->sg_data_bytes);
 }
 
 static void print_binder_proc_stats(struct seq_file *m,
@@ -3460,6 +3847,21 @@ static void print_binder_proc_stats(struct seq_file *m,
 			"  free async space %zd\n", proc->requested_threads,
 			proc->requested_threads_started, proc->max_threads,
 			proc->ready_threads, proc->free_async_space);
+	seq_printf(m, "  async space low watermark %zd, failed %d\n",
+		   proc->free_async_space_min, proc->async_alloc_failed);
+	count = 0;
+	for (n = rb_first(&proc->free_buffers); n != NULL; n = rb_next(n))
+		count++;
+	n = rb_last(&proc->free_buffers);
+	seq_printf(m, "  buffer space: allocated %zd max %zd, free %zd in "
+		   "%d extents, largest %zd, failed %d\n",
+		   proc->allocated_space, proc->allocated_space_max,
+		   proc->buffer_size - proc->allocated_space, count,
+		   n ? binder_buffer_size(proc, rb_entry(n,
+				struct binder_buffer, rb_node)) : 0,
+		   proc->alloc_failed);
+	seq_printf(m, "  buffer pages: %d max %d\n",
+		   proc->pages_allocated, proc->pages_allocated_max);
 	count = 0;
 	for (n = rb_first(&proc->nodes); n != NULL; n = rb_next(n))
 		count++;
@@ -37,6 +37,8 @@ enum {
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	/* real-time callers pass their policy on to the handling thread */
+	FLAT_BINDER_FLAG_INHERIT_RT = 0x800,
 };
 
 /*
@@ -147,6 +149,26 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * For BC_TRANSACTION_SG and BC_REPLY_SG the transaction data is gathered
+ * from up to BINDER_MAX_DATA_SEGMENTS user buffers, in order, instead of
+ * from data.ptr.buffer.  The segment sizes must add up to data_size;
+ * data.ptr.offsets is used as for BC_TRANSACTION and indexes into the
+ * gathered data.
+ */
+#define BINDER_MAX_DATA_SEGMENTS	256
+
+struct binder_data_segment {
+	const void __user	*buffer;
+	size_t			size;
+};
+
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	const struct binder_data_segment __user *segments;
+	size_t				segments_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +346,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * gathered from a list of segments.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
@@ -25,6 +25,10 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/lzo.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -93,29 +97,82 @@ static char klog_buf[256];
  *
  * This structure lives from module insertion until module removal, so it does
  * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * spinlock 'lock'.
+ *
+ * Nothing may sleep under 'lock': user copies are done with page faults
+ * disabled, and on a fault the lock is dropped, the user pages are faulted in
+ * and the operation is retried. Writers therefore never wait for a reader or
+ * another writer that is stuck in a page fault.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
+	spinlock_t		lock;	/* lock protecting buffer */
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	u64			w_pos;	/* bytes ever written; w_off's position */
+	unsigned char		*static_buf; /* built-in buffer, never freed */
+	size_t			pending_size; /* size requested before init */
+
+	/*
+	 * The archive holds LZO-compressed chunks of whole entries taken from
+	 * the oldest part of the ring before the writer laps them. It is
+	 * protected by 'archive_mutex', except 'archive_pos' which is
+	 * protected by 'lock'. Writers never take 'archive_mutex'.
+	 */
+	struct mutex		archive_mutex;
+	struct list_head	archive;	/* chunks, oldest first */
+	size_t			archive_bytes;	/* memory used by chunks */
+	u64			archive_pos;	/* next position to compress */
+	struct work_struct	archive_work;
+	unsigned char		*archive_raw;	/* uncompressed chunk */
+	unsigned char		*archive_lzo;	/* compressed chunk */
+	void			*archive_wrkmem; /* lzo1x_1_compress() state */
 };
 
+/*
+ * struct logger_archive_chunk - entries [pos, pos + len) of a log's stream,
+ * compressed into 'clen' bytes of 'data'.
+ */
+struct logger_archive_chunk {
+	struct list_head	list;
+	u64			pos;
+	size_t			len;
+	size_t			clen;
+	unsigned char		data[0];
+};
+
+/* uncompressed size of an archive chunk; always holds whole entries */
+#define LOGGER_ARCHIVE_CHUNK	(32*1024)
+
+/* largest log size that can be set at runtime */
+#define LOGGER_MAX_SIZE		(16*1024*1024)
+
+/* bytes of compressed history to keep per log; 0 disables the archive */
+static unsigned int logger_archive_size;
+module_param_named(archive_size, logger_archive_size, uint, 0644);
+
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. The structure is protected by log->lock.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	/*
+	 * 'a_pos' only moves under both log->archive_mutex and log->lock,
+	 * so holding either is enough to read it.
+	 */
+	u64			a_pos;	/* next archived position to read */
+	u64			a_end;	/* ring position at open; archive ends */
+	unsigned char		*a_buf;	/* decompressed archive chunk */
+	u64			a_buf_pos; /* position of chunk in a_buf */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -148,7 +205,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -166,11 +223,169 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 	return sizeof(struct logger_entry) + val;
 }
 
+/*
+ * logger_pos - the stream position of the readable offset 'off'
+ *
+ * Caller needs to hold log->lock.
+ */
+static inline u64 logger_pos(struct logger_log *log, size_t off)
+{
+	return log->w_pos - logger_offset(log->w_off - off);
+}
+
+/* logger_set_a_pos - moves the reader's archive position */
+static void logger_set_a_pos(struct logger_reader *reader, u64 pos)
+{
+	spin_lock(&reader->log->lock);
+	reader->a_pos = pos;
+	spin_unlock(&reader->log->lock);
+}
+
+/* logger_in_archive - has 'reader' archived entries left to read? */
+static int logger_in_archive(struct logger_reader *reader)
+{
+	int ret;
+
+	spin_lock(&reader->log->lock);
+	ret = reader->a_pos < reader->a_end;
+	spin_unlock(&reader->log->lock);
+
+	return ret;
+}
+
+/*
+ * logger_archive_next - finds the next archived entry for 'reader' and
+ * decompresses its chunk into reader->a_buf, where the entry starts at
+ * 'a_pos - a_buf_pos'. Returns the entry's length, or zero once the reader
+ * has gone past the archive and should continue in the ring.
+ *
+ * The caller needs to hold log->archive_mutex.
+ */
+static ssize_t logger_archive_next(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	struct logger_archive_chunk *chunk;
+	size_t len;
+	__u16 val;
+
+	list_for_each_entry(chunk, &log->archive, list)
+		if (reader->a_pos < chunk->pos + chunk->len)
+			goto found;
+	goto done;
+
+found:
+	if (chunk->pos >= reader->a_end)
+		goto done;
+
+	/* older chunks were dropped while we were away */
+	if (reader->a_pos < chunk->pos)
+		logger_set_a_pos(reader, chunk->pos);
+
+	if (!reader->a_buf) {
+		reader->a_buf = vmalloc(LOGGER_ARCHIVE_CHUNK);
+		if (!reader->a_buf)
+			return -ENOMEM;
+	}
+
+	if (reader->a_buf_pos != chunk->pos) {
+		len = LOGGER_ARCHIVE_CHUNK;
+		if (lzo1x_decompress_safe(chunk->data, chunk->clen,
+					  reader->a_buf, &len) != LZO_E_OK ||
+		    len != chunk->len) {
+			reader->a_buf_pos = ~0ULL;
+			logger_set_a_pos(reader, chunk->pos + chunk->len);
+			return -EIO;
+		}
+		reader->a_buf_pos = chunk->pos;
+	}
+
+	memcpy(&val, reader->a_buf + (reader->a_pos - chunk->pos), sizeof(val));
+	return sizeof(struct logger_entry) + val;
+
+done:
+	logger_set_a_pos(reader, reader->a_end);
+	return 0;
+}
+
+/*
+ * logger_read_archive - reads the next archived entry for 'reader' into
+ * 'buf'. Returns the entry's length, or zero once the reader has gone past
+ * the archive and should continue in the ring.
+ */
+static ssize_t logger_read_archive(struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	struct logger_log *log = reader->log;
+	ssize_t ret;
+
+	mutex_lock(&log->archive_mutex);
+
+	ret = logger_archive_next(reader);
+	if (ret <= 0)
+		goto out;
+
+	if (count < ret) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (copy_to_user(buf, reader->a_buf +
+			 (reader->a_pos - reader->a_buf_pos), ret)) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	logger_set_a_pos(reader, reader->a_pos + ret);
+out:
+	mutex_unlock(&log->archive_mutex);
+
+	return ret;
+}
+
+/*
+ * logger_archive_next_len - LOGGER_GET_NEXT_ENTRY_LEN for a reader that has
+ * archived entries left. Returns zero once it has gone past the archive.
+ */
+static ssize_t logger_archive_next_len(struct logger_reader *reader)
+{
+	ssize_t ret;
+
+	mutex_lock(&reader->log->archive_mutex);
+	ret = logger_archive_next(reader);
+	mutex_unlock(&reader->log->archive_mutex);
+
+	return ret;
+}
+
+/*
+ * logger_archive_len - bytes of archived entries 'reader' has left to read,
+ * for LOGGER_GET_LOG_LEN.
+ */
+static size_t logger_archive_len(struct logger_reader *reader)
+{
+	struct logger_log *log = reader->log;
+	struct logger_archive_chunk *chunk;
+	size_t len = 0;
+
+	mutex_lock(&log->archive_mutex);
+	list_for_each_entry(chunk, &log->archive, list) {
+		if (chunk->pos >= reader->a_end)
+			break;
+		if (chunk->pos + chunk->len <= reader->a_pos)
+			continue;
+		len += chunk->pos + chunk->len - max(chunk->pos, reader->a_pos);
+	}
+	mutex_unlock(&log->archive_mutex);
+
+	return len;
+}
+
 /*
  * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * user-space buffer 'buf'. Returns 'count' on success, or -EFAULT if the
+ * user buffer is not resident; the read head only moves on success.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock and have checked access_ok() on 'buf'.
  */
 static ssize_t do_read_log_to_user(struct logger_log *log,
 				   struct logger_reader *reader,
@@ -178,6 +393,9 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 				   size_t count)
 {
 	size_t len;
+	unsigned long left;
+
+	pagefault_disable();
 
 	/*
 	 * We read from the log in two disjoint operations. First, we read from
@@ -185,16 +403,20 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the log, whichever comes first.
 	 */
 	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
-		return -EFAULT;
+	left = __copy_to_user_inatomic(buf, log->buffer + reader->r_off, len);
 
 	/*
 	 * Second, we read any remaining bytes, starting back at the head of
 	 * the log.
 	 */
-	if (count != len)
-		if (copy_to_user(buf + len, log->buffer, count - len))
-			return -EFAULT;
+	if (!left && count != len)
+		left = __copy_to_user_inatomic(buf + len, log->buffer,
+					       count - len);
+
+	pagefault_enable();
+
+	if (left)
+		return -EFAULT;
 
 	reader->r_off = logger_offset(reader->r_off + count);
 
@@ -202,36 +424,37 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 }
 
 /*
- * logger_read - our log's read() method
- *
- * Behavior:
- *
- * 	- O_NONBLOCK works
- * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
- *
- * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
- * buffer is insufficient to hold next entry.
+ * logger_read_entry - reads exactly one entry for 'reader' into 'buf',
+ * archived entries first, blocking for one unless 'nonblock' is set.
  */
-static ssize_t logger_read(struct file *file, char __user *buf,
-			   size_t count, loff_t *pos)
+static ssize_t logger_read_entry(struct logger_reader *reader,
+				 char __user *buf, size_t count, int nonblock)
 {
-	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t len = 0;
 	DEFINE_WAIT(wait);
 
+	if (!access_ok(VERIFY_WRITE, buf, count))
+		return -EFAULT;
+
+	if (logger_in_archive(reader)) {
+		ret = logger_read_archive(reader, buf, count);
+		if (ret)
+			return ret;
+	}
+
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
-		if (file->f_flags & O_NONBLOCK) {
+		if (nonblock) {
 			ret = -EAGAIN;
 			break;
 		}
@@ -248,35 +471,100 @@ start:
 	if (ret)
 		return ret;
 
-	mutex_lock(&log->mutex);
+retry:
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
 	if (unlikely(log->w_off == reader->r_off)) {
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		goto start;
 	}
 
 	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
+	len = get_entry_len(log, reader->r_off);
+	if (count < len) {
 		ret = -EINVAL;
 		goto out;
 	}
 
 	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	ret = do_read_log_to_user(log, reader, buf, len);
 
 out:
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	/* the user buffer was not resident: fault it in and try again */
+	if (unlikely(ret == -EFAULT)) {
+		if (fault_in_pages_writeable(buf, len))
+			return -EFAULT;
+		goto retry;
+	}
 
 	return ret;
 }
 
+/*
+ * logger_read - our log's read() method
+ *
+ * Behavior:
+ *
+ * 	- O_NONBLOCK works
+ * 	- If there are no log entries to read, blocks until log is written to
+ * 	- Atomically reads exactly one log entry
+ *
+ * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
+ * buffer is insufficient to hold next entry.
+ */
+static ssize_t logger_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *pos)
+{
+	struct logger_reader *reader = file->private_data;
+
+	return logger_read_entry(reader, buf, count,
+				 file->f_flags & O_NONBLOCK);
+}
+
+/*
+ * logger_read_bulk - LOGGER_READ_BULK: like read(), but then keeps copying
+ * whole entries without blocking until the next one does not fit.
+ */
+static long logger_read_bulk(struct file *file,
+			     struct logger_bulk_read __user *arg)
+{
+	struct logger_reader *reader = file->private_data;
+	struct logger_bulk_read req;
+	char __user *buf;
+	ssize_t ret, total;
+	__u32 entries = 0;
+
+	if (copy_from_user(&req, arg, sizeof(req)))
+		return -EFAULT;
+
+	buf = (char __user *)(unsigned long)req.buf;
+	total = logger_read_entry(reader, buf, req.size,
+				  file->f_flags & O_NONBLOCK);
+	if (total < 0)
+		return total;
+
+	for (entries = 1; total < req.size; entries++) {
+		ret = logger_read_entry(reader, buf + total,
+					req.size - total, 1);
+		if (ret <= 0)
+			break;
+		total += ret;
+	}
+
+	if (put_user(entries, &arg->entries))
+		return -EFAULT;
+
+	return total;
+}
+
 /*
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -314,7 +602,7 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
@@ -330,10 +618,133 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 			reader->r_off = get_next_entry(log, reader->r_off, len);
 }
 
+/*
+ * logger_archive_trim - drops the oldest chunks until the archive fits in
+ * 'limit' bytes.
+ *
+ * The caller needs to hold log->archive_mutex.
+ */
+static void logger_archive_trim(struct logger_log *log, size_t limit)
+{
+	struct logger_archive_chunk *chunk;
+
+	while (log->archive_bytes > limit) {
+		chunk = list_first_entry(&log->archive,
+					 struct logger_archive_chunk, list);
+		list_del(&chunk->list);
+		log->archive_bytes -= sizeof(*chunk) + chunk->clen;
+		kfree(chunk);
+	}
+}
+
+/*
+ * logger_archive_chunk - compresses up to LOGGER_ARCHIVE_CHUNK bytes of the
+ * oldest not yet archived entries, once more than half of the ring is
+ * waiting. Returns nonzero if a chunk was added.
+ *
+ * The caller needs to hold log->archive_mutex.
+ */
+static int logger_archive_chunk(struct logger_log *log)
+{
+	struct logger_archive_chunk *chunk;
+	size_t off, len, n, clen;
+	u64 pos;
+
+	spin_lock(&log->lock);
+
+	/* the writer got to these first */
+	pos = logger_pos(log, log->head);
+	if (log->archive_pos < pos)
+		log->archive_pos = pos;
+
+	if (log->w_pos - log->archive_pos <= log->size / 2) {
+		spin_unlock(&log->lock);
+		return 0;
+	}
+
+	pos = log->archive_pos;
+	off = logger_offset(log->w_off - (size_t)(log->w_pos - pos));
+	for (len = 0; pos + len < log->w_pos; len += n) {
+		n = get_entry_len(log, logger_offset(off + len));
+		if (len + n > LOGGER_ARCHIVE_CHUNK)
+			break;
+	}
+
+	n = min(len, log->size - off);
+	memcpy(log->archive_raw, log->buffer + off, n);
+	if (len != n)
+		memcpy(log->archive_raw + n, log->buffer, len - n);
+	log->archive_pos += len;
+
+	spin_unlock(&log->lock);
+
+	if (lzo1x_1_compress(log->archive_raw, len, log->archive_lzo, &clen,
+			     log->archive_wrkmem) != LZO_E_OK)
+		return 1;
+
+	chunk = kmalloc(sizeof(*chunk) + clen, GFP_KERNEL);
+	if (!chunk)
+		return 0;
+	chunk->pos = pos;
+	chunk->len = len;
+	chunk->clen = clen;
+	memcpy(chunk->data, log->archive_lzo, clen);
+
+	list_add_tail(&chunk->list, &log->archive);
+	log->archive_bytes += sizeof(*chunk) + clen;
+	logger_archive_trim(log, logger_archive_size);
+
+	return 1;
+}
+
+/*
+ * logger_archive_work - keeps the archive ahead of the writer
+ */
+static void logger_archive_work(struct work_struct *work)
+{
+	struct logger_log *log = container_of(work, struct logger_log,
+					      archive_work);
+
+	mutex_lock(&log->archive_mutex);
+
+	if (!log->archive_raw) {
+		log->archive_raw = vmalloc(LOGGER_ARCHIVE_CHUNK);
+		log->archive_lzo =
+			vmalloc(lzo1x_worst_compress(LOGGER_ARCHIVE_CHUNK));
+		log->archive_wrkmem = vmalloc(LZO1X_1_MEM_COMPRESS);
+		if (!log->archive_raw || !log->archive_lzo ||
+		    !log->archive_wrkmem) {
+			vfree(log->archive_raw);
+			vfree(log->archive_lzo);
+			vfree(log->archive_wrkmem);
+			log->archive_raw = NULL;
+			goto out;
+		}
+	}
+
+	while (logger_archive_size && logger_archive_chunk(log))
+		;
+out:
+	mutex_unlock(&log->archive_mutex);
+}
+
+/*
+ * logger_archive_flush - empties the archive
+ */
+static void logger_archive_flush(struct logger_log *log)
+{
+	mutex_lock(&log->archive_mutex);
+	logger_archive_trim(log, 0);
+	spin_lock(&log->lock);
+	log->archive_pos = log->w_pos;
+	spin_unlock(&log->lock);
+	mutex_unlock(&log->archive_mutex);
+}
+
 /*
  * do_write_log - writes 'len' bytes from 'buf' to 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 {
@@ -353,14 +764,16 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
  * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
  * the log 'log'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock and have checked access_ok() on 'buf'.
  *
- * Returns 'count' on success, negative error code on failure.
+ * Returns 'count' on success, negative error code on failure. -EFAULT means
+ * the user pages were not resident, as page faults are disabled here.
  */
 static ssize_t do_write_log_from_user(struct logger_log *log,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
+	unsigned long left;
 
 #ifdef CONFIG_KERNEL_DEBUG_SEC
 	if (count > log->size - 1) {
@@ -369,13 +782,17 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	}
 #endif
 
+	pagefault_disable();
 	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
+	left = __copy_from_user_inatomic(log->buffer + log->w_off, buf, len);
 
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
+	if (!left && count != len)
+		left = __copy_from_user_inatomic(log->buffer, buf + len,
+						 count - len);
+	pagefault_enable();
+
+	if (left)
+		return -EFAULT;
 
 #ifdef CONFIG_KERNEL_DEBUG_SEC
 	//{{ pass platform log (!@hello) to kernel -2/3
@@ -396,6 +813,33 @@ static ssize_t do_write_log_from_user(struct logger_log *log,
 	return count;
 }
 
+/*
+ * fault_in_iov - fault in the first 'count' bytes described by 'iov' so that
+ * a retried write finds them resident. Returns nonzero if they can't be.
+ */
+static int fault_in_iov(const struct iovec *iov, unsigned long nr_segs,
+			size_t count)
+{
+	while (nr_segs-- > 0 && count) {
+		size_t len = min_t(size_t, iov->iov_len, count);
+		const char __user *base = iov->iov_base;
+
+		/* fault_in_pages_readable() only touches the first two pages */
+		while (len) {
+			size_t chunk = min_t(size_t, len, PAGE_SIZE);
+
+			if (fault_in_pages_readable(base, chunk))
+				return -EFAULT;
+			base += chunk;
+			len -= chunk;
+		}
+		count -= min_t(size_t, iov->iov_len, count);
+		iov++;
+	}
+
+	return 0;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -405,10 +849,12 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	size_t orig;
 	struct logger_entry header;
 	struct timespec now;
-	ssize_t ret = 0;
+	unsigned long seg;
+	ssize_t ret;
+	int archive;
 
 	now = current_kernel_time();
 
@@ -422,7 +868,15 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	for (seg = 0; seg < nr_segs; seg++)
+		if (!access_ok(VERIFY_READ, iov[seg].iov_base,
+			       iov[seg].iov_len))
+			return -EFAULT;
+
+retry:
+	ret = 0;
+	spin_lock(&log->lock);
+	orig = log->w_off;
 
 	/*
 	 * Fix up any readers, pulling them forward to the first readable
@@ -434,29 +888,44 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 
 	do_write_log(log, &header, sizeof(struct logger_entry));
 
-	while (nr_segs-- > 0) {
+	for (seg = 0; seg < nr_segs; seg++) {
 		size_t len;
 		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
-		len = min_t(size_t, iov->iov_len, header.len - ret);
+		len = min_t(size_t, iov[seg].iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, iov[seg].iov_base, len);
 		if (unlikely(nr < 0)) {
 			log->w_off = orig;
-			mutex_unlock(&log->mutex);
+			spin_unlock(&log->lock);
+			if (nr == -EFAULT &&
+			    !fault_in_iov(iov, nr_segs, header.len))
+				goto retry;
 			return nr;
 		}
 
-		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
+	log->w_pos += sizeof(struct logger_entry) + ret;
+	archive = logger_archive_size &&
+		  log->w_pos - log->archive_pos > log->size / 2;
+
+	spin_unlock(&log->lock);
+
+	if (archive)
+		schedule_work(&log->archive_work);
 
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	/*
+	 * Wake up any blocked readers. Readers only sleep once they have
+	 * caught up with the writer, so a burst of writes costs one wakeup
+	 * and the writers behind it see an empty wait queue.
+	 */
+	smp_mb();
+	if (waitqueue_active(&log->wq))
+		wake_up_interruptible(&log->wq);
 
 #ifdef CONFIG_KERNEL_DEBUG_SEC
 	//{{ pass platform log (!@hello) to kernel -3/3
@@ -498,11 +967,15 @@ static int logger_open(struct inode *inode, struct file *file)
 
 		reader->log = log;
 		INIT_LIST_HEAD(&reader->list);
+		reader->a_buf = NULL;
+		reader->a_buf_pos = ~0ULL;
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
+		reader->a_end = logger_pos(log, log->head);
+		reader->a_pos = logger_archive_size ? 0 : reader->a_end;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -520,7 +993,12 @@ static int logger_release(struct inode *ignored, struct file *file)
 {
 	if (file->f_mode & FMODE_READ) {
 		struct logger_reader *reader = file->private_data;
+		struct logger_log *log = reader->log;
+
+		spin_lock(&log->lock);
 		list_del(&reader->list);
+		spin_unlock(&log->lock);
+		vfree(reader->a_buf);
 		kfree(reader);
 	}
 
@@ -550,10 +1028,10 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
-	if (log->w_off != reader->r_off)
+	spin_lock(&log->lock);
+	if (log->w_off != reader->r_off || reader->a_pos < reader->a_end)
 		ret |= POLLIN | POLLRDNORM;
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
 
 	return ret;
 }
@@ -562,9 +1040,29 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	size_t archived = 0;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_READ_BULK) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		return logger_read_bulk(file, (void __user *)arg);
+	}
+
+	/* archived entries are read first, so they come first here too */
+	if ((cmd == LOGGER_GET_LOG_LEN || cmd == LOGGER_GET_NEXT_ENTRY_LEN) &&
+	    (file->f_mode & FMODE_READ) &&
+	    logger_in_archive(file->private_data)) {
+		reader = file->private_data;
+		if (cmd == LOGGER_GET_NEXT_ENTRY_LEN) {
+			ret = logger_archive_next_len(reader);
+			if (ret)
+				return ret;
+		} else
+			archived = logger_archive_len(reader);
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -580,6 +1078,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			ret = log->w_off - reader->r_off;
 		else
 			ret = (log->size - reader->r_off) + log->w_off;
+		ret += archived;
 		break;
 	case LOGGER_GET_NEXT_ENTRY_LEN:
 		if (!(file->f_mode & FMODE_READ)) {
@@ -604,7 +1103,10 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	if (cmd == LOGGER_FLUSH_LOG && !ret)
+		logger_archive_flush(log);
 
 	return ret;
 }
@@ -623,12 +1125,14 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The size can be changed later through
+ * the module parameter 'SIZE_PARAM'.
  */
-#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
+#define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE, SIZE_PARAM) \
 static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
 	.buffer = _buf_ ## VAR, \
+	.static_buf = _buf_ ## VAR, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -637,30 +1141,37 @@ static struct logger_log VAR = { \
 	}, \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
-	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
-};
+	.archive_mutex = __MUTEX_INITIALIZER(VAR .archive_mutex), \
+	.archive = LIST_HEAD_INIT(VAR .archive), \
+	.archive_work = __WORK_INITIALIZER(VAR .archive_work, \
+					   logger_archive_work), \
+}; \
+module_param_cb(SIZE_PARAM, &logger_size_ops, &VAR, 0644);
+
+static struct kernel_param_ops logger_size_ops;
 
 #ifdef CONFIG_KERNEL_DEBUG_SEC
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 512*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 512*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 512*1024, main_size)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 512*1024, events_size)
 #ifdef CONFIG_MACH_SAMSUNG_P4LTE
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 1024*1024)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 1024*1024, radio_size)
 #else
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 512*1024)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 512*1024, radio_size)
 #endif
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 512*1024)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 512*1024, system_size)
 #else
-DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
-DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024)
+DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024, main_size)
+DEFINE_LOGGER_DEVICE(log_events, LOGGER_LOG_EVENTS, 256*1024, events_size)
 #ifdef CONFIG_MACH_SAMSUNG_P4LTE
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 1024*1024)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 1024*1024, radio_size)
 #else
-DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024)
+DEFINE_LOGGER_DEVICE(log_radio, LOGGER_LOG_RADIO, 64*1024, radio_size)
 #endif
-DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024)
+DEFINE_LOGGER_DEVICE(log_system, LOGGER_LOG_SYSTEM, 64*1024, system_size)
 #endif
 
 static struct logger_log *get_log_from_minor(int minor)
@@ -676,10 +1187,100 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+/* set once the logs are registered and their buffers can be replaced */
+static int logger_ready;
+
+/*
+ * logger_resize - replaces the ring of 'log' with an empty one of 'size'
+ * bytes. The archive is kept, as stream positions carry on from the old ring.
+ */
+static int logger_resize(struct logger_log *log, size_t size)
+{
+	struct logger_reader *reader;
+	unsigned char *buffer, *old;
+
+	buffer = vmalloc(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	spin_lock(&log->lock);
+	old = log->buffer;
+	log->buffer = buffer;
+	log->size = size;
+	log->w_off = 0;
+	log->head = 0;
+	list_for_each_entry(reader, &log->readers, list)
+		reader->r_off = 0;
+	log->archive_pos = log->w_pos;
+	spin_unlock(&log->lock);
+
+#ifdef CONFIG_KERNEL_DEBUG_SEC
+	if (log == &log_main)
+		plat_log_mark.p_main = buffer;
+	else if (log == &log_radio)
+		plat_log_mark.p_radio = buffer;
+	else if (log == &log_events)
+		plat_log_mark.p_events = buffer;
+	else if (log == &log_system)
+		plat_log_mark.p_system = buffer;
+#endif
+
+	if (old != log->static_buf)
+		vfree(old);
+
+	printk(KERN_INFO "logger: resized log '%s' to %luK\n",
+	       log->misc.name, (unsigned long) size >> 10);
+
+	return 0;
+}
+
+static int logger_set_size(const char *val, const struct kernel_param *kp)
+{
+	struct logger_log *log = kp->arg;
+	unsigned long long size;
+
+	size = memparse(val, NULL);
+	if (size <= LOGGER_ENTRY_MAX_LEN || size > LOGGER_MAX_SIZE ||
+	    !is_power_of_2(size))
+		return -EINVAL;
+
+	/* too early to allocate, logger_init() picks it up */
+	if (!logger_ready) {
+		log->pending_size = size;
+		return 0;
+	}
+
+	if (size == log->size)
+		return 0;
+
+	return logger_resize(log, size);
+}
+
+static int logger_get_size(char *buffer, const struct kernel_param *kp)
+{
+	struct logger_log *log = kp->arg;
+
+	if (!logger_ready && log->pending_size)
+		return sprintf(buffer, "%lu", (unsigned long) log->pending_size);
+	return sprintf(buffer, "%lu", (unsigned long) log->size);
+}
+
+static struct kernel_param_ops logger_size_ops = {
+	.set = logger_set_size,
+	.get = logger_get_size,
+};
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	if (log->pending_size && log->pending_size != log->size) {
+		ret = logger_resize(log, log->pending_size);
+		if (unlikely(ret))
+			printk(KERN_ERR "logger: failed to resize log '%s'\n",
+			       log->misc.name);
+	}
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
@@ -723,6 +1324,7 @@ static int __init logger_init(void)
 	if (unlikely(ret))
 		goto out;
 
+	logger_ready = 1;
 out:
 	return ret;
 }
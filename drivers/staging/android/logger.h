@@ -39,11 +39,23 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * LOGGER_READ_BULK fills 'buf' with as many whole entries as fit in 'size'
+ * bytes, blocking like read() for the first one only. It returns the number
+ * of bytes copied and sets 'entries'.
+ */
+struct logger_bulk_read {
+	__u64		buf;		/* user buffer, e.g. an mmap'd area */
+	__u32		size;		/* size of buf in bytes */
+	__u32		entries;	/* out: number of entries copied */
+};
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_READ_BULK		_IOWR(__LOGGERIO, 5, struct logger_bulk_read)
 
 #endif /* _LINUX_LOGGER_H */
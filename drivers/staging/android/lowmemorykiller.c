@@ -16,6 +16,10 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in per-oom_adj buckets, updated on fork, exit, exec and
+ * oom_adj writes, so a kill only looks at the processes of the highest
+ * bucket that has a candidate rather than at every process in the system.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -37,6 +41,11 @@
 #include <linux/rcupdate.h>
 #include <linux/profile.h>
 #include <linux/notifier.h>
+#include <linux/rculist_nulls.h>
+#include <linux/ktime.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/lowmemorykiller.h>
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -63,6 +72,92 @@ static unsigned long lowmem_deathpending_timeout;
 			printk(x);			\
 	} while (0)
 
+/*
+ * Thread group leaders by oom_adj. Readers walk a bucket under RCU; a task
+ * that moves to another bucket meanwhile sends the reader to a foreign
+ * nulls marker and the bucket is scanned again. Writers hold the lock.
+ */
+#define LOWMEM_INDEX_SIZE	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+
+static struct hlist_nulls_head lowmem_index[LOWMEM_INDEX_SIZE];
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static int lowmem_index_ready;
+
+static inline int lowmem_index_slot(int oom_adj)
+{
+	return clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX) - OOM_DISABLE;
+}
+
+static void __oom_adj_index_add(struct task_struct *p)
+{
+	hlist_nulls_add_head_rcu(&p->oom_adj_node,
+		&lowmem_index[lowmem_index_slot(p->signal->oom_adj)]);
+}
+
+static void __oom_adj_index_del(struct task_struct *p)
+{
+	if (!hlist_nulls_unhashed(&p->oom_adj_node))
+		hlist_nulls_del_init_rcu(&p->oom_adj_node);
+}
+
+void oom_adj_index_add(struct task_struct *p)
+{
+	p->oom_adj_node.pprev = NULL;
+	if (!lowmem_index_ready)
+		return;
+
+	spin_lock(&lowmem_index_lock);
+	__oom_adj_index_add(p);
+	spin_unlock(&lowmem_index_lock);
+}
+
+void oom_adj_index_del(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	__oom_adj_index_del(p);
+	spin_unlock(&lowmem_index_lock);
+}
+
+void oom_adj_index_replace(struct task_struct *old, struct task_struct *new)
+{
+	spin_lock(&lowmem_index_lock);
+	if (!hlist_nulls_unhashed(&old->oom_adj_node)) {
+		hlist_nulls_del_init_rcu(&old->oom_adj_node);
+		__oom_adj_index_add(new);
+	} else
+		new->oom_adj_node.pprev = NULL;
+	spin_unlock(&lowmem_index_lock);
+}
+
+void oom_adj_index_update(struct task_struct *p)
+{
+	spin_lock(&lowmem_index_lock);
+	p = p->group_leader;
+	if (!hlist_nulls_unhashed(&p->oom_adj_node)) {
+		hlist_nulls_del_init_rcu(&p->oom_adj_node);
+		__oom_adj_index_add(p);
+	}
+	spin_unlock(&lowmem_index_lock);
+}
+
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	int i;
+
+	for (i = 0; i < LOWMEM_INDEX_SIZE; i++)
+		INIT_HLIST_NULLS_HEAD(&lowmem_index[i], i);
+
+	/* no fork or exit while we catch up with the existing processes */
+	write_lock_irq(&tasklist_lock);
+	lowmem_index_ready = 1;
+	spin_lock(&lowmem_index_lock);
+	for_each_process(p)
+		__oom_adj_index_add(p);
+	spin_unlock(&lowmem_index_lock);
+	write_unlock_irq(&tasklist_lock);
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data);
 
@@ -85,13 +180,17 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *tsk;
 	struct task_struct *selected = NULL;
+	struct hlist_nulls_node *pos;
 	int rem = 0;
 	int tasksize;
 	int i;
+	int adj;
+	int scanned = 0;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
 	int array_size = ARRAY_SIZE(lowmem_adj);
+	ktime_t start;
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -132,41 +231,59 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 		return rem;
 	}
 	selected_oom_adj = min_adj;
+	start = ktime_get();
 
+	/*
+	 * The highest bucket holding a process with memory has the victim,
+	 * so lower buckets are only looked at when it has none.
+	 */
 	rcu_read_lock();
-	for_each_process(tsk) {
-		struct task_struct *p;
-		int oom_adj;
+	for (adj = OOM_ADJUST_MAX; adj >= min_adj && !selected; adj--) {
+restart:
+		hlist_nulls_for_each_entry_rcu(tsk, pos,
+				&lowmem_index[lowmem_index_slot(adj)],
+				oom_adj_node) {
+			struct task_struct *p;
+			int oom_adj;
 
-		if (tsk->flags & PF_KTHREAD)
-			continue;
+			scanned++;
+			if (tsk->flags & PF_KTHREAD)
+				continue;
 
-		p = find_lock_task_mm(tsk);
-		if (!p)
-			continue;
+			p = find_lock_task_mm(tsk);
+			if (!p)
+				continue;
 
-		oom_adj = p->signal->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(p->mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+			oom_adj = p->signal->oom_adj;
+			if (oom_adj < min_adj) {
+				task_unlock(p);
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			}
+			tasksize = get_mm_rss(p->mm);
+			task_unlock(p);
+			if (tasksize <= 0)
 				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+			}
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
+		if (get_nulls_value(pos) != lowmem_index_slot(adj))
+			goto restart;
 	}
+	trace_lowmem_select(min_adj, scanned,
+			    selected ? selected->pid : 0, selected_oom_adj,
+			    selected_tasksize,
+			    ktime_to_ns(ktime_sub(ktime_get(), start)));
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
@@ -189,6 +306,7 @@ static struct shrinker lowmem_shrinker = {
 
 static int __init lowmem_init(void)
 {
+	lowmem_index_init();
 	task_free_register(&task_nb);
 	register_shrinker(&lowmem_shrinker);
 	return 0;
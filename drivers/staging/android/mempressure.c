@@ -0,0 +1,267 @@
+/* drivers/staging/android/mempressure.c
+ *
+ * The memory pressure device lets a user-space daemon sleep until reclaim
+ * reaches a given pressure level, so that caches can be trimmed and
+ * processes killed before direct reclaim stalls the foreground app.
+ *
+ * Reclaim reports the pages it scanned and reclaimed. Every
+ * MEMPRESSURE_WINDOW scanned pages the reclaim efficiency is graded:
+ *
+ *	low		reclaim is running
+ *	medium		less than (100 - medium)% of the scanned pages were
+ *			reclaimed, or free and file pages are both below
+ *			medium_minfree pages
+ *	critical	the same with critical and critical_minfree
+ *
+ * Write "low", "medium" or "critical" to /dev/mempressure to pick the
+ * lowest level to be woken for (default "low"). read() then blocks until
+ * such an event and returns the level as a line of text; poll() reports
+ * POLLIN when one is pending. Only events after open() are reported.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/mempressure.h>
+
+enum {
+	MEMPRESSURE_NONE,
+	MEMPRESSURE_LOW,
+	MEMPRESSURE_MEDIUM,
+	MEMPRESSURE_CRITICAL,
+	MEMPRESSURE_LEVELS,
+};
+
+static const char * const mempressure_names[MEMPRESSURE_LEVELS] = {
+	"none", "low", "medium", "critical",
+};
+
+/* pages reclaim has to scan before the pressure is graded again */
+#define MEMPRESSURE_WINDOW	(SWAP_CLUSTER_MAX * 16)
+
+static uint mempressure_medium = 60;
+static uint mempressure_critical = 95;
+static uint mempressure_medium_minfree = 4 * 1024;	/* 16MB */
+static uint mempressure_critical_minfree = 2 * 1024;	/* 8MB */
+
+/*
+ * mempressure_seq[l] counts the events at level l or above, and
+ * mempressure_last[l] is the level of the latest of them.
+ */
+static DEFINE_SPINLOCK(mempressure_lock);
+static unsigned long mempressure_scanned;
+static unsigned long mempressure_reclaimed;
+static unsigned int mempressure_seq[MEMPRESSURE_LEVELS];
+static int mempressure_last[MEMPRESSURE_LEVELS];
+static DECLARE_WAIT_QUEUE_HEAD(mempressure_wait);
+
+struct mempressure_reader {
+	int		level;	/* lowest level to report */
+	unsigned int	seq;	/* mempressure_seq[level] last reported */
+};
+
+static int mempressure_level(unsigned long scanned, unsigned long reclaimed)
+{
+	unsigned long pressure;
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+
+	pressure = 100 - min(reclaimed, scanned) * 100 / scanned;
+
+	if (pressure >= mempressure_critical ||
+	    (other_free < mempressure_critical_minfree &&
+	     other_file < mempressure_critical_minfree))
+		return MEMPRESSURE_CRITICAL;
+	if (pressure >= mempressure_medium ||
+	    (other_free < mempressure_medium_minfree &&
+	     other_file < mempressure_medium_minfree))
+		return MEMPRESSURE_MEDIUM;
+	return MEMPRESSURE_LOW;
+}
+
+/*
+ * mempressure_reclaim - called by reclaim after each zone scan
+ */
+void mempressure_reclaim(unsigned long scanned, unsigned long reclaimed)
+{
+	int level, l;
+
+	if (!scanned)
+		return;
+
+	spin_lock(&mempressure_lock);
+	mempressure_scanned += scanned;
+	mempressure_reclaimed += reclaimed;
+	if (mempressure_scanned < MEMPRESSURE_WINDOW) {
+		spin_unlock(&mempressure_lock);
+		return;
+	}
+
+	level = mempressure_level(mempressure_scanned, mempressure_reclaimed);
+	mempressure_scanned = 0;
+	mempressure_reclaimed = 0;
+	for (l = MEMPRESSURE_LOW; l <= level; l++) {
+		mempressure_seq[l]++;
+		mempressure_last[l] = level;
+	}
+	spin_unlock(&mempressure_lock);
+
+	/*
+	 * Order the sequence update before the wait queue check, pairing
+	 * with the barrier a reader's prepare_to_wait() implies; otherwise a
+	 * reader that has just queued itself may sleep through this event.
+	 */
+	smp_mb();
+	if (waitqueue_active(&mempressure_wait))
+		wake_up_interruptible(&mempressure_wait);
+}
+
+static int mempressure_pending(struct mempressure_reader *reader)
+{
+	return ACCESS_ONCE(mempressure_seq[reader->level]) != reader->seq;
+}
+
+static int mempressure_open(struct inode *inode, struct file *file)
+{
+	struct mempressure_reader *reader;
+	int ret;
+
+	ret = nonseekable_open(inode, file);
+	if (ret)
+		return ret;
+
+	reader = kmalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+
+	spin_lock(&mempressure_lock);
+	reader->level = MEMPRESSURE_LOW;
+	reader->seq = mempressure_seq[reader->level];
+	spin_unlock(&mempressure_lock);
+
+	file->private_data = reader;
+	return 0;
+}
+
+static int mempressure_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t mempressure_read(struct file *file, char __user *buf,
+				size_t count, loff_t *pos)
+{
+	struct mempressure_reader *reader = file->private_data;
+	char line[16];
+	int level, len, ret;
+
+	if (!(file->f_flags & O_NONBLOCK)) {
+		ret = wait_event_interruptible(mempressure_wait,
+					       mempressure_pending(reader));
+		if (ret)
+			return ret;
+	}
+
+	spin_lock(&mempressure_lock);
+	if (mempressure_seq[reader->level] == reader->seq) {
+		spin_unlock(&mempressure_lock);
+		return -EAGAIN;
+	}
+	reader->seq = mempressure_seq[reader->level];
+	level = mempressure_last[reader->level];
+	spin_unlock(&mempressure_lock);
+
+	len = snprintf(line, sizeof(line), "%s\n", mempressure_names[level]);
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, line, len))
+		return -EFAULT;
+
+	return len;
+}
+
+static ssize_t mempressure_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *pos)
+{
+	struct mempressure_reader *reader = file->private_data;
+	char line[16];
+	int level;
+
+	memset(line, 0, sizeof(line));
+	if (count > sizeof(line) - 1)
+		return -EINVAL;
+	if (copy_from_user(line, buf, count))
+		return -EFAULT;
+
+	for (level = MEMPRESSURE_LOW; level < MEMPRESSURE_LEVELS; level++)
+		if (!strcmp(strstrip(line), mempressure_names[level]))
+			break;
+	if (level == MEMPRESSURE_LEVELS)
+		return -EINVAL;
+
+	spin_lock(&mempressure_lock);
+	reader->level = level;
+	reader->seq = mempressure_seq[level];
+	spin_unlock(&mempressure_lock);
+
+	return count;
+}
+
+static unsigned int mempressure_poll(struct file *file, poll_table *wait)
+{
+	struct mempressure_reader *reader = file->private_data;
+
+	poll_wait(file, &mempressure_wait, wait);
+
+	return mempressure_pending(reader) ? POLLIN | POLLRDNORM : 0;
+}
+
+static const struct file_operations mempressure_fops = {
+	.owner = THIS_MODULE,
+	.open = mempressure_open,
+	.release = mempressure_release,
+	.read = mempressure_read,
+	.write = mempressure_write,
+	.poll = mempressure_poll,
+};
+
+static struct miscdevice mempressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "mempressure",
+	.fops = &mempressure_fops,
+};
+
+static int __init mempressure_init(void)
+{
+	return misc_register(&mempressure_misc);
+}
+
+module_param_named(medium, mempressure_medium, uint, S_IRUGO | S_IWUSR);
+module_param_named(critical, mempressure_critical, uint, S_IRUGO | S_IWUSR);
+module_param_named(medium_minfree, mempressure_medium_minfree, uint,
+		   S_IRUGO | S_IWUSR);
+module_param_named(critical_minfree, mempressure_critical_minfree, uint,
+		   S_IRUGO | S_IWUSR);
+
+module_init(mempressure_init);
+
+MODULE_LICENSE("GPL");
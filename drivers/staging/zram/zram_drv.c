@@ -21,11 +21,16 @@
 #include <linux/bitops.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
+#include <linux/hash.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/percpu.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -37,6 +42,15 @@ static struct zram *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static char default_compressor[ZRAM_COMP_NAME_LEN] = "lzo";
+static int dedup = 1;
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+/* Background writeback */
+static struct workqueue_struct *zram_wq;
+/* Backing device reads, kept off zram_wq so they never wait for writeback */
+static struct workqueue_struct *zram_rd_wq;
+#endif
 
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
@@ -56,18 +70,23 @@ static void zram_clear_flag(struct zram *zram, u32 index,
 	zram->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Returns 1 if the page is a single word repeated, which is then
+ * stored in *element. Zero filled pages are the common case.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
 	return 1;
 }
 
@@ -111,7 +130,7 @@ static void zram_ioctl_get_stats(struct zram *zram,
 	size_t succ_writes, mem_used;
 	unsigned int good_compress_perc = 0, no_compress_perc = 0;
 
-	mem_used = xv_get_total_size_bytes(zram->mem_pool)
+	mem_used = zs_get_total_size_bytes(zram->mem_pool)
 			+ (rs->pages_expand << PAGE_SHIFT);
 	succ_writes = zram_stat64_read(zram, &rs->num_writes) -
 			zram_stat64_read(zram, &rs->failed_writes);
@@ -143,39 +162,278 @@ static void zram_ioctl_get_stats(struct zram *zram,
 #endif /* CONFIG_ZRAM_STATS */
 }
 
+/*
+ * Returns the workspace of the current CPU, locked. The caller may
+ * sleep or migrate while holding it; that only costs contention.
+ */
+static struct zram_workspace *zram_get_workspace(struct zram *zram)
+{
+	struct zram_workspace *ws;
+
+	ws = per_cpu_ptr(zram->workspace, raw_smp_processor_id());
+	mutex_lock(&ws->lock);
+
+	return ws;
+}
+
+static void zram_put_workspace(struct zram_workspace *ws)
+{
+	mutex_unlock(&ws->lock);
+}
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static u32 zram_now(void)
+{
+	struct timespec ts;
+
+	ktime_get_ts(&ts);
+	return ts.tv_sec;
+}
+
+static void zram_touch(struct zram *zram, u32 index)
+{
+	zram->table[index].ac_time = zram_now();
+}
+
+/*
+ * Backing device page 0 is never handed out, so that 0 can mean
+ * failure.
+ */
+static unsigned long zram_bd_alloc(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->bd_lock);
+	blk = find_next_zero_bit(zram->bd_map, zram->bd_pages, 1);
+	if (blk < zram->bd_pages)
+		__set_bit(blk, zram->bd_map);
+	else
+		blk = 0;
+	spin_unlock(&zram->bd_lock);
+
+	return blk;
+}
+
+static void zram_bd_free(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->bd_lock);
+	WARN_ON(!test_bit(blk, zram->bd_map));
+	__clear_bit(blk, zram->bd_map);
+	spin_unlock(&zram->bd_lock);
+}
+
+static void zram_bd_end_io(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+/*
+ * Synchronous page I/O on the backing device. Must not be called from
+ * zram_make_request(): bios submitted there are only issued once it
+ * returns.
+ */
+static int zram_bd_rw(struct zram *zram, unsigned long blk,
+			struct page *page, int rw)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(done);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = zram_bd_end_io;
+	bio->bi_private = &done;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+struct zram_bd_read {
+	struct work_struct work;
+	struct zram *zram;
+	unsigned long blk;
+	struct page *page;
+	int ret;
+};
+
+static void zram_bd_read_work(struct work_struct *work)
+{
+	struct zram_bd_read *rd = container_of(work, struct zram_bd_read,
+						work);
+
+	rd->ret = zram_bd_rw(rd->zram, rd->blk, rd->page, READ_SYNC);
+}
+
+/*
+ * Reads for zram_make_request(), which has to hand the I/O off to a
+ * worker and wait for it.
+ */
+static int zram_bd_read(struct zram *zram, unsigned long blk,
+			struct page *page)
+{
+	struct zram_bd_read rd = {
+		.zram = zram,
+		.blk = blk,
+		.page = page,
+	};
+
+	INIT_WORK_ON_STACK(&rd.work, zram_bd_read_work);
+	queue_work(zram_rd_wq, &rd.work);
+	flush_work(&rd.work);
+	destroy_work_on_stack(&rd.work);
+
+	if (!rd.ret)
+		atomic_long_inc(&zram->bd_reads);
+
+	return rd.ret;
+}
+#else
+static inline void zram_touch(struct zram *zram, u32 index) { }
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+static struct hlist_head *zram_hash_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[hash_32(checksum, zram->hash_bits)];
+}
+
+/*
+ * Looks for a stored object with the same content as 'mem' and takes a
+ * reference on it. The candidate is decompressed into the workspace
+ * buffer for comparison, so the caller must hold the workspace.
+ */
+static struct zram_hash *zram_dedup_get(struct zram *zram,
+		struct zram_workspace *ws, void *mem, u32 checksum)
+{
+	struct hlist_node *pos;
+	struct zram_hash *entry, *found = NULL;
+
+	read_lock(&zram->table_lock);
+	hlist_for_each_entry(entry, pos, zram_hash_bucket(zram, checksum),
+				node) {
+		int ret;
+		unsigned int dlen = PAGE_SIZE;
+		unsigned char *cmem;
+
+		if (entry->checksum != checksum)
+			continue;
+
+		cmem = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		ret = crypto_comp_decompress(ws->tfm, cmem, entry->size,
+				ws->buf, &dlen);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (!ret && dlen == PAGE_SIZE &&
+				!memcmp(ws->buf, mem, PAGE_SIZE)) {
+			/* Puts only happen under the write lock */
+			atomic_inc(&entry->refcount);
+			found = entry;
+			break;
+		}
+	}
+	read_unlock(&zram->table_lock);
+
+	return found;
+}
+
+/*
+ * Drops the reference of table entry 'index' on its hashed object.
+ * Returns 1 if other entries still use the object. Called with
+ * table_lock held for writing.
+ */
+static int zram_dedup_put(struct zram *zram, u32 index)
+{
+	struct hlist_node *pos;
+	struct zram_hash *entry;
+	struct table *t = &zram->table[index];
+
+	if (!zram->hash)
+		return 0;
+
+	hlist_for_each_entry(entry, pos, zram_hash_bucket(zram, t->checksum),
+				node) {
+		if (entry->handle != t->handle)
+			continue;
+
+		if (!atomic_dec_and_test(&entry->refcount))
+			return 1;
+
+		hlist_del(&entry->node);
+		kfree(entry);
+		break;
+	}
+
+	/* Objects stored while short of memory were never hashed */
+	return 0;
+}
+
+/*
+ * Called with table_lock held for writing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	unsigned long handle = zram->table[index].handle;
 
-	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
-		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
-			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
-		}
+	/*
+	 * No memory is allocated for zero or same filled pages.
+	 * Simply clear the flag.
+	 */
+	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_clear_flag(zram, index, ZRAM_ZERO);
+		zram_stat_dec(&zram->stats.pages_zero);
 		return;
 	}
 
+	/* Tell a writeback in progress that the page went away */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_SAME)) {
+		zram_clear_flag(zram, index, ZRAM_SAME);
+		zram_stat_dec(&zram->stats.pages_same);
+		zram->table[index].element = 0;
+		return;
+	}
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_bd_free(zram, zram->table[index].blk);
+		atomic_long_dec(&zram->bd_count);
+		zram->table[index].blk = 0;
+		return;
+	}
+#endif
+
+	if (unlikely(!handle))
+		return;
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
+	if (zram_dedup_put(zram, index)) {
+		zram_stat_dec(&zram->stats.pages_dup);
+		zram_stat_dec(&zram->stats.pages_stored);
+		goto clear;
+	}
 
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -183,8 +441,10 @@ out:
 	zram->stats.compr_size -= clen;
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+clear:
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
+	zram->table[index].checksum = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -198,14 +458,26 @@ static void handle_zero_page(struct page *page)
 	flush_dcache_page(page);
 }
 
+static void handle_same_page(struct page *page, unsigned long element)
+{
+	unsigned int pos;
+	unsigned long *user_mem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+}
+
 static void handle_uncompressed_page(struct zram *zram,
 				struct page *page, u32 index)
 {
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -226,21 +498,53 @@ static int zram_read(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
+		unsigned int clen;
 		struct page *page;
-		struct zobj_header *zheader;
+		struct zram_workspace *ws;
 		unsigned char *user_mem, *cmem;
 
 		page = bvec->bv_page;
 
+		read_lock(&zram->table_lock);
+
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			read_unlock(&zram->table_lock);
 			handle_zero_page(page);
 			index++;
 			continue;
 		}
 
+		if (zram_test_flag(zram, index, ZRAM_SAME)) {
+			unsigned long element = zram->table[index].element;
+
+			read_unlock(&zram->table_lock);
+			handle_same_page(page, element);
+			index++;
+			continue;
+		}
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+		if (zram_test_flag(zram, index, ZRAM_WB)) {
+			unsigned long blk = zram->table[index].blk;
+
+			zram_touch(zram, index);
+			read_unlock(&zram->table_lock);
+			if (zram_bd_read(zram, blk, page)) {
+				pr_err("Backing device read failed! page=%u\n",
+					index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+			flush_dcache_page(page);
+			index++;
+			continue;
+		}
+#endif
+
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			read_unlock(&zram->table_lock);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -248,9 +552,12 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+		zram_touch(zram, index);
+
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			read_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
@@ -258,19 +565,21 @@ static int zram_read(struct zram *zram, struct bio *bio)
 		user_mem = kmap_atomic(page, KM_USER0);
 		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+		/* table_lock keeps preemption off, so dtfm is ours */
+		ws = per_cpu_ptr(zram->workspace, smp_processor_id());
+		ret = crypto_comp_decompress(ws->dtfm, cmem,
+			zram->table[index].size, user_mem, &clen);
 
+		zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+
+		read_unlock(&zram->table_lock);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret || clen != PAGE_SIZE)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -301,43 +610,79 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		int ret;
-		u32 offset;
-		size_t clen;
-		struct zobj_header *zheader;
+		int ret, expand = 0;
+		u32 checksum = 0;
+		unsigned int clen;
+		unsigned long element, handle;
+		struct zram_workspace *ws;
+		struct zram_hash *entry = NULL;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
+		 * Compression only needs this CPU's workspace; table_lock is
+		 * taken just to swap the new object into the table, so
+		 * writers on other CPUs compress in parallel.
 		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		ws = zram_get_workspace(zram);
+		src = ws->buf;
 
 		user_mem = kmap_atomic(page, KM_USER0);
-		if (page_zero_filled(user_mem)) {
+		if (page_same_filled(user_mem, &element)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
-			zram_stat_inc(&zram->stats.pages_zero);
-			zram_set_flag(zram, index, ZRAM_ZERO);
+			zram_put_workspace(ws);
+
+			write_lock(&zram->table_lock);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			zram_free_page(zram, index);
+			if (!element) {
+				zram_stat_inc(&zram->stats.pages_zero);
+				zram_set_flag(zram, index, ZRAM_ZERO);
+			} else {
+				zram_stat_inc(&zram->stats.pages_same);
+				zram_set_flag(zram, index, ZRAM_SAME);
+				zram->table[index].element = element;
+			}
+			write_unlock(&zram->table_lock);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		if (zram->hash) {
+			checksum = jhash2((u32 *)user_mem,
+					PAGE_SIZE / sizeof(u32), 0);
+			entry = zram_dedup_get(zram, ws, user_mem, checksum);
+			if (entry) {
+				kunmap_atomic(user_mem, KM_USER0);
+				zram_put_workspace(ws);
+
+				write_lock(&zram->table_lock);
+				zram_free_page(zram, index);
+				zram->table[index].handle = entry->handle;
+				zram->table[index].size = entry->size;
+				zram->table[index].checksum = checksum;
+				zram_touch(zram, index);
+				zram_stat_inc(&zram->stats.pages_dup);
+				zram_stat_inc(&zram->stats.pages_stored);
+				write_unlock(&zram->table_lock);
+				index++;
+				continue;
+			}
+		}
+
+		clen = 2 * PAGE_SIZE;
+		ret = crypto_comp_compress(ws->tfm, user_mem, PAGE_SIZE,
+					src, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zram_put_workspace(ws);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -352,7 +697,7 @@ static int zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zram_put_workspace(ws);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -360,44 +705,59 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
+			expand = 1;
+			handle = (unsigned long)page_store;
 			src = kmap_atomic(page, KM_USER0);
-			goto memstore;
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
+			goto store;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = zs_malloc(zram->mem_pool, clen, GFP_NOIO | __GFP_HIGHMEM);
+		if (!handle) {
+			zram_put_workspace(ws);
 			pr_info("Error allocating memory for compressed "
-				"page: %u, size=%zu\n", index, clen);
+				"page: %u, size=%u\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-#if 0
-		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
+		/* Without a hash entry the object simply is not shared */
+		if (zram->hash) {
+			entry = kmalloc(sizeof(*entry), GFP_NOIO);
+			if (entry) {
+				entry->handle = handle;
+				entry->size = clen;
+				entry->checksum = checksum;
+				atomic_set(&entry->refcount, 1);
+			}
 		}
-#endif
 
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 		memcpy(cmem, src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+store:
+		zram_put_workspace(ws);
+
+		write_lock(&zram->table_lock);
+
+		/* Drop whatever this sector held before */
+		zram_free_page(zram, index);
+
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
+		zram->table[index].checksum = checksum;
+		zram_touch(zram, index);
+		if (unlikely(expand)) {
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		}
+		if (entry)
+			hlist_add_head(&entry->node,
+				zram_hash_bucket(zram, checksum));
 
 		/* Update stats */
 		zram->stats.compr_size += clen;
@@ -405,7 +765,7 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		write_unlock(&zram->table_lock);
 		index++;
 	}
 
@@ -418,6 +778,167 @@ out:
 	return 0;
 }
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+#define ZRAM_WB_HUGE	0x1	/* incompressible pages */
+#define ZRAM_WB_IDLE	0x2	/* pages idle for at least wb_age seconds */
+
+/*
+ * Moves one page to the backing device, using 'page' as bounce buffer.
+ * Returns 1 if the page was written back, 0 if it was not eligible or
+ * could not be decompressed, and a negative error if the backing device
+ * could not take it.
+ */
+static int zram_writeback_slot(struct zram *zram, u32 index,
+			struct page *page, int mode)
+{
+	int ret, eligible;
+	unsigned long blk;
+	unsigned char *user_mem, *cmem;
+
+	write_lock(&zram->table_lock);
+
+	eligible = zram->table[index].handle &&
+		!zram_test_flag(zram, index, ZRAM_ZERO) &&
+		!zram_test_flag(zram, index, ZRAM_SAME) &&
+		!zram_test_flag(zram, index, ZRAM_WB) &&
+		!zram_test_flag(zram, index, ZRAM_UNDER_WB);
+	if (eligible)
+		eligible = ((mode & ZRAM_WB_HUGE) &&
+			zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) ||
+			((mode & ZRAM_WB_IDLE) && zram->wb_age &&
+			zram_now() - zram->table[index].ac_time >=
+				zram->wb_age);
+	if (!eligible) {
+		write_unlock(&zram->table_lock);
+		return 0;
+	}
+
+	zram_set_flag(zram, index, ZRAM_UNDER_WB);
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+		cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+		memcpy(user_mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		ret = 0;
+	} else {
+		unsigned int clen = PAGE_SIZE;
+		struct zram_workspace *ws;
+
+		cmem = zs_map_object(zram->mem_pool,
+				zram->table[index].handle, ZS_MM_RO);
+		ws = per_cpu_ptr(zram->workspace, smp_processor_id());
+		ret = crypto_comp_decompress(ws->dtfm, cmem,
+				zram->table[index].size, user_mem, &clen);
+		zs_unmap_object(zram->mem_pool, zram->table[index].handle);
+		if (!ret && clen != PAGE_SIZE)
+			ret = -EINVAL;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (ret) {
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->table_lock);
+		/* Leave the slot in RAM, its reads will report the error */
+		pr_err("Decompression for writeback failed! err=%d, page=%u\n",
+			ret, index);
+		return 0;
+	}
+	write_unlock(&zram->table_lock);
+
+	blk = zram_bd_alloc(zram);
+	if (!blk) {
+		ret = -ENOSPC;
+		goto fail;
+	}
+
+	ret = zram_bd_rw(zram, blk, page, WRITE);
+	if (ret)
+		goto fail;
+
+	write_lock(&zram->table_lock);
+	/* Rewritten or freed while we were writing it out */
+	if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+		write_unlock(&zram->table_lock);
+		zram_bd_free(zram, blk);
+		return 0;
+	}
+
+	zram_free_page(zram, index);
+	zram->table[index].blk = blk;
+	zram_set_flag(zram, index, ZRAM_WB);
+	atomic_long_inc(&zram->bd_count);
+	atomic_long_inc(&zram->bd_writes);
+	write_unlock(&zram->table_lock);
+
+	return 1;
+
+fail:
+	write_lock(&zram->table_lock);
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	write_unlock(&zram->table_lock);
+	if (blk)
+		zram_bd_free(zram, blk);
+	return ret;
+}
+
+/*
+ * Writes back the pages selected by 'mode'. Returns the number of
+ * pages written or a negative error. Called with init_lock held.
+ */
+static long zram_writeback(struct zram *zram, int mode)
+{
+	int ret = 0;
+	long count = 0;
+	u32 index;
+	struct page *page;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		ret = zram_writeback_slot(zram, index, page, mode);
+		if (ret < 0)
+			break;
+		count += ret;
+		cond_resched();
+	}
+
+	__free_page(page);
+
+	/* A full backing device is not an error for what was written */
+	if (ret < 0 && (ret != -ENOSPC || !count))
+		return ret;
+	return count;
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work.work);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done && zram->bdev && zram->wb_age) {
+		zram_writeback(zram, ZRAM_WB_HUGE | ZRAM_WB_IDLE);
+		queue_delayed_work(zram_wq, &zram->wb_work,
+				zram->wb_age * HZ);
+	}
+	mutex_unlock(&zram->init_lock);
+}
+
+static void zram_bd_close(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	close_bdev_exclusive(zram->bdev, FMODE_READ | FMODE_WRITE);
+	vfree(zram->bd_map);
+	zram->bdev = NULL;
+	zram->bd_map = NULL;
+	zram->bd_pages = 0;
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
 /*
  * Check if request is within bounds and page aligned.
  */
@@ -467,6 +988,60 @@ static int zram_make_request(struct request_queue *queue, struct bio *bio)
 	return ret;
 }
 
+static void free_workspaces(struct zram *zram)
+{
+	int cpu;
+
+	if (!zram->workspace)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		struct zram_workspace *ws = per_cpu_ptr(zram->workspace, cpu);
+
+		if (ws->tfm)
+			crypto_free_comp(ws->tfm);
+		if (ws->dtfm)
+			crypto_free_comp(ws->dtfm);
+		free_pages((unsigned long)ws->buf, 1);
+	}
+
+	free_percpu(zram->workspace);
+	zram->workspace = NULL;
+}
+
+static int alloc_workspaces(struct zram *zram)
+{
+	int cpu;
+
+	/* Zeroed, so a partial failure is undone by free_workspaces() */
+	zram->workspace = alloc_percpu(struct zram_workspace);
+	if (!zram->workspace)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct crypto_comp *tfm;
+		struct zram_workspace *ws = per_cpu_ptr(zram->workspace, cpu);
+
+		mutex_init(&ws->lock);
+
+		tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		ws->tfm = tfm;
+
+		tfm = crypto_alloc_comp(zram->compressor, 0, 0);
+		if (IS_ERR(tfm))
+			return PTR_ERR(tfm);
+		ws->dtfm = tfm;
+
+		ws->buf = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+		if (!ws->buf)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static void reset_device(struct zram *zram)
 {
 	size_t index;
@@ -475,33 +1050,26 @@ static void reset_device(struct zram *zram)
 	zram->init_done = 0;
 
 	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	free_workspaces(zram);
 
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
+	/* Initialization may have failed before the table was allocated */
+	if (!zram->table)
+		zram->disksize = 0;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	/*
+	 * Free all pages that are still in this zram device. Shared
+	 * objects have to go through the hash, so take the normal path.
+	 */
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+		zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	vfree(zram->hash);
+	zram->hash = NULL;
+
+	zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -522,17 +1090,10 @@ static int zram_ioctl_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	ret = alloc_workspaces(zram);
+	if (ret) {
+		pr_err("Error allocating %s compressor workspaces!\n",
+			zram->compressor);
 		goto fail;
 	}
 
@@ -547,12 +1108,27 @@ static int zram_ioctl_init_device(struct zram *zram)
 	}
 	memset(zram->table, 0, num_pages * sizeof(*zram->table));
 
+	if (dedup) {
+		size_t i;
+
+		/* About one bucket per eight pages */
+		zram->hash_bits = ilog2(max_t(size_t, num_pages >> 3, 64));
+		zram->hash = vmalloc(sizeof(*zram->hash) << zram->hash_bits);
+		if (!zram->hash) {
+			pr_err("Error allocating zram dedup table\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+		for (i = 0; i < 1 << zram->hash_bits; i++)
+			INIT_HLIST_HEAD(&zram->hash[i]);
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -561,6 +1137,12 @@ static int zram_ioctl_init_device(struct zram *zram)
 
 	zram->init_done = 1;
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (zram->bdev && zram->wb_age)
+		queue_delayed_work(zram_wq, &zram->wb_work,
+				zram->wb_age * HZ);
+#endif
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -623,8 +1205,32 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case ZRAMIO_SET_COMPRESSOR:
+	{
+		char name[ZRAM_COMP_NAME_LEN];
+
+		if (zram->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(name, (void *)arg, sizeof(name))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		name[sizeof(name) - 1] = '\0';
+		if (!crypto_has_comp(name, 0, 0)) {
+			pr_info("Compressor %s not available\n", name);
+			ret = -EINVAL;
+			goto out;
+		}
+		strcpy(zram->compressor, name);
+		pr_info("Compressor set to %s\n", name);
+		break;
+	}
 	case ZRAMIO_INIT:
+		mutex_lock(&zram->init_lock);
 		ret = zram_ioctl_init_device(zram);
+		mutex_unlock(&zram->init_lock);
 		break;
 
 	case ZRAMIO_RESET:
@@ -638,7 +1244,9 @@ static int zram_ioctl(struct block_device *bdev, fmode_t mode,
 		if (bdev)
 			fsync_bdev(bdev);
 
+		mutex_lock(&zram->init_lock);
 		ret = zram_ioctl_reset_device(zram);
+		mutex_unlock(&zram->init_lock);
 		break;
 
 	default:
@@ -655,7 +1263,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->table_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->table_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -665,12 +1275,335 @@ static const struct block_device_operations zram_devops = {
 	.owner = THIS_MODULE
 };
 
+static struct zram *dev_to_zram(struct device *dev)
+{
+	return dev_to_disk(dev)->private_data;
+}
+
+static ssize_t compressor_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%s\n", dev_to_zram(dev)->compressor);
+}
+
+#if defined(CONFIG_ZRAM_STATS)
+static ssize_t pages_same_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_zram(dev)->stats.pages_same);
+}
+
+static ssize_t pages_dup_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_zram(dev)->stats.pages_dup);
+}
+#endif
+
+/*
+ * Allocator statistics. Fragmentation is the memory held in free
+ * slots of partially used zspages, relative to mem_used_total.
+ */
+static ssize_t zs_stat_show(struct device *dev, char *buf, int field)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct zs_pool_stats stats;
+	u64 val = 0;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		zs_get_stats(zram->mem_pool, &stats);
+		switch (field) {
+		case 0:
+			val = stats.pages_allocated << PAGE_SHIFT;
+			break;
+		case 1:
+			val = stats.obj_allocated;
+			break;
+		case 2:
+			val = stats.obj_free;
+			break;
+		case 3:
+			val = stats.pages_compacted;
+			break;
+		}
+	}
+	mutex_unlock(&zram->init_lock);
+
+	return sprintf(buf, "%llu\n", val);
+}
+
+static ssize_t mem_used_total_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return zs_stat_show(dev, buf, 0);
+}
+
+static ssize_t mem_obj_allocated_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return zs_stat_show(dev, buf, 1);
+}
+
+static ssize_t mem_fragmented_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return zs_stat_show(dev, buf, 2);
+}
+
+static ssize_t pages_compacted_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return zs_stat_show(dev, buf, 3);
+}
+
+static ssize_t compact_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long freed;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done) {
+		mutex_unlock(&zram->init_lock);
+		return -EINVAL;
+	}
+	freed = zs_compact(zram->mem_pool);
+	mutex_unlock(&zram->init_lock);
+
+	pr_debug("Compaction freed %lu pages\n", freed);
+	return len;
+}
+
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static ssize_t backing_dev_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	struct zram *zram = dev_to_zram(dev);
+	char name[BDEVNAME_SIZE];
+	ssize_t ret;
+
+	mutex_lock(&zram->init_lock);
+	if (zram->bdev)
+		ret = sprintf(buf, "%s\n", bdevname(zram->bdev, name));
+	else
+		ret = sprintf(buf, "none\n");
+	mutex_unlock(&zram->init_lock);
+
+	return ret;
+}
+
+/*
+ * Takes the path of a block device, or "none". Only allowed while the
+ * zram device is not initialized.
+ */
+static ssize_t backing_dev_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	struct block_device *bdev;
+	unsigned long *map = NULL;
+	unsigned long pages = 0;
+	char *path;
+	ssize_t ret = len;
+
+	path = kstrndup(buf, PATH_MAX, GFP_KERNEL);
+	if (!path)
+		return -ENOMEM;
+	strim(path);
+
+	mutex_lock(&zram->init_lock);
+	if (zram->init_done) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	zram_bd_close(zram);
+	if (!strcmp(path, "none") || !*path)
+		goto out;
+
+	bdev = open_bdev_exclusive(path, FMODE_READ | FMODE_WRITE, zram);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		goto out;
+	}
+
+	pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (pages > 1)
+		map = vmalloc(BITS_TO_LONGS(pages) * sizeof(long));
+	if (!map) {
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		ret = pages > 1 ? -ENOMEM : -EINVAL;
+		goto out;
+	}
+	memset(map, 0, BITS_TO_LONGS(pages) * sizeof(long));
+
+	zram->bdev = bdev;
+	zram->bd_map = map;
+	zram->bd_pages = pages;
+	pr_info("Backing device set to %s, %lu pages\n", path, pages);
+
+out:
+	mutex_unlock(&zram->init_lock);
+	kfree(path);
+	return ret;
+}
+
+/*
+ * "huge" writes back incompressible pages, "idle" the ones not accessed
+ * for writeback_age seconds, and "all" both.
+ */
+static ssize_t writeback_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	long ret;
+	int mode;
+
+	if (sysfs_streq(buf, "huge"))
+		mode = ZRAM_WB_HUGE;
+	else if (sysfs_streq(buf, "idle"))
+		mode = ZRAM_WB_IDLE;
+	else if (sysfs_streq(buf, "all"))
+		mode = ZRAM_WB_HUGE | ZRAM_WB_IDLE;
+	else
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	if (!zram->init_done || !zram->bdev)
+		ret = -EINVAL;
+	else if ((mode & ZRAM_WB_IDLE) && !zram->wb_age)
+		ret = -EINVAL;
+	else
+		ret = zram_writeback(zram, mode);
+	mutex_unlock(&zram->init_lock);
+
+	if (ret < 0)
+		return ret;
+
+	pr_debug("Wrote back %ld pages\n", ret);
+	return len;
+}
+
+static ssize_t writeback_age_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", dev_to_zram(dev)->wb_age);
+}
+
+/*
+ * A non-zero age also writes back incompressible and idle pages in the
+ * background every 'age' seconds.
+ */
+static ssize_t writeback_age_store(struct device *dev,
+		struct device_attribute *attr, const char *buf, size_t len)
+{
+	struct zram *zram = dev_to_zram(dev);
+	unsigned long age;
+
+	if (strict_strtoul(buf, 10, &age) || age > UINT_MAX / HZ)
+		return -EINVAL;
+
+	mutex_lock(&zram->init_lock);
+	zram->wb_age = age;
+	if (age && zram->init_done && zram->bdev)
+		queue_delayed_work(zram_wq, &zram->wb_work, age * HZ);
+	mutex_unlock(&zram->init_lock);
+
+	return len;
+}
+
+static ssize_t bd_count_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&dev_to_zram(dev)->bd_count));
+}
+
+static ssize_t bd_reads_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&dev_to_zram(dev)->bd_reads));
+}
+
+static ssize_t bd_writes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%ld\n",
+		atomic_long_read(&dev_to_zram(dev)->bd_writes));
+}
+
+static ssize_t bd_written_bytes_show(struct device *dev,
+		struct device_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%llu\n",
+		(u64)atomic_long_read(&dev_to_zram(dev)->bd_writes)
+			<< PAGE_SHIFT);
+}
+#endif /* CONFIG_ZRAM_WRITEBACK */
+
+static DEVICE_ATTR(compressor, S_IRUGO, compressor_show, NULL);
+#if defined(CONFIG_ZRAM_STATS)
+static DEVICE_ATTR(pages_same, S_IRUGO, pages_same_show, NULL);
+static DEVICE_ATTR(pages_dup, S_IRUGO, pages_dup_show, NULL);
+#endif
+static DEVICE_ATTR(mem_used_total, S_IRUGO, mem_used_total_show, NULL);
+static DEVICE_ATTR(mem_obj_allocated, S_IRUGO, mem_obj_allocated_show, NULL);
+static DEVICE_ATTR(mem_fragmented, S_IRUGO, mem_fragmented_show, NULL);
+static DEVICE_ATTR(pages_compacted, S_IRUGO, pages_compacted_show, NULL);
+static DEVICE_ATTR(compact, S_IWUSR, NULL, compact_store);
+#if defined(CONFIG_ZRAM_WRITEBACK)
+static DEVICE_ATTR(backing_dev, S_IRUGO | S_IWUSR,
+		backing_dev_show, backing_dev_store);
+static DEVICE_ATTR(writeback, S_IWUSR, NULL, writeback_store);
+static DEVICE_ATTR(writeback_age, S_IRUGO | S_IWUSR,
+		writeback_age_show, writeback_age_store);
+static DEVICE_ATTR(bd_count, S_IRUGO, bd_count_show, NULL);
+static DEVICE_ATTR(bd_reads, S_IRUGO, bd_reads_show, NULL);
+static DEVICE_ATTR(bd_writes, S_IRUGO, bd_writes_show, NULL);
+static DEVICE_ATTR(bd_written_bytes, S_IRUGO, bd_written_bytes_show, NULL);
+#endif
+
+static struct attribute *zram_disk_attrs[] = {
+	&dev_attr_compressor.attr,
+#if defined(CONFIG_ZRAM_STATS)
+	&dev_attr_pages_same.attr,
+	&dev_attr_pages_dup.attr,
+#endif
+	&dev_attr_mem_used_total.attr,
+	&dev_attr_mem_obj_allocated.attr,
+	&dev_attr_mem_fragmented.attr,
+	&dev_attr_pages_compacted.attr,
+	&dev_attr_compact.attr,
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	&dev_attr_backing_dev.attr,
+	&dev_attr_writeback.attr,
+	&dev_attr_writeback_age.attr,
+	&dev_attr_bd_count.attr,
+	&dev_attr_bd_reads.attr,
+	&dev_attr_bd_writes.attr,
+	&dev_attr_bd_written_bytes.attr,
+#endif
+	NULL,
+};
+
+static struct attribute_group zram_disk_attr_group = {
+	.attrs = zram_disk_attrs,
+};
+
 static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
+	mutex_init(&zram->init_lock);
+	rwlock_init(&zram->table_lock);
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	spin_lock_init(&zram->bd_lock);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+#endif
 	spin_lock_init(&zram->stat64_lock);
+	strcpy(zram->compressor, default_compressor);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -714,6 +1647,17 @@ static int create_device(struct zram *zram, int device_id)
 
 	add_disk(zram->disk);
 
+	ret = sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
+				&zram_disk_attr_group);
+	if (ret < 0) {
+		pr_warning("Error creating sysfs group for device %d\n",
+			device_id);
+		del_gendisk(zram->disk);
+		put_disk(zram->disk);
+		blk_cleanup_queue(zram->queue);
+		goto out;
+	}
+
 	zram->init_done = 0;
 
 out:
@@ -723,6 +1667,8 @@ out:
 static void destroy_device(struct zram *zram)
 {
 	if (zram->disk) {
+		sysfs_remove_group(&disk_to_dev(zram->disk)->kobj,
+				&zram_disk_attr_group);
 		del_gendisk(zram->disk);
 		put_disk(zram->disk);
 	}
@@ -742,11 +1688,24 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	zram_wq = create_workqueue("zram");
+	if (!zram_wq) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	zram_rd_wq = alloc_workqueue("zram_rd", WQ_UNBOUND | WQ_RESCUER, 0);
+	if (!zram_rd_wq) {
+		ret = -ENOMEM;
+		goto destroy_wq;
+	}
+#endif
+
 	zram_major = register_blkdev(0, "zram");
 	if (zram_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto destroy_wq;
 	}
 
 	if (!num_devices) {
@@ -776,6 +1735,12 @@ free_devices:
 	kfree(devices);
 unregister:
 	unregister_blkdev(zram_major, "zram");
+destroy_wq:
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	if (zram_rd_wq)
+		destroy_workqueue(zram_rd_wq);
+	destroy_workqueue(zram_wq);
+#endif
 out:
 	return ret;
 }
@@ -789,11 +1754,21 @@ static void __exit zram_exit(void)
 		zram = &devices[i];
 
 		destroy_device(zram);
+#if defined(CONFIG_ZRAM_WRITEBACK)
+		cancel_delayed_work_sync(&zram->wb_work);
+#endif
 		if (zram->init_done)
 			reset_device(zram);
+#if defined(CONFIG_ZRAM_WRITEBACK)
+		zram_bd_close(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	destroy_workqueue(zram_rd_wq);
+	destroy_workqueue(zram_wq);
+#endif
 
 	kfree(devices);
 	pr_debug("Cleanup done!\n");
@@ -802,6 +1777,14 @@ static void __exit zram_exit(void)
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of zram devices");
 
+module_param_string(compressor, default_compressor,
+			sizeof(default_compressor), 0);
+MODULE_PARM_DESC(compressor, "Default crypto compressor, e.g. lzo, deflate");
+
+module_param(dedup, bool, 0644);
+MODULE_PARM_DESC(dedup, "Share identical pages within a device "
+			"(applies at device init)");
+
 module_init(zram_init);
 module_exit(zram_exit);
 
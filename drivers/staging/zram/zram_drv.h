@@ -17,9 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/crypto.h>
+#include <linux/workqueue.h>
 
 #include "zram_ioctl.h"
-#include "xvmalloc.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -27,18 +29,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -52,8 +42,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -71,6 +61,15 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is one repeated non-zero word, kept in table.element */
+	ZRAM_SAME,
+
+	/* Page is on the backing device, at page table.blk */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -78,12 +77,34 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* zsmalloc object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED pages */
+		unsigned long element;	/* ZRAM_SAME pages */
+		unsigned long blk;	/* ZRAM_WB pages */
+	};
+	u16 size;	/* compressed size */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
+	u32 checksum;	/* content hash of compressed pages */
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	u32 ac_time;	/* last access, monotonic seconds */
+#endif
 } __attribute__((aligned(4)));
 
+/*
+ * Compressed objects are entered in a per-device hash table keyed by
+ * the checksum of their uncompressed content, so that sectors written
+ * with identical data share one object.
+ */
+struct zram_hash {
+	struct hlist_node node;
+	unsigned long handle;
+	u16 size;
+	u32 checksum;
+	atomic_t refcount;	/* table entries pointing at this object */
+};
+
 struct zram_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
@@ -97,29 +118,59 @@ struct zram_stats {
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of pages of one repeated word */
+	u32 pages_dup;		/* no. of pages sharing a stored object */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
 #endif
 };
 
+/*
+ * Compression working memory. There is one per possible CPU so that
+ * writers running on different CPUs compress concurrently.
+ */
+struct zram_workspace {
+	struct mutex lock;	/* held from compression until the output
+				 * has been copied out of 'buf' */
+	struct crypto_comp *tfm;	/* used under 'lock' */
+	struct crypto_comp *dtfm;	/* reads, with preemption off */
+	void *buf;		/* compressed output, two pages */
+};
+
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zram_workspace __percpu *workspace;
 	struct table *table;
+	struct hlist_head *hash;	/* NULL if dedup is disabled */
+	unsigned int hash_bits;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t table_lock;	/* protect table entries, the hash and
+				 * the page counters in stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
+	struct mutex init_lock;	/* serialize init, reset and compaction */
 	int init_done;
+	char compressor[ZRAM_COMP_NAME_LEN];
 	/*
 	 * This is the limit on amount of *uncompressed* worth of data
 	 * we can store in a disk.
 	 */
 	size_t disksize;	/* bytes */
 
+#if defined(CONFIG_ZRAM_WRITEBACK)
+	/* Backing device for incompressible and idle pages */
+	struct block_device *bdev;
+	unsigned long *bd_map;	/* used backing device pages */
+	unsigned long bd_pages;
+	spinlock_t bd_lock;	/* protect bd_map */
+	unsigned int wb_age;	/* seconds; 0 disables background writeback */
+	struct delayed_work wb_work;
+	atomic_long_t bd_count;	/* pages currently on the backing device */
+	atomic_long_t bd_reads;
+	atomic_long_t bd_writes;
+#endif
+
 	struct zram_stats stats;
 };
 
@@ -33,9 +33,12 @@ struct zram_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+#define ZRAM_COMP_NAME_LEN	32	/* including the terminating NUL */
+
 #define ZRAMIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define ZRAMIO_GET_STATS	_IOR('z', 1, struct zram_ioctl_stats)
 #define ZRAMIO_INIT		_IO('z', 2)
 #define ZRAMIO_RESET		_IO('z', 3)
+#define ZRAMIO_SET_COMPRESSOR	_IOW('z', 4, char[ZRAM_COMP_NAME_LEN])
 
 #endif
@@ -0,0 +1,533 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Objects are grouped in size classes ZS_SIZE_CLASS_DELTA bytes apart.
+ * Each class carves zspages - groups of up to ZS_MAX_PAGES_PER_ZSPAGE
+ * pages - into equal slots, packed back to back across page
+ * boundaries, so the per-object waste is bounded by the class delta
+ * instead of by what is left over at the end of a page.
+ *
+ * Callers hold handles, not addresses. A handle stays valid while its
+ * object is moved, which is what zs_compact() does to empty sparsely
+ * used zspages and give their pages back.
+ */
+
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/bit_spinlock.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static struct size_class *get_size_class(struct zs_pool *pool, size_t size)
+{
+	unsigned int idx = 0;
+
+	if (size > ZS_MIN_ALLOC_SIZE)
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return &pool->classes[idx];
+}
+
+/*
+ * Pick the zspage size that wastes the least space at the end for
+ * objects of the given size.
+ */
+static unsigned int get_pages_per_zspage(unsigned int size)
+{
+	unsigned int i, best = 1, best_usage = 0;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		unsigned int zspage_size = i * PAGE_SIZE;
+		unsigned int usage;
+
+		usage = (zspage_size / size) * size * 100 / zspage_size;
+		if (usage > best_usage) {
+			best_usage = usage;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * Copy between 'buf' and the zspage area at 'offset', mapping one page
+ * at a time.
+ */
+static void zs_copy(struct zspage *zspage, unsigned int offset, void *buf,
+			unsigned int len, int to_zspage, enum km_type type)
+{
+	while (len) {
+		unsigned int pg = offset >> PAGE_SHIFT;
+		unsigned int pg_off = offset & ~PAGE_MASK;
+		unsigned int n = min_t(unsigned int, len, PAGE_SIZE - pg_off);
+		char *addr;
+
+		addr = kmap_atomic(zspage->pages[pg], type);
+		if (to_zspage)
+			memcpy(addr + pg_off, buf, n);
+		else
+			memcpy(buf, addr + pg_off, n);
+		kunmap_atomic(addr, type);
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+			struct size_class *class, gfp_t flags)
+{
+	unsigned int i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage), flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	zspage->class = class;
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+
+fail:
+	while (i)
+		__free_page(zspage->pages[--i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	unsigned int i;
+
+	for (i = 0; i < zspage->class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(zspage->class->pages_per_zspage,
+			&pool->pages_allocated);
+
+	kfree(zspage);
+}
+
+/*
+ * Takes a free slot of a zspage on the class partial list.
+ * Called with class->lock held.
+ */
+static unsigned int obj_alloc(struct size_class *class, struct zspage *zspage)
+{
+	unsigned int idx;
+
+	idx = find_first_zero_bit(zspage->used_map, class->objs_per_zspage);
+	__set_bit(idx, zspage->used_map);
+	zspage->inuse++;
+	class->objs_inuse++;
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->full);
+
+	return idx;
+}
+
+/*
+ * Returns 1 if the zspage became empty; it is then off the class lists
+ * and the caller frees it after dropping class->lock.
+ * Called with class->lock held.
+ */
+static int obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned int idx)
+{
+	BUG_ON(!test_bit(idx, zspage->used_map));
+
+	if (zspage->inuse == class->objs_per_zspage)
+		list_move(&zspage->list, &class->partial);
+
+	__clear_bit(idx, zspage->used_map);
+	zspage->inuse--;
+	class->objs_inuse--;
+
+	if (zspage->inuse)
+		return 0;
+
+	list_del(&zspage->list);
+	class->zspages--;
+	return 1;
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: flags for the pages and metadata that may be allocated
+ *
+ * Returns a handle for the object, or 0 on failure.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned int idx;
+	struct zs_handle *handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = kmalloc(sizeof(*handle), flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+	handle->lock = 0;
+
+	class = get_size_class(pool, size + ZS_HANDLE_SIZE);
+
+	spin_lock(&class->lock);
+	if (list_empty(&class->partial)) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (!zspage) {
+			kfree(handle);
+			return 0;
+		}
+		spin_lock(&class->lock);
+		list_add(&zspage->list, &class->partial);
+		class->zspages++;
+	}
+
+	zspage = list_first_entry(&class->partial, struct zspage, list);
+	idx = obj_alloc(class, zspage);
+
+	handle->zspage = zspage;
+	handle->idx = idx;
+
+	/* Back-pointer for compaction */
+	zs_copy(zspage, idx * class->size, &handle, ZS_HANDLE_SIZE, 1,
+		KM_USER1);
+	spin_unlock(&class->lock);
+
+	return (unsigned long)handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/*
+ * Free object identified by handle
+ */
+void zs_free(struct zs_pool *pool, unsigned long obj)
+{
+	int empty;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	/* Keeps zs_compact() from moving the object under us */
+	bit_spin_lock(ZS_HANDLE_LOCK, &handle->lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	empty = obj_free(class, zspage, handle->idx);
+	spin_unlock(&class->lock);
+	bit_spin_unlock(ZS_HANDLE_LOCK, &handle->lock);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kfree(handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of an allocated object
+ * @pool: pool the object was allocated from
+ * @obj: handle returned by zs_malloc
+ * @mm: what the caller is going to do with the object
+ *
+ * The object stays put and preemption is disabled until it is unmapped
+ * with zs_unmap_object(). Objects spanning two pages are copied through
+ * a per-CPU buffer.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long obj,
+			enum zs_mapmode mm)
+{
+	unsigned int offset, len, pg_off;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+
+	bit_spin_lock(ZS_HANDLE_LOCK, &handle->lock);
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	offset = handle->idx * class->size + ZS_HANDLE_SIZE;
+	len = class->size - ZS_HANDLE_SIZE;
+	pg_off = offset & ~PAGE_MASK;
+
+	area = this_cpu_ptr(pool->map_area);
+	area->mode = mm;
+
+	if (pg_off + len <= PAGE_SIZE) {
+		area->spanning = 0;
+		area->vaddr = kmap_atomic(zspage->pages[offset >> PAGE_SHIFT],
+				KM_USER1);
+		return area->vaddr + pg_off;
+	}
+
+	area->spanning = 1;
+	if (mm != ZS_MM_WO)
+		zs_copy(zspage, offset, area->buf, len, 0, KM_USER1);
+
+	return area->buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long obj)
+{
+	unsigned int offset, len;
+	struct zs_handle *handle = (struct zs_handle *)obj;
+	struct size_class *class;
+	struct zs_map_area *area;
+	struct zspage *zspage;
+
+	zspage = handle->zspage;
+	class = zspage->class;
+
+	offset = handle->idx * class->size + ZS_HANDLE_SIZE;
+	len = class->size - ZS_HANDLE_SIZE;
+
+	area = this_cpu_ptr(pool->map_area);
+	if (!area->spanning)
+		kunmap_atomic(area->vaddr, KM_USER1);
+	else if (area->mode != ZS_MM_RO)
+		zs_copy(zspage, offset, area->buf, len, 1, KM_USER1);
+
+	bit_spin_unlock(ZS_HANDLE_LOCK, &handle->lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/*
+ * Moves objects from the least used partial zspage of the class into
+ * the most used one, until the former is empty or the latter is full.
+ * Returns the emptied zspage, if any, for the caller to free, or
+ * ERR_PTR(-EAGAIN) if no further progress is possible.
+ */
+static struct zspage *compact_one(struct size_class *class, void *buf)
+{
+	unsigned int nr = 0, free_slots = 0, idx;
+	struct zspage *zspage, *src = NULL, *dst = NULL;
+
+	spin_lock(&class->lock);
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		nr++;
+		free_slots += class->objs_per_zspage - zspage->inuse;
+		if (!src || zspage->inuse < src->inuse)
+			src = zspage;
+	}
+
+	list_for_each_entry(zspage, &class->partial, list) {
+		if (zspage != src && (!dst || zspage->inuse > dst->inuse))
+			dst = zspage;
+	}
+
+	/* Only worth it if a whole zspage worth of slots is free */
+	if (nr < 2 || free_slots < class->objs_per_zspage) {
+		spin_unlock(&class->lock);
+		return ERR_PTR(-EAGAIN);
+	}
+
+	for_each_set_bit(idx, src->used_map, class->objs_per_zspage) {
+		struct zs_handle *handle;
+		unsigned int didx;
+
+		zs_copy(src, idx * class->size, &handle, ZS_HANDLE_SIZE, 0,
+			KM_USER0);
+
+		/* Mapped or being freed: leave this zspage alone */
+		if (!bit_spin_trylock(ZS_HANDLE_LOCK, &handle->lock))
+			break;
+
+		didx = obj_alloc(class, dst);
+		zs_copy(src, idx * class->size, buf, class->size, 0, KM_USER0);
+		zs_copy(dst, didx * class->size, buf, class->size, 1, KM_USER0);
+		handle->zspage = dst;
+		handle->idx = didx;
+		bit_spin_unlock(ZS_HANDLE_LOCK, &handle->lock);
+
+		if (obj_free(class, src, idx)) {
+			spin_unlock(&class->lock);
+			return src;
+		}
+		if (dst->inuse == class->objs_per_zspage)
+			break;
+	}
+
+	/* dst filled up and left the partial list: try another pair */
+	zspage = dst->inuse == class->objs_per_zspage ? NULL : ERR_PTR(-EAGAIN);
+	spin_unlock(&class->lock);
+
+	return zspage;
+}
+
+/**
+ * zs_compact - release pages held by sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Objects that are mapped at the time are skipped. Returns the number
+ * of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	void *buf;
+	unsigned long freed = 0;
+
+	buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+	if (!buf)
+		return 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		struct zspage *zspage;
+
+		for (;;) {
+			zspage = compact_one(class, buf);
+			if (IS_ERR(zspage))
+				break;
+			if (zspage) {
+				freed += class->pages_per_zspage;
+				free_zspage(pool, zspage);
+			}
+			cond_resched();
+		}
+	}
+
+	kfree(buf);
+	atomic_long_add(freed, &pool->pages_compacted);
+
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+static void free_map_areas(struct zs_pool *pool)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+	free_percpu(pool->map_area);
+}
+
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+
+		spin_lock_init(&class->lock);
+		INIT_LIST_HEAD(&class->partial);
+		INIT_LIST_HEAD(&class->full);
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage * PAGE_SIZE /
+					class->size;
+	}
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail_areas;
+	}
+
+	return pool;
+
+fail_areas:
+	free_map_areas(pool);
+fail:
+	kfree(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		struct zspage *zspage, *tmp;
+
+		if (class->zspages)
+			pr_info("zsmalloc: freeing %lu zspages still in use "
+				"in class %u\n", class->zspages, class->size);
+
+		list_splice_init(&class->full, &class->partial);
+		list_for_each_entry_safe(zspage, tmp, &class->partial, list)
+			free_zspage(pool, zspage);
+	}
+
+	free_map_areas(pool);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->classes[i];
+		unsigned long objs;
+
+		spin_lock(&class->lock);
+		objs = class->zspages * class->objs_per_zspage;
+		stats->obj_allocated += (u64)class->objs_inuse * class->size;
+		stats->obj_free += (u64)(objs - class->objs_inuse) * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	stats->pages_allocated = atomic_long_read(&pool->pages_allocated);
+	stats->pages_compacted = atomic_long_read(&pool->pages_compacted);
+}
+EXPORT_SYMBOL_GPL(zs_get_stats);
@@ -0,0 +1,51 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_H_
+#define _ZS_MALLOC_H_
+
+#include <linux/types.h>
+
+/*
+ * Objects are referred to by opaque handles and must be mapped to be
+ * accessed. Only one object may be mapped at a time per CPU, and the
+ * caller must not sleep until it is unmapped.
+ */
+enum zs_mapmode {
+	ZS_MM_RW,	/* read and write the object */
+	ZS_MM_RO,	/* read only */
+	ZS_MM_WO,	/* write only, object contents are not read in */
+};
+
+struct zs_pool;
+
+struct zs_pool_stats {
+	u64 pages_allocated;	/* pages backing the pool */
+	u64 obj_allocated;	/* bytes in allocated objects */
+	u64 obj_free;		/* bytes in free slots of zspages */
+	u64 pages_compacted;	/* pages released by zs_compact() */
+};
+
+struct zs_pool *zs_create_pool(void);
+void zs_destroy_pool(struct zs_pool *pool);
+
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags);
+void zs_free(struct zs_pool *pool, unsigned long handle);
+
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm);
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle);
+
+unsigned long zs_compact(struct zs_pool *pool);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool);
+void zs_get_stats(struct zs_pool *pool, struct zs_pool_stats *stats);
+
+#endif
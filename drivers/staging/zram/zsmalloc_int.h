@@ -0,0 +1,96 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * Every object starts with a back-pointer to its handle so compaction
+ * can find and update the handle of an object it moves.
+ */
+#define ZS_HANDLE_SIZE		sizeof(unsigned long)
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes. It must be
+ * a multiple of ZS_HANDLE_SIZE so that a handle back-pointer never
+ * straddles two pages.
+ */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is a group of up to this many 0-order pages over which the
+ * objects of one class are packed back to back, so an object may span
+ * two pages.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+#define ZS_MAX_OBJS_PER_ZSPAGE	\
+	(ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE)
+
+/* End of user params */
+
+/* Bit in zs_handle->lock held while an object is mapped or moved */
+#define ZS_HANDLE_LOCK		0
+
+struct zs_handle {
+	unsigned long lock;
+	struct zspage *zspage;
+	unsigned int idx;	/* object index within zspage */
+};
+
+struct zspage {
+	struct list_head list;	/* on class partial or full list */
+	struct size_class *class;
+	unsigned int inuse;	/* objects allocated */
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned long used_map[BITS_TO_LONGS(ZS_MAX_OBJS_PER_ZSPAGE)];
+};
+
+struct size_class {
+	spinlock_t lock;
+	unsigned int size;		/* object size, including handle */
+	unsigned int pages_per_zspage;
+	unsigned int objs_per_zspage;
+
+	struct list_head partial;	/* zspages with free objects */
+	struct list_head full;
+
+	/* stats, under lock */
+	unsigned long zspages;
+	unsigned long objs_inuse;
+};
+
+/* Per-CPU copy of objects that span two pages */
+struct zs_map_area {
+	char *buf;
+	void *vaddr;		/* kmap_atomic() address if not spanning */
+	int mode;		/* enum zs_mapmode */
+	int spanning;
+};
+
+struct zs_pool {
+	struct size_class classes[ZS_SIZE_CLASSES];
+	struct zs_map_area __percpu *map_area;
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * zsmalloc allocation/free stress test
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Fills a pool with objects of random size, then repeatedly frees a
+ * random half of them and allocates replacements, checking object
+ * contents throughout. Reports how many bytes the pool holds per byte
+ * stored before and after zs_compact(), and the cost of an allocation
+ * and a free.
+ *
+ * Everything happens at load time; the module then refuses to stay
+ * loaded, like tcrypt:
+ *	modprobe zsmalloc_test objects=65536 rounds=8
+ */
+
+#define KMSG_COMPONENT "zsmalloc_test"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/random.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+static unsigned int objects = 16384;
+static unsigned int rounds = 4;
+static unsigned int min_size = 64;
+/* zram stores pages compressing worse than this uncompressed */
+static unsigned int max_size = PAGE_SIZE / 4 * 3;
+
+struct zs_test {
+	struct zs_pool *pool;
+	unsigned long *handles;
+	unsigned int *sizes;
+	u64 stored;		/* bytes requested by live objects */
+	unsigned long live;
+
+	u64 alloc_ns, nr_alloc;
+	u64 free_ns, nr_free;
+};
+
+/* Every byte depends on the object slot, so a misplaced object shows */
+static void zs_test_fill(char *buf, unsigned int i, unsigned int size)
+{
+	unsigned int j;
+
+	for (j = 0; j < size; j++)
+		buf[j] = (char)(i * 7 + j);
+}
+
+static int zs_test_check(char *buf, unsigned int i, unsigned int size)
+{
+	unsigned int j;
+
+	for (j = 0; j < size; j++)
+		if (buf[j] != (char)(i * 7 + j))
+			return -EIO;
+	return 0;
+}
+
+static int zs_test_alloc(struct zs_test *t, unsigned int i)
+{
+	ktime_t start;
+	unsigned long handle;
+	unsigned int size;
+	char *obj;
+
+	size = min_size + random32() % (max_size - min_size + 1);
+
+	start = ktime_get();
+	handle = zs_malloc(t->pool, size, GFP_KERNEL | __GFP_HIGHMEM);
+	t->alloc_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	t->nr_alloc++;
+	if (!handle)
+		return -ENOMEM;
+
+	obj = zs_map_object(t->pool, handle, ZS_MM_WO);
+	zs_test_fill(obj, i, size);
+	zs_unmap_object(t->pool, handle);
+
+	t->handles[i] = handle;
+	t->sizes[i] = size;
+	t->stored += size;
+	t->live++;
+
+	return 0;
+}
+
+static void zs_test_free(struct zs_test *t, unsigned int i)
+{
+	ktime_t start;
+
+	start = ktime_get();
+	zs_free(t->pool, t->handles[i]);
+	t->free_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	t->nr_free++;
+
+	t->stored -= t->sizes[i];
+	t->live--;
+	t->handles[i] = 0;
+}
+
+static int zs_test_verify(struct zs_test *t)
+{
+	unsigned int i;
+	int ret;
+	char *obj;
+
+	for (i = 0; i < objects; i++) {
+		if (!t->handles[i])
+			continue;
+
+		obj = zs_map_object(t->pool, t->handles[i], ZS_MM_RO);
+		ret = zs_test_check(obj, i, t->sizes[i]);
+		zs_unmap_object(t->pool, t->handles[i]);
+		if (ret) {
+			pr_err("object %u (%u bytes) is corrupted\n",
+				i, t->sizes[i]);
+			return ret;
+		}
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/*
+ * Bytes held per byte stored, in thousandths, counting the pool pages
+ * and the kmalloc'ed handles. zspage descriptors are left out; there is
+ * one per up to ZS_MAX_PAGES_PER_ZSPAGE pages.
+ */
+static void zs_test_report(struct zs_test *t, const char *when)
+{
+	struct zs_pool_stats stats;
+	u64 total, handles, permille = 0;
+	u32 rem;
+
+	zs_get_stats(t->pool, &stats);
+
+	total = zs_get_total_size_bytes(t->pool);
+	handles = (u64)t->live * sizeof(struct zs_handle);
+	if (t->stored)
+		permille = div64_u64((total + handles) * 1000, t->stored);
+	permille = div_u64_rem(permille, 1000, &rem);
+
+	pr_info("%s: %lu objects, %llu bytes stored in %llu pool bytes "
+		"+ %llu handle bytes, %llu.%03u bytes per stored byte, "
+		"%llu bytes in free slots\n", when, t->live,
+		(unsigned long long)t->stored, (unsigned long long)total,
+		(unsigned long long)handles, (unsigned long long)permille,
+		rem, (unsigned long long)stats.obj_free);
+}
+
+static int zs_test_run(struct zs_test *t)
+{
+	unsigned int i, r;
+	unsigned long freed;
+	int ret;
+
+	for (i = 0; i < objects; i++) {
+		ret = zs_test_alloc(t, i);
+		if (ret)
+			return ret;
+		cond_resched();
+	}
+	zs_test_report(t, "filled");
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < objects; i++) {
+			if (random32() & 1)
+				zs_test_free(t, i);
+			cond_resched();
+		}
+		zs_test_report(t, "half freed");
+
+		freed = zs_compact(t->pool);
+		ret = zs_test_verify(t);
+		if (ret)
+			return ret;
+		pr_info("round %u: compaction freed %lu pages\n", r, freed);
+		zs_test_report(t, "compacted");
+
+		for (i = 0; i < objects; i++) {
+			if (t->handles[i])
+				continue;
+			ret = zs_test_alloc(t, i);
+			if (ret)
+				return ret;
+			cond_resched();
+		}
+		zs_test_report(t, "refilled");
+	}
+
+	ret = zs_test_verify(t);
+	if (ret)
+		return ret;
+
+	pr_info("%llu allocations, %llu ns each; %llu frees, %llu ns each\n",
+		(unsigned long long)t->nr_alloc,
+		(unsigned long long)div64_u64(t->alloc_ns, t->nr_alloc),
+		(unsigned long long)t->nr_free, t->nr_free ?
+		(unsigned long long)div64_u64(t->free_ns, t->nr_free) : 0);
+
+	return 0;
+}
+
+static int __init zs_test_init(void)
+{
+	struct zs_test t;
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	if (!objects || !min_size || min_size > max_size ||
+			max_size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE) {
+		pr_err("bad parameters\n");
+		return -EINVAL;
+	}
+
+	memset(&t, 0, sizeof(t));
+
+	t.handles = vzalloc(objects * sizeof(*t.handles));
+	t.sizes = vmalloc(objects * sizeof(*t.sizes));
+	if (!t.handles || !t.sizes)
+		goto out;
+
+	t.pool = zs_create_pool();
+	if (!t.pool)
+		goto out;
+
+	pr_info("%u objects of %u-%u bytes, %u rounds\n",
+		objects, min_size, max_size, rounds);
+
+	ret = zs_test_run(&t);
+	if (ret)
+		pr_err("failed: %d\n", ret);
+
+	for (i = 0; i < objects; i++)
+		if (t.handles[i])
+			zs_free(t.pool, t.handles[i]);
+	zs_destroy_pool(t.pool);
+
+	/* Nothing to keep loaded, see tcrypt */
+	if (!ret)
+		ret = -EAGAIN;
+out:
+	vfree(t.sizes);
+	vfree(t.handles);
+	return ret;
+}
+
+/*
+ * If an init function is provided, an exit function must also be provided
+ * to allow module unload.
+ */
+static void __exit zs_test_exit(void) { }
+
+module_init(zs_test_init);
+module_exit(zs_test_exit);
+
+module_param(objects, uint, 0);
+MODULE_PARM_DESC(objects, "Number of objects kept in the pool");
+module_param(rounds, uint, 0);
+MODULE_PARM_DESC(rounds, "Free/reallocate rounds");
+module_param(min_size, uint, 0);
+MODULE_PARM_DESC(min_size, "Smallest object size in bytes");
+module_param(max_size, uint, 0);
+MODULE_PARM_DESC(max_size, "Largest object size in bytes");
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("zsmalloc allocation/free stress test");
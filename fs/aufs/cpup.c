@@ -22,7 +22,11 @@
 
 #include <linux/file.h>
 #include <linux/fs_stack.h>
+#include <linux/ktime.h>
 #include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/spinlock.h>
+#include <linux/splice.h>
 #include <linux/uaccess.h>
 #include "aufs.h"
 
@@ -186,16 +190,54 @@ int cpup_iattr(struct dentry *dst, aufs_bindex_t bindex, struct dentry *h_src)
 
 /* ---------------------------------------------------------------------- */
 
+/* a block which is all zero becomes a hole in dst */
+static int au_test_zero_blk(char *p, size_t sz, unsigned long blksize,
+			    char *zp)
+{
+	return sz == blksize && !memcmp(p, zp, sz);
+}
+
+/* the file ends in a hole, set the size which the seek did not */
+static int au_copy_last_hole(struct file *dst, struct iattr *ia)
+{
+	int err;
+	struct mutex *h_mtx;
+
+	AuLabel(last hole);
+
+	err = 1;
+	if (au_test_nfs(dst->f_dentry->d_sb)) {
+		/* nfs requires this step to make last hole */
+		/* is this only nfs? */
+		do {
+			/* todo: signal_pending? */
+			err = vfsub_write_k(dst, "\0", 1, &dst->f_pos);
+		} while (err == -EAGAIN || err == -EINTR);
+		if (err == 1)
+			dst->f_pos--;
+	}
+
+	if (err == 1) {
+		ia->ia_size = dst->f_pos;
+		ia->ia_valid = ATTR_SIZE | ATTR_FILE;
+		ia->ia_file = dst;
+		h_mtx = &dst->f_dentry->d_inode->i_mutex;
+		mutex_lock_nested(h_mtx, AuLsc_I_CHILD2);
+		err = vfsub_notify_change(&dst->f_path, ia);
+		mutex_unlock(h_mtx);
+	}
+
+	return err;
+}
+
 static int au_do_copy_file(struct file *dst, struct file *src, loff_t len,
-			   char *buf, unsigned long blksize)
+			   char *buf, unsigned long bufsz,
+			   unsigned long blksize)
 {
 	int err;
-	size_t sz, rbytes, wbytes;
+	size_t sz, rbytes, wbytes, run, b;
 	unsigned char all_zero;
 	char *p, *zp;
-	struct mutex *h_mtx;
-	/* reduce stack usage */
-	struct iattr *ia;
 
 	zp = page_address(ZERO_PAGE(0));
 	if (unlikely(!zp))
@@ -205,8 +247,8 @@ static int au_do_copy_file(struct file *dst, struct file *src, loff_t len,
 	all_zero = 0;
 	while (len) {
 		AuDbg("len %lld\n", len);
-		sz = blksize;
-		if (len < blksize)
+		sz = bufsz;
+		if (len < bufsz)
 			sz = len;
 
 		rbytes = 0;
@@ -218,104 +260,313 @@ static int au_do_copy_file(struct file *dst, struct file *src, loff_t len,
 		if (unlikely(err < 0))
 			break;
 
-		all_zero = 0;
-		if (len >= rbytes && rbytes == blksize)
-			all_zero = !memcmp(buf, zp, rbytes);
-		if (!all_zero) {
-			wbytes = rbytes;
-			p = buf;
-			while (wbytes) {
-				size_t b;
-
-				b = vfsub_write_k(dst, p, wbytes, &dst->f_pos);
-				err = b;
+		/*
+		 * split the buffer into runs of data blocks and zero blocks,
+		 * write the former and seek over the latter.
+		 */
+		p = buf;
+		while (p < buf + rbytes) {
+			b = min_t(size_t, blksize, buf + rbytes - p);
+			all_zero = au_test_zero_blk(p, b, blksize, zp);
+			run = b;
+			while (p + run < buf + rbytes) {
+				b = min_t(size_t, blksize, buf + rbytes - p - run);
+				if (au_test_zero_blk(p + run, b, blksize, zp)
+				    != all_zero)
+					break;
+				run += b;
+			}
+
+			if (!all_zero) {
+				wbytes = run;
+				while (wbytes) {
+					b = vfsub_write_k(dst, p, wbytes,
+							  &dst->f_pos);
+					err = b;
+					/* todo: signal_pending? */
+					if (unlikely(err == -EAGAIN
+						     || err == -EINTR))
+						continue;
+					if (unlikely(err < 0))
+						break;
+					wbytes -= b;
+					p += b;
+				}
+				if (unlikely(err < 0))
+					break;
+			} else {
+				loff_t res;
+
+				AuLabel(hole);
+				res = vfsub_llseek(dst, run, SEEK_CUR);
+				err = res;
+				if (unlikely(res < 0))
+					break;
+				p += run;
+			}
+		}
+		if (unlikely(err < 0))
+			break;
+		len -= rbytes;
+		err = 0;
+	}
+
+	/* the last block may be a hole, buf is free to hold the iattr */
+	if (!err && all_zero)
+		err = au_copy_last_hole(dst, (void *)buf);
+
+	return err;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * splice the data runs from the page cache of src to dst, with no copy
+ * through a kernel buffer. the pages are only mapped to find the blocks
+ * which are all zero, and dst seeks over them as au_do_copy_file() does.
+ */
+struct au_cpup_splice {
+	struct file *dst;
+	unsigned long blksize;
+	char *zp;
+	unsigned char all_zero;
+};
+
+/*
+ * returns the length of the run at the head of the pipe, up to len, whose
+ * blocks are all zero or all not, and sets cs->all_zero accordingly.
+ */
+static long au_splice_run(struct pipe_inode_info *pipe, size_t len,
+			  struct au_cpup_splice *cs)
+{
+	long err;
+	int i, first;
+	unsigned char all_zero;
+	size_t run, off, b;
+	char *p;
+	struct pipe_buffer *buf;
+
+	run = 0;
+	first = 1;
+	for (i = 0; i < pipe->nrbufs && run < len; i++) {
+		buf = pipe->bufs + ((pipe->curbuf + i) & (pipe->buffers - 1));
+		err = buf->ops->confirm(pipe, buf);
+		if (unlikely(err))
+			return err;
+
+		p = buf->ops->map(pipe, buf, /*atomic*/0);
+		for (off = 0; off < buf->len && run < len; off += b) {
+			/* blocks are aligned in the file, blksize is 2^n */
+			b = cs->blksize
+				- ((cs->dst->f_pos + run) & (cs->blksize - 1));
+			b = min_t(size_t, b, buf->len - off);
+			b = min_t(size_t, b, len - run);
+			all_zero = au_test_zero_blk(p + buf->offset + off, b,
+						    cs->blksize, cs->zp);
+			if (first) {
+				cs->all_zero = all_zero;
+				first = 0;
+			} else if (all_zero != cs->all_zero)
+				break;
+			run += b;
+		}
+		buf->ops->unmap(pipe, buf, p);
+		if (off < buf->len && run < len)
+			break;
+	}
+
+	return run;
+}
+
+/* consume len bytes at the head of the pipe without writing them */
+static void au_splice_skip(struct pipe_inode_info *pipe, size_t len)
+{
+	size_t b;
+	struct pipe_buffer *buf;
+
+	while (len) {
+		buf = pipe->bufs + pipe->curbuf;
+		b = min_t(size_t, len, buf->len);
+		buf->offset += b;
+		buf->len -= b;
+		len -= b;
+		if (!buf->len) {
+			buf->ops->release(pipe, buf);
+			buf->ops = NULL;
+			pipe->curbuf = (pipe->curbuf + 1) & (pipe->buffers - 1);
+			pipe->nrbufs--;
+		}
+	}
+}
+
+static int au_splice_actor(struct pipe_inode_info *pipe,
+			   struct splice_desc *sd)
+{
+	long err;
+	size_t left, run;
+	struct au_cpup_splice *cs = sd->u.data;
+	struct file *dst = cs->dst;
+
+	left = sd->total_len;
+	while (left) {
+		err = au_splice_run(pipe, left, cs);
+		if (unlikely(err <= 0))
+			return err ? err : -EIO;
+		run = err;
+
+		if (!cs->all_zero) {
+			while (run) {
+				err = vfsub_splice_from(pipe, dst, &dst->f_pos,
+							run, sd->flags);
 				/* todo: signal_pending? */
 				if (unlikely(err == -EAGAIN || err == -EINTR))
 					continue;
-				if (unlikely(err < 0))
-					break;
-				wbytes -= b;
-				p += b;
+				if (unlikely(err <= 0))
+					return err ? err : -EIO;
+				run -= err;
+				left -= err;
 			}
 		} else {
 			loff_t res;
 
 			AuLabel(hole);
-			res = vfsub_llseek(dst, rbytes, SEEK_CUR);
-			err = res;
+			au_splice_skip(pipe, run);
+			res = vfsub_llseek(dst, run, SEEK_CUR);
 			if (unlikely(res < 0))
-				break;
+				return res;
+			left -= run;
 		}
-		len -= rbytes;
-		err = 0;
 	}
 
-	/* the last block may be a hole */
-	if (!err && all_zero) {
-		AuLabel(last hole);
+	return sd->total_len;
+}
 
-		err = 1;
-		if (au_test_nfs(dst->f_dentry->d_sb)) {
-			/* nfs requires this step to make last hole */
-			/* is this only nfs? */
-			do {
-				/* todo: signal_pending? */
-				err = vfsub_write_k(dst, "\0", 1, &dst->f_pos);
-			} while (err == -EAGAIN || err == -EINTR);
-			if (err == 1)
-				dst->f_pos--;
-		}
+/* splice_desc counts in unsigned int */
+#define AuCpupSpliceMax	(INT_MAX & PAGE_MASK)
+
+static int au_splice_file(struct file *dst, struct file *src, loff_t len,
+			  unsigned long blksize)
+{
+	int err;
+	ssize_t ssz;
+	struct iattr *ia;
+	struct au_cpup_splice cs = {
+		.dst		= dst,
+		.blksize	= blksize,
+		.all_zero	= 0
+	};
+	struct splice_desc sd = {
+		.flags		= 0,
+		.pos		= 0,
+		.u.data		= &cs
+	};
+
+	cs.zp = page_address(ZERO_PAGE(0));
+	if (unlikely(!cs.zp))
+		return -ENOMEM; /* possible? */
 
-		if (err == 1) {
-			ia = (void *)buf;
-			ia->ia_size = dst->f_pos;
-			ia->ia_valid = ATTR_SIZE | ATTR_FILE;
-			ia->ia_file = dst;
-			h_mtx = &dst->f_dentry->d_inode->i_mutex;
-			mutex_lock_nested(h_mtx, AuLsc_I_CHILD2);
-			err = vfsub_notify_change(&dst->f_path, ia);
-			mutex_unlock(h_mtx);
+	err = 0;
+	while (len) {
+		AuDbg("len %lld\n", len);
+		sd.total_len = AuCpupSpliceMax;
+		if (len < AuCpupSpliceMax)
+			sd.total_len = len;
+		ssz = splice_direct_to_actor(src, &sd, au_splice_actor);
+		err = ssz;
+		if (unlikely(ssz < 0))
+			break;
+		err = -EIO;
+		if (unlikely(!ssz))
+			break; /* src is shorter than len */
+		len -= ssz;
+		err = 0;
+	}
+
+	if (!err && cs.all_zero) {
+		err = -ENOMEM;
+		ia = kmalloc(sizeof(*ia), GFP_NOFS);
+		if (ia) {
+			err = au_copy_last_hole(dst, ia);
+			kfree(ia);
 		}
 	}
 
 	return err;
 }
 
+/*
+ * splice when the branch fs can. otherwise copy through a buffer of up to
+ * 1 << AuCpupBufOrder pages, to reduce the number of read/write calls for a
+ * large file. fall back to smaller buffers when the memory is fragmented.
+ */
+#define AuCpupBufOrder	4
+
 int au_copy_file(struct file *dst, struct file *src, loff_t len)
 {
 	int err;
+	unsigned int order;
 	unsigned long blksize;
-	unsigned char do_kfree;
 	char *buf;
 
-	err = -ENOMEM;
 	blksize = dst->f_dentry->d_sb->s_blocksize;
 	if (!blksize || PAGE_SIZE < blksize)
 		blksize = PAGE_SIZE;
 	AuDbg("blksize %lu\n", blksize);
-	do_kfree = (blksize != PAGE_SIZE && blksize >= sizeof(struct iattr *));
-	if (do_kfree)
-		buf = kmalloc(blksize, GFP_NOFS);
-	else
-		buf = (void *)__get_free_page(GFP_NOFS);
-	if (unlikely(!buf))
-		goto out;
 
 	if (len > (1 << 22))
 		AuDbg("copying a large file %lld\n", (long long)len);
 
 	src->f_pos = 0;
 	dst->f_pos = 0;
-	err = au_do_copy_file(dst, src, len, buf, blksize);
-	if (do_kfree)
-		kfree(buf);
-	else
-		free_page((unsigned long)buf);
+	err = au_splice_file(dst, src, len, blksize);
+	if (!err || dst->f_pos)
+		goto out;
+	/* nothing is written yet, the branch fs may not support splice */
+	AuDbg("splice err %d, read/write instead\n", err);
+
+	err = -ENOMEM;
+	order = 0;
+	if (len > PAGE_SIZE)
+		order = min_t(unsigned int, get_order(len), AuCpupBufOrder);
+	do {
+		buf = (void *)__get_free_pages(GFP_NOFS | __GFP_NOWARN, order);
+	} while (!buf && order--);
+	if (unlikely(!buf))
+		goto out;
+
+	err = au_do_copy_file(dst, src, len, buf, PAGE_SIZE << order, blksize);
+	free_pages((unsigned long)buf, order);
 
 out:
 	return err;
 }
 
+/* ---------------------------------------------------------------------- */
+
+static DEFINE_SPINLOCK(au_cpup_stat_spin);
+static struct au_cpup_stat au_cpup_stat;
+
+static void au_cpup_stat_add(loff_t len, ktime_t start)
+{
+	unsigned long long usec;
+
+	usec = ktime_to_us(ktime_sub(ktime_get(), start));
+	spin_lock(&au_cpup_stat_spin);
+	au_cpup_stat.count++;
+	au_cpup_stat.bytes += len;
+	au_cpup_stat.usec += usec;
+	if (au_cpup_stat.max_usec < usec)
+		au_cpup_stat.max_usec = usec;
+	spin_unlock(&au_cpup_stat_spin);
+}
+
+void au_cpup_stat_get(struct au_cpup_stat *stat)
+{
+	spin_lock(&au_cpup_stat_spin);
+	*stat = au_cpup_stat;
+	spin_unlock(&au_cpup_stat_spin);
+}
+
 /*
  * to support a sparse file which is opened with O_APPEND,
  * we need to close the file.
@@ -348,6 +599,7 @@ static int au_cp_regular(struct dentry *dentry, aufs_bindex_t bdst,
 		}
 	};
 	struct super_block *sb;
+	ktime_t start;
 
 	/* bsrc branch can be ro/rw. */
 	sb = dentry->d_sb;
@@ -365,7 +617,10 @@ static int au_cp_regular(struct dentry *dentry, aufs_bindex_t bdst,
 
 	/* try stopping to update while we copyup */
 	IMustLock(file[SRC].dentry->d_inode);
+	start = ktime_get();
 	err = au_copy_file(file[DST].file, file[SRC].file, len);
+	if (!err)
+		au_cpup_stat_add(len, start);
 
 out_dst:
 	fput(file[DST].file);
@@ -52,6 +52,12 @@ void au_cpup_attr_all(struct inode *inode, int force);
 	do { (flags) &= ~AuCpup_##name; } while (0)
 
 int au_copy_file(struct file *dst, struct file *src, loff_t len);
+
+/* regular file copy-up statistics, see sysfs.c */
+struct au_cpup_stat {
+	unsigned long long count, bytes, usec, max_usec;
+};
+void au_cpup_stat_get(struct au_cpup_stat *stat);
 int au_sio_cpup_single(struct dentry *dentry, aufs_bindex_t bdst,
 		       aufs_bindex_t bsrc, loff_t len, unsigned int flags,
 		       struct dentry *dst_parent);
@@ -33,7 +33,7 @@
 /* need to be faster and smaller */
 
 struct au_nhash {
-	unsigned int		nh_num;
+	unsigned int		nh_num, nh_count;
 	struct hlist_head	*nh_head;
 };
 
@@ -83,6 +83,8 @@ struct au_vdir {
 	unsigned long	vd_version;
 	unsigned int	vd_deblk_sz;
 	unsigned long	vd_jiffy;
+	/* set by hnotify, a branch dir was changed */
+	unsigned char	vd_stale;
 } ____cacheline_aligned_in_smp;
 
 /* ---------------------------------------------------------------------- */
@@ -106,6 +108,7 @@ int au_nhash_append_wh(struct au_nhash *whlist, char *name, int nlen, ino_t ino,
 		       unsigned int d_type, aufs_bindex_t bindex,
 		       unsigned char shwh);
 void au_vdir_free(struct au_vdir *vdir);
+void au_vdir_stale(struct inode *dir);
 int au_vdir_init(struct file *file);
 int au_vdir_fill_de(struct file *file, void *dirent, filldir_t filldir);
 
@@ -336,11 +336,7 @@ static int hn_job(struct hn_job_args *a)
 
 	/* make dir entries obsolete */
 	if (au_ftest_hnjob(a->flags, DIRENT) && a->inode) {
-		struct au_vdir *vdir;
-
-		vdir = au_ivdir(a->inode);
-		if (vdir)
-			vdir->vd_jiffy = 0;
+		au_vdir_stale(a->inode);
 		/* IMustLock(a->inode); */
 		/* a->inode->i_version++; */
 	}
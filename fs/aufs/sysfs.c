@@ -46,10 +46,33 @@ static ssize_t config_show(struct kobject *kobj, struct kobj_attribute *attr,
 static struct kobj_attribute au_config_attr = __ATTR_RO(config);
 #endif
 
+/* copy-up statistics, one number per file */
+#define AuCpupStatAttr(_name)						\
+static ssize_t cpup_##_name##_show(struct kobject *kobj,		\
+				   struct kobj_attribute *attr,		\
+				   char *buf)				\
+{									\
+	struct au_cpup_stat stat;					\
+									\
+	au_cpup_stat_get(&stat);					\
+	return snprintf(buf, PAGE_SIZE, "%llu\n", stat._name);		\
+}									\
+static struct kobj_attribute au_cpup_##_name##_attr =			\
+	__ATTR_RO(cpup_##_name)
+
+AuCpupStatAttr(count);
+AuCpupStatAttr(bytes);
+AuCpupStatAttr(usec);
+AuCpupStatAttr(max_usec);
+
 static struct attribute *au_attr[] = {
 #ifdef CONFIG_AUFS_FS_MODULE
 	&au_config_attr.attr,
 #endif
+	&au_cpup_count_attr.attr,
+	&au_cpup_bytes_attr.attr,
+	&au_cpup_usec_attr.attr,
+	&au_cpup_max_usec_attr.attr,
 	NULL,	/* need to NULL terminate the list of attributes */
 };
 
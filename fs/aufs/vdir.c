@@ -82,6 +82,7 @@ int au_nhash_alloc(struct au_nhash *nhash, unsigned int num_hash, gfp_t gfp)
 	head = kmalloc(sizeof(*nhash->nh_head) * num_hash, gfp);
 	if (head) {
 		nhash->nh_num = num_hash;
+		nhash->nh_count = 0;
 		nhash->nh_head = head;
 		for (u = 0; u < num_hash; u++)
 			INIT_HLIST_HEAD(head++);
@@ -184,14 +185,61 @@ static struct hlist_head *au_name_hash(struct au_nhash *nhash,
 
 	AuDebugOn(!nhash->nh_num || !nhash->nh_head);
 
-	v = 0;
-	while (len--)
-		v += *name++;
+	v = full_name_hash(name, len);
 	/* v = hash_long(v, magic_bit); */
 	v %= nhash->nh_num;
 	return nhash->nh_head + v;
 }
 
+/*
+ * the initial size of the name hash is estimated from the size of the lower
+ * dirs which may be far from the number of entries. double the hash when the
+ * chains get longer than AuNhashLoad in average. the failure is not an error,
+ * we keep the current hash.
+ */
+#define AuNhashLoad	4
+
+static struct au_vdir_destr *au_nhash_wh_str(struct hlist_node *pos)
+{
+	return &hlist_entry(pos, struct au_vdir_wh, wh_hash)->wh_str;
+}
+
+static struct au_vdir_destr *au_nhash_de_str(struct hlist_node *pos)
+{
+	return hlist_entry(pos, struct au_vdir_dehstr, hash)->str;
+}
+
+static void au_nhash_add(struct au_nhash *nhash, struct hlist_node *new,
+			 struct au_vdir_destr *(*str)(struct hlist_node *pos))
+{
+	unsigned int u, n;
+	struct hlist_head *head;
+	struct hlist_node *pos, *node;
+	struct au_vdir_destr *destr;
+	struct au_nhash grown;
+
+	destr = str(new);
+	hlist_add_head(new, au_name_hash(nhash, destr->name, destr->len));
+	if (++nhash->nh_count / AuNhashLoad <= nhash->nh_num)
+		return;
+
+	n = nhash->nh_num;
+	if (n > KMALLOC_MAX_SIZE / sizeof(*head) / 2
+	    || au_nhash_alloc(&grown, n * 2, GFP_NOFS | __GFP_NOWARN))
+		return;
+
+	head = nhash->nh_head;
+	for (u = 0; u < n; u++, head++)
+		hlist_for_each_safe(pos, node, head) {
+			destr = str(pos);
+			hlist_add_head(pos, au_name_hash(&grown, destr->name,
+							 destr->len));
+		}
+	kfree(nhash->nh_head);
+	nhash->nh_num = grown.nh_num;
+	nhash->nh_head = grown.nh_head;
+}
+
 static int au_nhash_test_name(struct au_vdir_destr *str, const char *name,
 			      int nlen)
 {
@@ -252,14 +300,16 @@ int au_nhash_append_wh(struct au_nhash *whlist, char *name, int nlen, ino_t ino,
 	int err;
 	struct au_vdir_destr *str;
 	struct au_vdir_wh *wh;
+	void *p;
 
 	AuDbg("%.*s\n", nlen, name);
 	AuDebugOn(!whlist->nh_num || !whlist->nh_head);
 
 	err = -ENOMEM;
-	wh = kmalloc(sizeof(*wh) + nlen, GFP_NOFS);
-	if (unlikely(!wh))
+	p = kmalloc(sizeof(*wh) + nlen, GFP_NOFS);
+	if (unlikely(!p))
 		goto out;
+	wh = p;
 
 	err = 0;
 	wh->wh_bindex = bindex;
@@ -268,7 +318,12 @@ int au_nhash_append_wh(struct au_nhash *whlist, char *name, int nlen, ino_t ino,
 	str = &wh->wh_str;
 	str->len = nlen;
 	memcpy(str->name, name, nlen);
-	hlist_add_head(&wh->wh_hash, au_name_hash(whlist, name, nlen));
+	/*
+	 * wh is packed and &wh->wh_hash may be unaligned in general. it is the
+	 * first member of a kmalloc-ed object here, pass it through p.
+	 */
+	BUILD_BUG_ON(offsetof(struct au_vdir_wh, wh_hash));
+	au_nhash_add(whlist, p, au_nhash_wh_str);
 	/* smp_mb(); */
 
 out:
@@ -337,11 +392,11 @@ static int append_de(struct au_vdir *vdir, char *name, int nlen, ino_t ino,
 		goto out;
 
 	dehstr->str = &room->de->de_str;
-	hlist_add_head(&dehstr->hash, au_name_hash(delist, name, nlen));
 	room->de->de_ino = ino;
 	room->de->de_type = d_type;
 	room->de->de_str.len = nlen;
 	memcpy(room->de->de_str.name, name, nlen);
+	au_nhash_add(delist, &dehstr->hash, au_nhash_de_str);
 
 	err = 0;
 	room->deblk += sz;
@@ -366,6 +421,23 @@ void au_vdir_free(struct au_vdir *vdir)
 	au_cache_free_vdir(vdir);
 }
 
+/*
+ * called by hnotify when an entry in a branch dir was changed.
+ * when the set of the branch dirs changes, the refreshed inode gets a new
+ * i_version and it makes the vdir obsolete too.
+ * hnotify runs under si_write_lock and the readers of vd_stale under
+ * si_read_lock, so they never race. ACCESS_ONCE only keeps the compiler from
+ * caching the flag.
+ */
+void au_vdir_stale(struct inode *dir)
+{
+	struct au_vdir *vdir;
+
+	vdir = au_ivdir(dir);
+	if (vdir)
+		ACCESS_ONCE(vdir->vd_stale) = 1;
+}
+
 static struct au_vdir *alloc_vdir(struct file *file)
 {
 	struct au_vdir *vdir;
@@ -393,6 +465,7 @@ static struct au_vdir *alloc_vdir(struct file *file)
 	vdir->vd_nblk = 0;
 	vdir->vd_version = 0;
 	vdir->vd_jiffy = 0;
+	vdir->vd_stale = 0;
 	err = append_deblk(vdir);
 	if (!err)
 		return vdir; /* success */
@@ -424,6 +497,7 @@ static int reinit_vdir(struct au_vdir *vdir)
 	vdir->vd_last.p.deblk = vdir->vd_deblk[0];
 	vdir->vd_version = 0;
 	vdir->vd_jiffy = 0;
+	vdir->vd_stale = 0;
 	/* smp_mb(); */
 	return err;
 }
@@ -501,8 +575,6 @@ static int fillvdir(void *__arg, const char *__name, int nlen,
 	}
 
 out:
-	if (!arg->err)
-		arg->vdir->vd_jiffy = jiffies;
 	/* smp_mb(); */
 	AuTraceErr(arg->err);
 	return arg->err;
@@ -623,10 +695,26 @@ out:
 	return err;
 }
 
+/*
+ * with udba=notify every change on the branches is told by hnotify, and the
+ * cached vdir is kept until then. otherwise it expires after rdcache.
+ */
+static int au_vdir_test_stale(struct inode *inode, struct au_vdir *vdir)
+{
+	unsigned long expire;
+
+	if (ACCESS_ONCE(vdir->vd_stale))
+		return 1;
+	if (au_opt_test(au_mntflags(inode->i_sb), UDBA_HNOTIFY))
+		return 0;
+
+	expire = au_sbi(inode->i_sb)->si_rdcache;
+	return time_after(jiffies, vdir->vd_jiffy + expire);
+}
+
 static int read_vdir(struct file *file, int may_read)
 {
 	int err;
-	unsigned long expire;
 	unsigned char do_read;
 	struct fillvdir_arg arg;
 	struct inode *inode;
@@ -639,7 +727,6 @@ static int read_vdir(struct file *file, int may_read)
 
 	allocated = NULL;
 	do_read = 0;
-	expire = au_sbi(inode->i_sb)->si_rdcache;
 	vdir = au_ivdir(inode);
 	if (!vdir) {
 		do_read = 1;
@@ -651,11 +738,13 @@ static int read_vdir(struct file *file, int may_read)
 		allocated = vdir;
 	} else if (may_read
 		   && (inode->i_version != vdir->vd_version
-		       || time_after(jiffies, vdir->vd_jiffy + expire))) {
+		       || au_vdir_test_stale(inode, vdir))) {
 		do_read = 1;
 		err = reinit_vdir(vdir);
 		if (unlikely(err))
 			goto out;
+		/* make the vdir cache of the opened files obsolete too */
+		inode->i_version++;
 	}
 
 	if (!do_read)
@@ -667,6 +756,7 @@ static int read_vdir(struct file *file, int may_read)
 	if (!err) {
 		/* file->f_pos = 0; */
 		vdir->vd_version = inode->i_version;
+		vdir->vd_jiffy = jiffies;
 		vdir->vd_last.ul = 0;
 		vdir->vd_last.p.deblk = vdir->vd_deblk[0];
 		if (allocated)
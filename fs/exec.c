@@ -54,6 +54,7 @@
 #include <linux/fsnotify.h>
 #include <linux/fs_struct.h>
 #include <linux/pipe_fs_i.h>
+#include <linux/oom.h>
 
 #include <asm/uaccess.h>
 #include <asm/mmu_context.h>
@@ -898,6 +899,7 @@ static int de_thread(struct task_struct *tsk)
 
 		tsk->group_leader = tsk;
 		leader->group_leader = tsk;
+		oom_adj_index_replace(leader, tsk);
 
 		tsk->exit_signal = SIGCHLD;
 
@@ -1072,6 +1072,7 @@ static ssize_t oom_adjust_write(struct file *file, const char __user *buf,
 	else
 		task->signal->oom_score_adj = (oom_adjust * OOM_SCORE_ADJ_MAX) /
 								-OOM_DISABLE;
+	oom_adj_index_update(task);
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
 
@@ -1177,6 +1178,7 @@ static ssize_t oom_score_adj_write(struct file *file, const char __user *buf,
 	else
 		task->signal->oom_adj = (oom_score_adj * OOM_ADJUST_MAX) /
 							OOM_SCORE_ADJ_MAX;
+	oom_adj_index_update(task);
 	unlock_task_sighand(task, &flags);
 	put_task_struct(task);
 	return count;
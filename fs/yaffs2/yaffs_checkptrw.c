@@ -45,7 +45,7 @@ static int yaffs_CheckpointErase(yaffs_Device *dev)
 			if (dev->param.eraseBlockInNAND(dev, i - dev->blockOffset /* realign */)) {
 				bi->blockState = YAFFS_BLOCK_STATE_EMPTY;
 				dev->nErasedBlocks++;
-				dev->nFreeChunks += dev->param.nChunksPerBlock;
+				dev->nFreeChunks += dev->chunksPerSummary;
 			} else {
 				dev->param.markNANDBlockBad(dev, i);
 				bi->blockState = YAFFS_BLOCK_STATE_DEAD;
@@ -371,7 +371,7 @@ int yaffs_CheckpointClose(yaffs_Device *dev)
 		dev->checkpointBlockList = NULL;
 	}
 
-	dev->nFreeChunks -= dev->blocksInCheckpoint * dev->param.nChunksPerBlock;
+	dev->nFreeChunks -= dev->blocksInCheckpoint * dev->chunksPerSummary;
 	dev->nErasedBlocks -= dev->blocksInCheckpoint;
 
 
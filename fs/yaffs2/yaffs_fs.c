@@ -143,17 +143,25 @@ unsigned int yaffs_wr_attempts = YAFFS_WR_ATTEMPTS;
 unsigned int yaffs_auto_checkpoint = 1;
 unsigned int yaffs_gc_control = 1;
 
+#ifdef CONFIG_YAFFS_SHORT_OP_CACHE_KB
+unsigned int yaffs_cache_kb = CONFIG_YAFFS_SHORT_OP_CACHE_KB;
+#else
+unsigned int yaffs_cache_kb = 512;
+#endif
+
 /* Module Parameters */
 #if (LINUX_VERSION_CODE > KERNEL_VERSION(2, 5, 0))
 module_param(yaffs_traceMask, uint, 0644);
 module_param(yaffs_wr_attempts, uint, 0644);
 module_param(yaffs_auto_checkpoint, uint, 0644);
 module_param(yaffs_gc_control, uint, 0644);
+module_param(yaffs_cache_kb, uint, 0644);
 #else
 MODULE_PARM(yaffs_traceMask, "i");
 MODULE_PARM(yaffs_wr_attempts, "i");
 MODULE_PARM(yaffs_auto_checkpoint, "i");
 MODULE_PARM(yaffs_gc_control, "i");
+MODULE_PARM(yaffs_cache_kb, "i");
 #endif
 
 #if (LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 25))
@@ -1951,7 +1959,7 @@ static void yaffs_FlushSuperBlock(struct super_block *sb, int do_checkpoint)
 
 static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 {
-	unsigned erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	unsigned erasedChunks = dev->nErasedBlocks * dev->chunksPerSummary;
 	struct yaffs_LinuxContext *context = yaffs_DeviceToContext(dev);
 	unsigned scatteredFree = 0; /* Free chunks not in an erased block */
 
@@ -1960,14 +1968,17 @@ static unsigned yaffs_bg_gc_urgency(yaffs_Device *dev)
 
 	if(!context->bgRunning)
 		return 0;
-	else if(scatteredFree < (dev->param.nChunksPerBlock * 2))
+	else if(scatteredFree < (dev->chunksPerSummary * 2))
 		return 0;
 	else if(erasedChunks > dev->nFreeChunks/2)
 		return 0;
 	else if(erasedChunks > dev->nFreeChunks/4)
 		return 1;
-	else
+	else if(dev->nErasedBlocks > dev->param.nReservedBlocks * 2 &&
+		erasedChunks > dev->nFreeChunks/8)
 		return 2;
+	else
+		return 3;
 }
 
 static int yaffs_do_sync_fs(struct super_block *sb,
@@ -2063,7 +2074,15 @@ static int yaffs_BackgroundThread(void *data)
 			if(!dev->isCheckpointed){
 				urgency = yaffs_bg_gc_urgency(dev);
 				gcResult = yaffs_BackgroundGarbageCollect(dev, urgency);
-				if(urgency > 1)
+				/*
+				 * Nothing worth collecting (eg. the device is
+				 * full of live data): don't poll every tick.
+				 */
+				if(!gcResult)
+					next_gc = now + HZ * 2;
+				else if(urgency > 2)
+					next_gc = now + 1;
+				else if(urgency > 1)
 					next_gc = now + HZ/20+1;
 				else if(urgency > 0)
 					next_gc = now + HZ/10+1;
@@ -2344,6 +2363,8 @@ typedef struct {
 	int lazy_loading_overridden;
 	int empty_lost_and_found;
 	int empty_lost_and_found_overridden;
+	int block_summary;
+	int block_summary_overridden;
 } yaffs_options;
 
 #define MAX_OPT_LEN 30
@@ -2390,6 +2411,12 @@ static int yaffs_parse_options(yaffs_options *options, const char *options_str)
 		} else if (!strcmp(cur_opt, "empty-lost-and-found-on")){
 			options->empty_lost_and_found = 1;
 			options->empty_lost_and_found_overridden=1;
+		} else if (!strcmp(cur_opt, "summary-off")){
+			options->block_summary = 0;
+			options->block_summary_overridden = 1;
+		} else if (!strcmp(cur_opt, "summary-on")){
+			options->block_summary = 1;
+			options->block_summary_overridden = 1;
 		} else if (!strcmp(cur_opt, "no-cache"))
 			options->no_cache = 1;
 		else if (!strcmp(cur_opt, "no-checkpoint-read"))
@@ -2665,6 +2692,12 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	if(options.empty_lost_and_found_overridden)
 		param->emptyLostAndFound = options.empty_lost_and_found;
 
+#ifdef CONFIG_YAFFS_BLOCK_SUMMARY
+	param->blockSummary = 1;
+#endif
+	if(options.block_summary_overridden)
+		param->blockSummary = options.block_summary;
+
 	/* ... and the functions. */
 	if (yaffsVersion == 2) {
 		param->writeChunkWithTagsToNAND =
@@ -2705,6 +2738,11 @@ static struct super_block *yaffs_internal_read_super(int yaffsVersion,
 	param->eraseBlockInNAND = nandmtd_EraseBlockInNAND;
 	param->initialiseNAND = nandmtd_InitialiseNAND;
 
+	/* Now that the chunk size is known, size the short op cache. */
+	if (param->nShortOpCaches > 0 &&
+	    yaffs_cache_kb * 1024 / param->totalBytesPerChunk > param->nShortOpCaches)
+		param->nShortOpCaches = yaffs_cache_kb * 1024 / param->totalBytesPerChunk;
+
 	yaffs_DeviceToContext(dev)->putSuperFunc = yaffs_MTDPutSuper;
 
 	param->markSuperBlockDirty = yaffs_MarkSuperBlockDirty;
@@ -2894,6 +2932,7 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "emptyLostAndFound.. %d\n", dev->param.emptyLostAndFound);
 	buf += sprintf(buf, "disableLazyLoad.... %d\n", dev->param.disableLazyLoad);
 	buf += sprintf(buf, "refreshPeriod...... %d\n", dev->param.refreshPeriod);
+	buf += sprintf(buf, "blockSummary....... %d\n", dev->param.blockSummary);
 	buf += sprintf(buf, "nShortOpCaches..... %d\n", dev->param.nShortOpCaches);
 	buf += sprintf(buf, "nReservedBlocks.... %d\n", dev->param.nReservedBlocks);
 
@@ -2903,8 +2942,38 @@ static char *yaffs_dump_dev_part0(char *buf, yaffs_Device * dev)
 }
 
 
+/* Average hash chain entries looked at per object lookup, times 100 */
+static unsigned yaffs_probes_per_lookup(yaffs_Device *dev)
+{
+	__u64 probes = (__u64)dev->nObjectProbes * 100;
+
+	if (!dev->nObjectLookups)
+		return 0;
+	do_div(probes, dev->nObjectLookups);
+	return (unsigned)probes;
+}
+
+/*
+ * NAND page writes per page written on behalf of the user, as "x.yy".
+ * Pages copied by gc are the overhead.
+ */
+static char *yaffs_write_amplification(char *buf, yaffs_Device *dev)
+{
+	__u64 ratio = 100;
+	__u32 userWrites = dev->nPageWrites - dev->nGCCopies;
+
+	if (dev->nGCCopies < dev->nPageWrites) {
+		ratio = (__u64)dev->nPageWrites * 100;
+		do_div(ratio, userWrites);
+	}
+	sprintf(buf, "%u.%02u", (unsigned)ratio / 100, (unsigned)ratio % 100);
+	return buf;
+}
+
 static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 {
+	char waBuf[24];
+
 	buf += sprintf(buf, "nDataBytesPerChunk. %d\n", dev->nDataBytesPerChunk);
 	buf += sprintf(buf, "chunkGroupBits..... %d\n", dev->chunkGroupBits);
 	buf += sprintf(buf, "chunkGroupSize..... %d\n", dev->chunkGroupSize);
@@ -2913,8 +2982,15 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nTnodesCreated..... %d\n", dev->nTnodesCreated);
 	buf += sprintf(buf, "nFreeTnodes........ %d\n", dev->nFreeTnodes);
+	buf += sprintf(buf, "nTnodeExtents...... %d\n", dev->nTnodeExtents);
 	buf += sprintf(buf, "nObjectsCreated.... %d\n", dev->nObjectsCreated);
 	buf += sprintf(buf, "nFreeObjects....... %d\n", dev->nFreeObjects);
+	buf += sprintf(buf, "ramPerObject....... %d\n", yaffs_GetRamPerObject(dev));
+	buf += sprintf(buf, "nObjectBuckets..... %d\n", dev->nObjectBuckets);
+	buf += sprintf(buf, "nObjectLookups..... %u\n", dev->nObjectLookups);
+	buf += sprintf(buf, "probesPerLookup.... %u.%02u\n",
+			yaffs_probes_per_lookup(dev) / 100,
+			yaffs_probes_per_lookup(dev) % 100);
 	buf += sprintf(buf, "nFreeChunks........ %d\n", dev->nFreeChunks);
 	buf += sprintf(buf, "\n");
 	buf += sprintf(buf, "nPageWrites........ %u\n", dev->nPageWrites);
@@ -2925,6 +3001,9 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "passiveGCs......... %u\n", dev->passiveGCs);
 	buf += sprintf(buf, "oldestDirtyGCs..... %u\n", dev->oldestDirtyGCs);
 	buf += sprintf(buf, "backgroundGCs...... %u\n", dev->backgroundGCs);
+	buf += sprintf(buf, "indexedGCs......... %u\n", dev->indexedGCs);
+	buf += sprintf(buf, "writeAmplification. %s\n",
+			yaffs_write_amplification(waBuf, dev));
 	buf += sprintf(buf, "nRetriedWrites..... %u\n", dev->nRetriedWrites);
 	buf += sprintf(buf, "nRetireBlocks...... %u\n", dev->nRetiredBlocks);
 	buf += sprintf(buf, "eccFixed........... %u\n", dev->eccFixed);
@@ -2935,6 +3014,8 @@ static char *yaffs_dump_dev_part1(char *buf, yaffs_Device * dev)
 	buf += sprintf(buf, "nDeletedFiles...... %u\n", dev->nDeletedFiles);
 	buf += sprintf(buf, "nUnlinkedFiles..... %u\n", dev->nUnlinkedFiles);
 	buf += sprintf(buf, "refreshCount....... %u\n", dev->refreshCount);
+	buf += sprintf(buf, "nSummaryWrites..... %u\n", dev->nSummaryWrites);
+	buf += sprintf(buf, "nSummaryScans...... %u\n", dev->nSummaryScans);
 	buf +=
 	    sprintf(buf, "nBackgroudDeletions %u\n", dev->nBackgroundDeletions);
 
@@ -25,6 +25,7 @@
 #include "yaffs_nand.h"
 
 #include "yaffs_checkptrw.h"
+#include "yaffs_summary.h"
 
 #include "yaffs_nand.h"
 #include "yaffs_packedtags2.h"
@@ -34,6 +35,9 @@
 #define YAFFS_GC_GOOD_ENOUGH 2
 #define YAFFS_GC_PASSIVE_THRESHOLD 4
 
+/* Ages (in blocks allocated since) beyond this all count the same for gc */
+#define YAFFS_GC_MAX_AGE 0xFFFF
+
 #define YAFFS_SMALL_HOLE_THRESHOLD 3
 
 /*
@@ -111,6 +115,10 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId);
 
 static void yaffs_InvalidateCheckpoint(yaffs_Device *dev);
 
+static void yaffs_GcIndexUpdate(yaffs_Device *dev, int blockNo,
+				yaffs_BlockInfo *bi);
+static void yaffs_GcIndexRemove(yaffs_Device *dev, int blockNo);
+
 static int yaffs_FindChunkInFile(yaffs_Object *in, int chunkInInode,
 				yaffs_ExtendedTags *tags);
 
@@ -854,7 +862,7 @@ static void yaffs_VerifyObjects(yaffs_Device *dev)
 
 	/* Iterate through the objects in each hash entry */
 
-	for (i = 0; i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; i < dev->nObjectBuckets; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -867,12 +875,13 @@ static void yaffs_VerifyObjects(yaffs_Device *dev)
 
 /*
  *  Simple hash function. Needs to have a reasonable spread
+ *  The number of buckets is always a power of 2.
  */
 
-static Y_INLINE int yaffs_HashFunction(int n)
+static Y_INLINE int yaffs_HashFunction(yaffs_Device *dev, int n)
 {
 	n = abs(n);
-	return n % YAFFS_NOBJECT_BUCKETS;
+	return n & (dev->nObjectBuckets - 1);
 }
 
 /*
@@ -1039,6 +1048,8 @@ static int yaffs_WriteNewChunkWithTagsToNAND(struct yaffs_DeviceStruct *dev,
 		/* Copy the data into the robustification buffer */
 		yaffs_HandleWriteChunkOk(dev, chunk, data, tags);
 
+		yaffs_SummaryAdd(dev, tags, chunk);
+
 	} while (writeOk != YAFFS_OK &&
 		(yaffs_wr_attempts <= 0 || attempts <= yaffs_wr_attempts));
 
@@ -1080,7 +1091,7 @@ static void yaffs_CalcOldestDirtySequence(yaffs_Device *dev)
 	b = dev->blockInfo;
 	for (i = dev->internalStartBlock; i <= dev->internalEndBlock; i++) {
 		if (b->blockState == YAFFS_BLOCK_STATE_FULL &&
-			(b->pagesInUse - b->softDeletions) < dev->param.nChunksPerBlock &&
+			(b->pagesInUse - b->softDeletions) < dev->chunksPerSummary &&
 			b->sequenceNumber < seq) {
 			seq = b->sequenceNumber;
 			blockNo = i;
@@ -1279,6 +1290,44 @@ static void yaffs_SetObjectName(yaffs_Object *obj, const YCHAR *name)
  * in the tnode.
  */
 
+/*
+ * Extents.
+ * A level 0 tnode that maps consecutive NAND chunks is replaced in its
+ * level 1 parent by a tagged word instead of a pointer:
+ *	(base << 2) | (lo << 1) | 1
+ * Entry pos >= lo is chunk base + pos and entries below lo are empty.
+ * lo is 1 only for the first level 0 tnode of a file, whose entry 0
+ * (chunk id 0) is never used.
+ *
+ * yaffs_GetChunkGroupBase() reads extents like any level 0 tnode. Code
+ * that changes entries gets a real tnode from yaffs_AddOrFindLevel0Tnode()
+ * first, and yaffs_FreeTnode() just forgets an extent. The top of the
+ * tree is never an extent. Only used when chunkGroupBits is 0, so that
+ * entries are chunk numbers.
+ */
+#define YAFFS_TNODE_EXTENT	1
+
+static Y_INLINE int yaffs_TnodeIsExtent(yaffs_Tnode *tn)
+{
+	return ((unsigned long)tn) & YAFFS_TNODE_EXTENT;
+}
+
+static Y_INLINE unsigned yaffs_ExtentLo(yaffs_Tnode *tn)
+{
+	return (((unsigned long)tn) >> 1) & 1;
+}
+
+static Y_INLINE __u32 yaffs_ExtentBase(yaffs_Tnode *tn)
+{
+	return (__u32)(((unsigned long)tn) >> 2);
+}
+
+static Y_INLINE yaffs_Tnode *yaffs_MakeExtent(__u32 base, unsigned lo)
+{
+	return (yaffs_Tnode *)((((unsigned long)base) << 2) | (lo << 1) |
+				YAFFS_TNODE_EXTENT);
+}
+
 /* yaffs_CreateTnodes creates a bunch more tnodes and
  * adds them to the tnode free list.
  * Don't use this function directly
@@ -1421,7 +1470,10 @@ static yaffs_Tnode *yaffs_GetTnode(yaffs_Device *dev)
 /* FreeTnode frees up a tnode and puts it back on the free list */
 static void yaffs_FreeTnode(yaffs_Device *dev, yaffs_Tnode *tn)
 {
-	if (tn) {
+	if (tn && yaffs_TnodeIsExtent(tn)) {
+		/* Nothing was allocated for it */
+		dev->nTnodeExtents--;
+	} else if (tn) {
 #ifdef CONFIG_YAFFS_VALGRIND_TEST
 		YFREE(tn);
 		dev->nTnodesCreated--;
@@ -1459,6 +1511,7 @@ static void yaffs_DeinitialiseTnodes(yaffs_Device *dev)
 	dev->freeTnodes = NULL;
 	dev->nFreeTnodes = 0;
 	dev->nTnodesCreated = 0;
+	dev->nTnodeExtents = 0;
 }
 
 static void yaffs_InitialiseTnodes(yaffs_Device *dev)
@@ -1467,6 +1520,7 @@ static void yaffs_InitialiseTnodes(yaffs_Device *dev)
 	dev->freeTnodes = NULL;
 	dev->nFreeTnodes = 0;
 	dev->nTnodesCreated = 0;
+	dev->nTnodeExtents = 0;
 }
 
 
@@ -1511,6 +1565,9 @@ static __u32 yaffs_GetChunkGroupBase(yaffs_Device *dev, yaffs_Tnode *tn,
 
 	pos &= YAFFS_TNODES_LEVEL0_MASK;
 
+	if (yaffs_TnodeIsExtent(tn))
+		return (pos < yaffs_ExtentLo(tn)) ? 0 : yaffs_ExtentBase(tn) + pos;
+
 	bitInMap = pos * dev->tnodeWidth;
 	wordInMap = bitInMap / 32;
 	bitInWord = bitInMap & (32 - 1);
@@ -1580,6 +1637,61 @@ static yaffs_Tnode *yaffs_FindLevel0Tnode(yaffs_Device *dev,
 	return tn;
 }
 
+/* CollapseLevel0Tnode turns the level 0 tnode holding chunkId into an
+ * extent if it maps consecutive chunks. Called after chunkId is added.
+ */
+static void yaffs_CollapseLevel0Tnode(yaffs_Device *dev,
+					yaffs_FileStructure *fStruct,
+					__u32 chunkId)
+{
+	yaffs_Tnode *tn = fStruct->top;
+	yaffs_Tnode *tn0;
+	int level = fStruct->topLevel;
+	unsigned lo, pos;
+	__u32 base;
+	__u32 x;
+
+	if (dev->chunkGroupBits || level < 1 || chunkId > YAFFS_MAX_CHUNK_ID)
+		return;
+
+	/* Traverse down to level 1 */
+	while (level > 1 && tn) {
+		tn = tn->internal[(chunkId >>
+			(YAFFS_TNODES_LEVEL0_BITS +
+				(level - 1) *
+				YAFFS_TNODES_INTERNAL_BITS)) &
+			YAFFS_TNODES_INTERNAL_MASK];
+		level--;
+	}
+
+	if (!tn)
+		return;
+
+	x = (chunkId >> YAFFS_TNODES_LEVEL0_BITS) & YAFFS_TNODES_INTERNAL_MASK;
+	tn0 = tn->internal[x];
+	if (!tn0 || yaffs_TnodeIsExtent(tn0))
+		return;
+
+	lo = (chunkId >> YAFFS_TNODES_LEVEL0_BITS) ? 0 : 1;
+	if (lo && yaffs_GetChunkGroupBase(dev, tn0, 0))
+		return;
+
+	base = yaffs_GetChunkGroupBase(dev, tn0, lo);
+	if (!base || base - lo > (~0UL >> 2))
+		return;
+	base -= lo;
+
+	/* Most level 0 tnodes fail on the last entry: check it first */
+	for (pos = YAFFS_NTNODES_LEVEL0 - 1; pos > lo; pos--) {
+		if (yaffs_GetChunkGroupBase(dev, tn0, pos) != base + pos)
+			return;
+	}
+
+	tn->internal[x] = yaffs_MakeExtent(base, lo);
+	dev->nTnodeExtents++;
+	yaffs_FreeTnode(dev, tn0);
+}
+
 /* AddOrFindLevel0Tnode finds the level 0 tnode if it exists, otherwise first expands the tree.
  * This happens in two steps:
  *  1. If the tree isn't tall enough, then make it taller.
@@ -1622,6 +1734,8 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 
 
 	if (requiredTallness > fStruct->topLevel) {
+		int wasLevel0 = !fStruct->topLevel;
+
 		/* Not tall enough, gotta make the tree taller */
 		for (i = fStruct->topLevel; i < requiredTallness; i++) {
 
@@ -1637,6 +1751,10 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 				return NULL;
 			}
 		}
+
+		/* The old top is now below level 1 and can be an extent */
+		if (wasLevel0)
+			yaffs_CollapseLevel0Tnode(dev, fStruct, 0);
 	}
 
 	/* Traverse down to level 0, adding anything we need */
@@ -1670,6 +1788,19 @@ static yaffs_Tnode *yaffs_AddOrFindLevel0Tnode(yaffs_Device *dev,
 					tn->internal[x] = yaffs_GetTnode(dev);
 					if(!tn->internal[x])
 						return NULL;
+				} else if (yaffs_TnodeIsExtent(tn->internal[x])) {
+					/* The caller is going to change it */
+					yaffs_Tnode *ext = tn->internal[x];
+					yaffs_Tnode *tn0 = yaffs_GetTnode(dev);
+					unsigned pos;
+
+					if (!tn0)
+						return NULL;
+					for (pos = yaffs_ExtentLo(ext); pos < YAFFS_NTNODES_LEVEL0; pos++)
+						yaffs_LoadLevel0Tnode(dev, tn0, pos,
+							yaffs_ExtentBase(ext) + pos);
+					tn->internal[x] = tn0;
+					yaffs_FreeTnode(dev, ext);
 				}
 			}
 
@@ -1823,6 +1954,7 @@ static void yaffs_SoftDeleteChunk(yaffs_Device *dev, int chunk)
 		theBlock->softDeletions++;
 		dev->nFreeChunks++;
 		yaffs_UpdateOldestDirtySequence(dev, blockNo, theBlock);
+		yaffs_GcIndexUpdate(dev, blockNo, theBlock);
 	}
 }
 
@@ -1876,7 +2008,8 @@ static int yaffs_SoftDeleteWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					 * a block.
 					 */
 					yaffs_SoftDeleteChunk(dev, theChunk);
-					yaffs_LoadLevel0Tnode(dev, tn, i, 0);
+					if (!yaffs_TnodeIsExtent(tn))
+						yaffs_LoadLevel0Tnode(dev, tn, i, 0);
 				}
 
 			}
@@ -1949,6 +2082,9 @@ static yaffs_Tnode *yaffs_PruneWorker(yaffs_Device *dev, yaffs_Tnode *tn,
 				if (tn->internal[i])
 					hasData++;
 			}
+		} else if (yaffs_TnodeIsExtent(tn)) {
+			/* Extents are never empty */
+			hasData++;
 		} else {
 			int tnodeSize_u32 = yaffs_CalcTnodeSize(dev)/sizeof(__u32);
 			__u32 *map = (__u32 *)tn;
@@ -2000,7 +2136,8 @@ static int yaffs_PruneFileStructure(yaffs_Device *dev,
 					hasData++;
 			}
 
-			if (!hasData) {
+			/* The top must not become an extent */
+			if (!hasData && !yaffs_TnodeIsExtent(tn->internal[0])) {
 				fStruct->top = tn->internal[0];
 				fStruct->topLevel--;
 				yaffs_FreeTnode(dev, tn);
@@ -2151,8 +2288,9 @@ static void yaffs_UnhashObject(yaffs_Object *tn)
 	/* If it is still linked into the bucket list, free from the list */
 	if (!ylist_empty(&tn->hashLink)) {
 		ylist_del_init(&tn->hashLink);
-		bucket = yaffs_HashFunction(tn->objectId);
+		bucket = yaffs_HashFunction(dev, tn->objectId);
 		dev->objectBucket[bucket].count--;
+		dev->nHashedObjects--;
 	}
 }
 
@@ -2219,20 +2357,82 @@ static void yaffs_DeinitialiseObjects(yaffs_Device *dev)
 	dev->freeObjects = NULL;
 	dev->nFreeObjects = 0;
 	dev->nObjectsCreated = 0;
+
+	if (dev->objectBucket)
+		YFREE_ALT(dev->objectBucket);
+	dev->objectBucket = NULL;
+	dev->nObjectBuckets = 0;
+	dev->nHashedObjects = 0;
 }
 
-static void yaffs_InitialiseObjects(yaffs_Device *dev)
+static yaffs_ObjectBucket *yaffs_AllocateObjectBuckets(int nBuckets)
 {
+	yaffs_ObjectBucket *buckets;
 	int i;
 
+	buckets = YMALLOC_ALT(nBuckets * sizeof(yaffs_ObjectBucket));
+	if (!buckets)
+		return NULL;
+
+	for (i = 0; i < nBuckets; i++) {
+		YINIT_LIST_HEAD(&buckets[i].list);
+		buckets[i].count = 0;
+	}
+	return buckets;
+}
+
+static int yaffs_InitialiseObjects(yaffs_Device *dev)
+{
 	dev->allocatedObjectList = NULL;
 	dev->freeObjects = NULL;
 	dev->nFreeObjects = 0;
 
-	for (i = 0; i < YAFFS_NOBJECT_BUCKETS; i++) {
-		YINIT_LIST_HEAD(&dev->objectBucket[i].list);
-		dev->objectBucket[i].count = 0;
+	dev->nObjectBuckets = YAFFS_NOBJECT_BUCKETS;
+	dev->nHashedObjects = 0;
+	dev->objectBucket = yaffs_AllocateObjectBuckets(dev->nObjectBuckets);
+
+	return dev->objectBucket ? YAFFS_OK : YAFFS_FAIL;
+}
+
+/*
+ * Double the number of object buckets and rehash everything. Object ids
+ * handed out so far stay valid since lookups only depend on the id.
+ * If we can't get the memory we carry on with longer chains.
+ */
+static void yaffs_GrowObjectHash(yaffs_Device *dev)
+{
+	int nBuckets = dev->nObjectBuckets * 2;
+	yaffs_ObjectBucket *oldBuckets = dev->objectBucket;
+	int nOldBuckets = dev->nObjectBuckets;
+	yaffs_ObjectBucket *buckets;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_Object *obj;
+	int b;
+	int newBucket;
+
+	buckets = yaffs_AllocateObjectBuckets(nBuckets);
+	if (!buckets)
+		return;
+
+	dev->objectBucket = buckets;
+	dev->nObjectBuckets = nBuckets;
+
+	for (b = 0; b < nOldBuckets; b++) {
+		ylist_for_each_safe(i, n, &oldBuckets[b].list) {
+			obj = ylist_entry(i, yaffs_Object, hashLink);
+			newBucket = yaffs_HashFunction(dev, obj->objectId);
+			ylist_del(&obj->hashLink);
+			ylist_add(&obj->hashLink, &buckets[newBucket].list);
+			buckets[newBucket].count++;
+		}
 	}
+
+	YFREE_ALT(oldBuckets);
+
+	T(YAFFS_TRACE_OS,
+	  (TSTR("yaffs: object hash grown to %d buckets for %d objects" TENDSTR),
+	  nBuckets, dev->nHashedObjects));
 }
 
 static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
@@ -2248,7 +2448,7 @@ static int yaffs_FindNiceObjectBucket(yaffs_Device *dev)
 
 	for (i = 0; i < 10 && lowest > 4; i++) {
 		dev->bucketFinder++;
-		dev->bucketFinder %= YAFFS_NOBJECT_BUCKETS;
+		dev->bucketFinder &= dev->nObjectBuckets - 1;
 		if (dev->objectBucket[dev->bucketFinder].count < lowest) {
 			lowest = dev->objectBucket[dev->bucketFinder].count;
 			l = dev->bucketFinder;
@@ -2276,7 +2476,7 @@ static int yaffs_CreateNewObjectNumber(yaffs_Device *dev)
 
 	while (!found) {
 		found = 1;
-		n += YAFFS_NOBJECT_BUCKETS;
+		n += dev->nObjectBuckets;
 		if (1 || dev->objectBucket[bucket].count > 0) {
 			ylist_for_each(i, &dev->objectBucket[bucket].list) {
 				/* If there is already one in the list */
@@ -2293,20 +2493,30 @@ static int yaffs_CreateNewObjectNumber(yaffs_Device *dev)
 
 static void yaffs_HashObject(yaffs_Object *in)
 {
-	int bucket = yaffs_HashFunction(in->objectId);
 	yaffs_Device *dev = in->myDev;
+	int bucket;
+
+	/* Keep the chains about YAFFS_OBJECT_BUCKET_LOAD long */
+	if (dev->nHashedObjects >= dev->nObjectBuckets * YAFFS_OBJECT_BUCKET_LOAD &&
+	    dev->nObjectBuckets < YAFFS_MAX_OBJECT_BUCKETS)
+		yaffs_GrowObjectHash(dev);
 
+	bucket = yaffs_HashFunction(dev, in->objectId);
 	ylist_add(&in->hashLink, &dev->objectBucket[bucket].list);
 	dev->objectBucket[bucket].count++;
+	dev->nHashedObjects++;
 }
 
 yaffs_Object *yaffs_FindObjectByNumber(yaffs_Device *dev, __u32 number)
 {
-	int bucket = yaffs_HashFunction(number);
+	int bucket = yaffs_HashFunction(dev, number);
 	struct ylist_head *i;
 	yaffs_Object *in;
 
+	dev->nObjectLookups++;
+
 	ylist_for_each(i, &dev->objectBucket[bucket].list) {
+		dev->nObjectProbes++;
 		/* Look if it is in the list */
 		if (i) {
 			in = ylist_entry(i, yaffs_Object, hashLink);
@@ -2866,6 +3076,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
 	}
+	yaffs_GcIndexRemove(dev, blockNo);
 
 	if (!bi->needsRetiring) {
 		yaffs_InvalidateCheckpoint(dev);
@@ -2906,7 +3117,7 @@ static void yaffs_BlockBecameDirty(yaffs_Device *dev, int blockNo)
 		T(YAFFS_TRACE_ERASE,
 		  (TSTR("Erased block %d" TENDSTR), blockNo));
 	} else {
-		dev->nFreeChunks -= dev->param.nChunksPerBlock;	/* We lost a block of free space */
+		dev->nFreeChunks -= dev->chunksPerSummary;	/* We lost a block of free space */
 
 		yaffs_RetireBlock(dev, blockNo);
 		T(YAFFS_TRACE_ERROR | YAFFS_TRACE_BAD_BLOCKS,
@@ -2986,7 +3197,7 @@ static int yaffs_CalcCheckpointBlocksRequired(yaffs_Device *dev)
 		nBytes += devBlocks * sizeof(yaffs_BlockInfo);
 		nBytes += devBlocks * dev->chunkBitmapStride;
 		nBytes += (sizeof(yaffs_CheckpointObject) + sizeof(__u32)) * (dev->nObjectsCreated - dev->nFreeObjects);
-		nBytes += (tnodeSize + sizeof(__u32)) * (dev->nTnodesCreated - dev->nFreeTnodes);
+		nBytes += (tnodeSize + sizeof(__u32)) * (dev->nTnodesCreated - dev->nFreeTnodes + dev->nTnodeExtents);
 		nBytes += sizeof(yaffs_CheckpointValidity);
 		nBytes += sizeof(__u32); /* checksum*/
 
@@ -3019,7 +3230,7 @@ static int yaffs_CheckSpaceForAllocation(yaffs_Device *dev, int nChunks)
 		checkpointBlocks = 0;
 	}
 
-	reservedChunks = ((reservedBlocks + checkpointBlocks) * dev->param.nChunksPerBlock);
+	reservedChunks = ((reservedBlocks + checkpointBlocks) * dev->chunksPerSummary);
 
 	return (dev->nFreeChunks > (reservedChunks + nChunks));
 }
@@ -3060,8 +3271,10 @@ static int yaffs_AllocateChunk(yaffs_Device *dev, int useReserve,
 
 		dev->nFreeChunks--;
 
-		/* If the block is full set the state to full */
-		if (dev->allocationPage >= dev->param.nChunksPerBlock) {
+		/* If the block is full set the state to full.
+		 * Any chunks past chunksPerSummary hold the block summary.
+		 */
+		if (dev->allocationPage >= dev->chunksPerSummary) {
 			bi->blockState = YAFFS_BLOCK_STATE_FULL;
 			dev->allocationBlock = -1;
 		}
@@ -3082,10 +3295,10 @@ static int yaffs_GetErasedChunks(yaffs_Device *dev)
 {
 	int n;
 
-	n = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	n = dev->nErasedBlocks * dev->chunksPerSummary;
 
 	if (dev->allocationBlock > 0)
-		n += (dev->param.nChunksPerBlock - dev->allocationPage);
+		n += (dev->chunksPerSummary - dev->allocationPage);
 
 	return n;
 
@@ -3376,6 +3589,105 @@ static int yaffs_GarbageCollectBlock(yaffs_Device *dev, int block,
 	return retVal;
 }
 
+/*
+ * Cost-benefit score for collecting a block: the space gained against the
+ * cost of copying out the chunks still in use, (free / 2 * used) * age.
+ * On yaffs2 the age is how many blocks have been allocated since this one,
+ * so cold blocks are collected ahead of recently written ones that are
+ * likely to empty themselves as their data is overwritten.
+ * A block holds chunksPerSummary data chunks; a summary chunk is not
+ * space that gc can give back.
+ */
+static __u32 yaffs_GcScore(yaffs_Device *dev, yaffs_BlockInfo *bi)
+{
+	int pagesUsed = bi->pagesInUse - bi->softDeletions;
+	__u32 freeChunks;
+	__u32 age = 1;
+
+	if (pagesUsed <= 0)
+		return 0xFFFFFFFF;
+	if (pagesUsed >= dev->chunksPerSummary)
+		return 0;
+	freeChunks = dev->chunksPerSummary - pagesUsed;
+
+	if (dev->param.isYaffs2 && dev->sequenceNumber > bi->sequenceNumber) {
+		age += dev->sequenceNumber - bi->sequenceNumber;
+		if (age > YAFFS_GC_MAX_AGE)
+			age = YAFFS_GC_MAX_AGE;
+	}
+
+	/* freeChunks < 1024 and age <= 0xFFFF, so this can't overflow */
+	return ((freeChunks * age) << 4) / (2 * pagesUsed);
+}
+
+/*
+ * The gc index keeps the best few candidates seen as chunks get deleted,
+ * so that gc does not have to go looking for them. An empty slot has
+ * block 0 and score 0. Scores go stale as blocks age, so they are only
+ * used to decide what to keep and are recalculated when picking a victim.
+ */
+static void yaffs_GcIndexUpdate(yaffs_Device *dev, int blockNo,
+				yaffs_BlockInfo *bi)
+{
+	__u32 score;
+	int worst = 0;
+	int i;
+
+	if (bi->blockState != YAFFS_BLOCK_STATE_FULL)
+		return;
+
+	score = yaffs_GcScore(dev, bi);
+
+	for (i = 0; i < YAFFS_GC_INDEX_SIZE; i++) {
+		if (dev->gcIndex[i] == blockNo) {
+			dev->gcIndexScore[i] = score;
+			return;
+		}
+		if (dev->gcIndexScore[i] < dev->gcIndexScore[worst])
+			worst = i;
+	}
+
+	if (score > dev->gcIndexScore[worst]) {
+		dev->gcIndex[worst] = blockNo;
+		dev->gcIndexScore[worst] = score;
+	}
+}
+
+static void yaffs_GcIndexRemove(yaffs_Device *dev, int blockNo)
+{
+	int i;
+
+	for (i = 0; i < YAFFS_GC_INDEX_SIZE; i++) {
+		if (dev->gcIndex[i] == blockNo) {
+			dev->gcIndex[i] = 0;
+			dev->gcIndexScore[i] = 0;
+		}
+	}
+}
+
+/*
+ * Is a block with pagesUsed chunks in use and the given score a better gc
+ * candidate than dev->gcDirtiest? Blocks that pass the threshold win over
+ * blocks that don't. Aggressive gc wants space back now so goes for the
+ * emptiest block, otherwise the best cost-benefit score wins.
+ */
+static int yaffs_GcBetterCandidate(yaffs_Device *dev, int pagesUsed,
+				__u32 score, int threshold, int aggressive)
+{
+	int fits = (pagesUsed <= threshold);
+
+	if (dev->gcDirtiest < 1)
+		return 1;
+
+	if (fits != ((int)dev->gcPagesInUse <= threshold))
+		return fits;
+
+	if (aggressive)
+		return pagesUsed < (int)dev->gcPagesInUse;
+
+	return score > dev->gcScore;
+}
+
 /*
  * FindBlockForgarbageCollection is used to select the dirtiest block (or close enough)
  * for garbage collection.
@@ -3392,6 +3704,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 	int prioritisedExists = 0;
 	yaffs_BlockInfo *bi;
 	int threshold;
+	int fromIndex = 0;
 
 	/* First let's see if we need to grab a prioritised block */
 	if (dev->hasPendingPrioritisedGCs && !aggressive) {
@@ -3435,12 +3748,13 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 	if (!selected){
 		int pagesUsed;
+		__u32 score;
 		int nBlocks = dev->internalEndBlock - dev->internalStartBlock + 1;
 		if (aggressive){
-			threshold = dev->param.nChunksPerBlock;
+			threshold = dev->chunksPerSummary;
 			iterations = nBlocks;
 		} else {
-			int maxThreshold = dev->param.nChunksPerBlock/2;
+			int maxThreshold = dev->chunksPerSummary/2;
 			threshold = background ?
 				(dev->gcNotDone + 2) * 2 : 0;
 			if(threshold <YAFFS_GC_PASSIVE_THRESHOLD)
@@ -3453,6 +3767,45 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 				iterations = 100;
 		}
 
+		/* Try the candidates in the gc index first */
+		for (i = 0; i < YAFFS_GC_INDEX_SIZE; i++) {
+			int b = dev->gcIndex[i];
+
+			if (b < 1)
+				continue;
+
+			bi = yaffs_GetBlockInfo(dev, b);
+			pagesUsed = bi->pagesInUse - bi->softDeletions;
+
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+				pagesUsed >= dev->chunksPerSummary) {
+				dev->gcIndex[i] = 0;
+				dev->gcIndexScore[i] = 0;
+				continue;
+			}
+
+			score = yaffs_GcScore(dev, bi);
+			dev->gcIndexScore[i] = score;
+
+			if (yaffs_GcBetterCandidate(dev, pagesUsed, score,
+						threshold, aggressive) &&
+				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
+				dev->gcDirtiest = b;
+				dev->gcPagesInUse = pagesUsed;
+				dev->gcScore = score;
+				fromIndex = 1;
+			}
+		}
+
+		/*
+		 * Only search the array if the index came up with nothing good
+		 * enough; that search is what foreground writes used to pay for.
+		 */
+		if (dev->gcDirtiest > 0 && dev->gcPagesInUse <= threshold)
+			iterations = 0;
+		else
+			fromIndex = 0;
+
 		for (i = 0;
 			i < iterations &&
 			(dev->gcDirtiest < 1 ||
@@ -3467,12 +3820,19 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 
 			pagesUsed = bi->pagesInUse - bi->softDeletions;
 
-			if (bi->blockState == YAFFS_BLOCK_STATE_FULL &&
-				pagesUsed < dev->param.nChunksPerBlock &&
-				(dev->gcDirtiest < 1 || pagesUsed < dev->gcPagesInUse) &&
+			if (bi->blockState != YAFFS_BLOCK_STATE_FULL ||
+				pagesUsed >= dev->chunksPerSummary)
+				continue;
+
+			score = yaffs_GcScore(dev, bi);
+			yaffs_GcIndexUpdate(dev, dev->gcBlockFinder, bi);
+
+			if (yaffs_GcBetterCandidate(dev, pagesUsed, score,
+						threshold, aggressive) &&
 				yaffs_BlockNotDisqualifiedFromGC(dev, bi)) {
 				dev->gcDirtiest = dev->gcBlockFinder;
 				dev->gcPagesInUse = pagesUsed;
+				dev->gcScore = score;
 			}
 		}
 
@@ -3492,6 +3852,7 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 			selected = dev->oldestDirtyBlock;
 			dev->gcDirtiest = selected;
 			dev->oldestDirtyGCs++;
+			fromIndex = 0;
 			bi = yaffs_GetBlockInfo(dev, selected);
 			dev->gcPagesInUse =  bi->pagesInUse - bi->softDeletions;
 		} else
@@ -3502,13 +3863,17 @@ static unsigned yaffs_FindBlockForGarbageCollection(yaffs_Device *dev,
 		T(YAFFS_TRACE_GC,
 		  (TSTR("GC Selected block %d with %d free, prioritised:%d" TENDSTR),
 		  selected,
-		  dev->param.nChunksPerBlock - dev->gcPagesInUse,
+		  dev->chunksPerSummary - dev->gcPagesInUse,
 		  prioritised));
 
 		if(background)
 			dev->backgroundGCs++;
+		if(fromIndex)
+			dev->indexedGCs++;
+		yaffs_GcIndexRemove(dev, selected);
 		dev->gcDirtiest = 0;
 		dev->gcPagesInUse = 0;
+		dev->gcScore = 0;
 		dev->gcNotDone = 0;
 		if(dev->refreshSkip > 0)
 			dev->refreshSkip--;
@@ -3567,7 +3932,7 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 			checkpointBlockAdjust = 0;
 
 		minErased  = dev->param.nReservedBlocks + checkpointBlockAdjust + 1;
-		erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+		erasedChunks = dev->nErasedBlocks * dev->chunksPerSummary;
 
 		/* If we need a block soon then do aggressive gc.*/
 		if (dev->nErasedBlocks < minErased)
@@ -3627,16 +3992,25 @@ static int yaffs_CheckGarbageCollection(yaffs_Device *dev, int background)
 /*
  * yaffs_BackgroundGarbageCollect()
  * Garbage collects. Intended to be called from a background thread.
- * Returns non-zero if at least half the free chunks are erased.
+ * The more urgent it is, the more gc passes are done per call, so that
+ * the background thread keeps ahead of writers as free space runs low.
+ * Returns non-zero if gc got anywhere: a block was picked, or one is still
+ * being collected.
  */
 int yaffs_BackgroundGarbageCollect(yaffs_Device *dev, unsigned urgency)
 {
-	int erasedChunks = dev->nErasedBlocks * dev->param.nChunksPerBlock;
+	int erasedChunks;
+	unsigned passes = urgency > 1 ? urgency : 1;
+	__u32 backgroundGCs = dev->backgroundGCs;
 
 	T(YAFFS_TRACE_BACKGROUND, (TSTR("Background gc %u" TENDSTR),urgency));
 
-	yaffs_CheckGarbageCollection(dev, 1);
-	return erasedChunks > dev->nFreeChunks/2;
+	do {
+		yaffs_CheckGarbageCollection(dev, 1);
+		erasedChunks = dev->nErasedBlocks * dev->chunksPerSummary;
+	} while (--passes > 0 && erasedChunks <= dev->nFreeChunks/2);
+
+	return dev->backgroundGCs != backgroundGCs || dev->gcBlock > 0;
 }
 
 /*-------------------------  TAGS --------------------------------*/
@@ -3706,6 +4080,18 @@ static int yaffs_FindAndDeleteChunkInFile(yaffs_Object *in, int chunkInInode,
 		    yaffs_FindChunkInGroup(dev, theChunk, tags, in->objectId,
 					   chunkInInode);
 
+		/* An extent needs to become a tnode before it can change */
+		if (retVal != -1 && yaffs_TnodeIsExtent(tn)) {
+			tn = yaffs_AddOrFindLevel0Tnode(dev,
+						&in->variant.fileVariant,
+						chunkInInode, NULL);
+			if (!tn) {
+				T(YAFFS_TRACE_ERROR,
+					(TSTR("yaffs: no more tnodes" TENDSTR)));
+				retVal = -1;
+			}
+		}
+
 		/* Delete the entry in the filestructure (if found) */
 		if (retVal != -1)
 			yaffs_LoadLevel0Tnode(dev, tn, chunkInInode, 0);
@@ -3887,6 +4273,9 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 				 */
 				yaffs_DeleteChunk(dev, chunkInNAND, 1,
 						  __LINE__);
+				yaffs_CollapseLevel0Tnode(dev,
+						&in->variant.fileVariant,
+						chunkInInode);
 				return YAFFS_OK;
 			}
 		}
@@ -3897,6 +4286,7 @@ static int yaffs_PutChunkIntoFile(yaffs_Object *in, int chunkInInode,
 		in->nDataChunks++;
 
 	yaffs_LoadLevel0Tnode(dev, tn, chunkInInode, chunkInNAND);
+	yaffs_CollapseLevel0Tnode(dev, &in->variant.fileVariant, chunkInInode);
 
 	return YAFFS_OK;
 }
@@ -3978,7 +4368,8 @@ void yaffs_DeleteChunk(yaffs_Device *dev, int chunkId, int markNAND, int lyn)
 		    bi->blockState != YAFFS_BLOCK_STATE_ALLOCATING &&
 		    bi->blockState != YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
 			yaffs_BlockBecameDirty(dev, block);
-		}
+		} else
+			yaffs_GcIndexUpdate(dev, block, bi);
 
 	}
 
@@ -4225,75 +4616,119 @@ int yaffs_UpdateObjectHeader(yaffs_Object *in, const YCHAR *name, int force,
  *   In Linux, the page cache provides read buffering aand the short op cache provides write
  *   buffering.
  *
- *   There are a limited number (~10) of cache chunks per device so that we don't
- *   need a very intelligent search.
+ *   The cache is looked up through a hash on object id and chunk id, so it can
+ *   be made large. Entries in use are kept in least recently used order and
+ *   dirty entries are also kept on a dirty list, so that neither eviction nor
+ *   flushing has to look at the whole cache.
  */
 
+static struct ylist_head *yaffs_ChunkCacheBucket(yaffs_Device *dev,
+						const yaffs_Object *obj,
+						int chunkId)
+{
+	return &dev->srHash[(obj->objectId * 31 + chunkId) & dev->srHashMask];
+}
+
+static void yaffs_DirtyChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (!cache->dirty) {
+		cache->dirty = 1;
+		ylist_add_tail(&cache->dirtyLink, &dev->srDirty);
+		dev->srNDirty++;
+	}
+}
+
+static void yaffs_CleanChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	if (cache->dirty) {
+		cache->dirty = 0;
+		ylist_del_init(&cache->dirtyLink);
+		dev->srNDirty--;
+	}
+}
+
+/* Drop an entry from the cache, dirty or not, and put it on the free list */
+static void yaffs_ReleaseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache)
+{
+	yaffs_CleanChunkCache(dev, cache);
+	ylist_del_init(&cache->hashLink);
+	ylist_del(&cache->lruLink);
+	ylist_add(&cache->lruLink, &dev->srFree);
+	cache->object = NULL;
+}
+
 static int yaffs_ObjectHasCachedWriteData(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int nCaches = obj->myDev->param.nShortOpCaches;
 
-	for (i = 0; i < nCaches; i++) {
-		cache = &dev->srCache[i];
-		if (cache->object == obj &&
-		    cache->dirty)
+	if (dev->param.nShortOpCaches < 1)
+		return 0;
+
+	ylist_for_each(i, &dev->srDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+		if (cache->object == obj)
 			return 1;
 	}
 
 	return 0;
 }
 
+static int yaffs_ChunkCacheCompare(const void *a, const void *b)
+{
+	const yaffs_ChunkCache *ca = *(const yaffs_ChunkCache **)a;
+	const yaffs_ChunkCache *cb = *(const yaffs_ChunkCache **)b;
+
+	return ca->chunkId - cb->chunkId;
+}
 
+/*
+ * Write out all the dirty chunks of an object in chunk order, so that the
+ * file's data lands on NAND in order. Flushed chunks stay in the cache as
+ * clean chunks.
+ */
 static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 {
 	yaffs_Device *dev = obj->myDev;
-	int lowest = -99;	/* Stop compiler whining. */
-	int i;
+	struct ylist_head *i;
 	yaffs_ChunkCache *cache;
-	int chunkWritten = 0;
-	int nCaches = obj->myDev->param.nShortOpCaches;
-
-	if (nCaches > 0) {
-		do {
-			cache = NULL;
-
-			/* Find the dirty cache for this object with the lowest chunk id. */
-			for (i = 0; i < nCaches; i++) {
-				if (dev->srCache[i].object == obj &&
-				    dev->srCache[i].dirty) {
-					if (!cache
-					    || dev->srCache[i].chunkId <
-					    lowest) {
-						cache = &dev->srCache[i];
-						lowest = cache->chunkId;
-					}
-				}
-			}
+	int chunkWritten = 1;
+	int nFlush = 0;
+	int n;
 
-			if (cache && !cache->locked) {
-				/* Write it out and free it up */
+	if (dev->param.nShortOpCaches < 1)
+		return;
 
-				chunkWritten =
-				    yaffs_WriteChunkDataToObject(cache->object,
-								 cache->chunkId,
-								 cache->data,
-								 cache->nBytes,
-								 1);
-				cache->dirty = 0;
-				cache->object = NULL;
-			}
+	ylist_for_each(i, &dev->srDirty) {
+		cache = ylist_entry(i, yaffs_ChunkCache, dirtyLink);
+		if (cache->object == obj && !cache->locked)
+			dev->srFlushList[nFlush++] = cache;
+	}
 
-		} while (cache && chunkWritten > 0);
+	if (nFlush > 1)
+		yaffs_qsort(dev->srFlushList, nFlush,
+			sizeof(yaffs_ChunkCache *), yaffs_ChunkCacheCompare);
 
-		if (cache) {
-			/* Hoosterman, disk full while writing cache out. */
-			T(YAFFS_TRACE_ERROR,
-			  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
+	for (n = 0; n < nFlush && chunkWritten > 0; n++) {
+		cache = dev->srFlushList[n];
+
+		chunkWritten = yaffs_WriteChunkDataToObject(cache->object,
+							cache->chunkId,
+							cache->data,
+							cache->nBytes,
+							1);
+		if (chunkWritten > 0)
+			yaffs_CleanChunkCache(dev, cache);
+		else
+			yaffs_ReleaseChunkCache(dev, cache);
+	}
+
+	if (chunkWritten <= 0) {
+		/* Hoosterman, disk full while writing cache out. */
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs tragedy: no space during cache write" TENDSTR)));
 
-		}
 	}
 
 }
@@ -4305,97 +4740,83 @@ static void yaffs_FlushFilesChunkCache(yaffs_Object *obj)
 
 void yaffs_FlushEntireDeviceCache(yaffs_Device *dev)
 {
-	yaffs_Object *obj;
-	int nCaches = dev->param.nShortOpCaches;
-	int i;
-
-	/* Find a dirty object in the cache and flush it...
-	 * until there are no further dirty objects.
-	 */
-	do {
-		obj = NULL;
-		for (i = 0; i < nCaches && !obj; i++) {
-			if (dev->srCache[i].object &&
-			    dev->srCache[i].dirty)
-				obj = dev->srCache[i].object;
+	yaffs_ChunkCache *cache;
+	int nDirty;
 
-		}
-		if (obj)
-			yaffs_FlushFilesChunkCache(obj);
+	if (dev->param.nShortOpCaches < 1)
+		return;
 
-	} while (obj);
+	/* Flush the object of the first dirty chunk until there are no
+	 * dirty chunks left, or a flush makes no progress.
+	 */
+	while (!ylist_empty(&dev->srDirty)) {
+		nDirty = dev->srNDirty;
+		cache = ylist_entry(dev->srDirty.next, yaffs_ChunkCache,
+				dirtyLink);
+		yaffs_FlushFilesChunkCache(cache->object);
+		if (dev->srNDirty >= nDirty)
+			break;
+	}
 
 }
 
 
-/* Grab us a cache chunk for use.
- * First look for an empty one.
- * Then look for the least recently used non-dirty one.
- * Then look for the least recently used dirty one...., flush and look again.
+/* Grab us a cache chunk for use and attach it to (in, chunkId).
+ * First take a free one.
+ * Then take the least recently used non-dirty one.
+ * Then flush the object owning the least recently used dirty one and try again.
  */
-static yaffs_ChunkCache *yaffs_GrabChunkCacheWorker(yaffs_Device *dev)
+static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Object *in, int chunkId)
 {
-	int i;
-
-	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (!dev->srCache[i].object)
-				return &dev->srCache[i];
-		}
-	}
-
-	return NULL;
-}
-
-static yaffs_ChunkCache *yaffs_GrabChunkCache(yaffs_Device *dev)
-{
-	yaffs_ChunkCache *cache;
-	yaffs_Object *theObj;
-	int usage;
-	int i;
-	int pushout;
-
-	if (dev->param.nShortOpCaches > 0) {
-		/* Try find a non-dirty one... */
-
-		cache = yaffs_GrabChunkCacheWorker(dev);
-
-		if (!cache) {
-			/* They were all dirty, find the last recently used object and flush
-			 * its cache, then  find again.
-			 * NB what's here is not very accurate, we actually flush the object
-			 * the last recently used page.
-			 */
+	yaffs_Device *dev = in->myDev;
+	yaffs_ChunkCache *cache = NULL;
+	yaffs_ChunkCache *lruDirty = NULL;
+	struct ylist_head *i;
+	int tries;
 
-			/* With locking we can't assume we can use entry zero */
+	if (dev->param.nShortOpCaches < 1)
+		return NULL;
 
-			theObj = NULL;
-			usage = -1;
-			cache = NULL;
-			pushout = -1;
+	for (tries = 0; tries < 2 && !cache; tries++) {
+		if (!ylist_empty(&dev->srFree)) {
+			cache = ylist_entry(dev->srFree.next,
+					yaffs_ChunkCache, lruLink);
+			break;
+		}
 
-			for (i = 0; i < dev->param.nShortOpCaches; i++) {
-				if (dev->srCache[i].object &&
-				    !dev->srCache[i].locked &&
-				    (dev->srCache[i].lastUse < usage || !cache)) {
-					usage = dev->srCache[i].lastUse;
-					theObj = dev->srCache[i].object;
-					cache = &dev->srCache[i];
-					pushout = i;
-				}
+		ylist_for_each(i, &dev->srLru) {
+			yaffs_ChunkCache *c =
+				ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (c->locked)
+				continue;
+			if (!c->dirty) {
+				cache = c;
+				break;
 			}
+			if (!lruDirty)
+				lruDirty = c;
+		}
 
-			if (!cache || cache->dirty) {
-				/* Flush and try again */
-				yaffs_FlushFilesChunkCache(theObj);
-				cache = yaffs_GrabChunkCacheWorker(dev);
-			}
+		if (!cache && lruDirty && tries == 0)
+			yaffs_FlushFilesChunkCache(lruDirty->object);
+	}
 
-		}
-		return cache;
-	} else
+	if (!cache)
 		return NULL;
 
+	if (cache->object)
+		yaffs_ReleaseChunkCache(dev, cache);
+
+	cache->object = in;
+	cache->chunkId = chunkId;
+	cache->dirty = 0;
+	cache->locked = 0;
+	cache->nBytes = 0;
+	ylist_del(&cache->lruLink);
+	ylist_add_tail(&cache->lruLink, &dev->srLru);
+	ylist_add(&cache->hashLink, yaffs_ChunkCacheBucket(dev, in, chunkId));
+
+	return cache;
 }
 
 /* Find a cached chunk */
@@ -4403,41 +4824,34 @@ static yaffs_ChunkCache *yaffs_FindChunkCache(const yaffs_Object *obj,
 					      int chunkId)
 {
 	yaffs_Device *dev = obj->myDev;
-	int i;
+	struct ylist_head *i;
+	yaffs_ChunkCache *cache;
+
 	if (dev->param.nShortOpCaches > 0) {
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == obj &&
-			    dev->srCache[i].chunkId == chunkId) {
+		ylist_for_each(i, yaffs_ChunkCacheBucket(dev, obj, chunkId)) {
+			cache = ylist_entry(i, yaffs_ChunkCache, hashLink);
+			if (cache->object == obj &&
+			    cache->chunkId == chunkId) {
 				dev->cacheHits++;
 
-				return &dev->srCache[i];
+				return cache;
 			}
 		}
 	}
 	return NULL;
 }
 
-/* Mark the chunk for the least recently used algorithym */
+/* Mark the chunk as the most recently used */
 static void yaffs_UseChunkCache(yaffs_Device *dev, yaffs_ChunkCache *cache,
 				int isAWrite)
 {
 
 	if (dev->param.nShortOpCaches > 0) {
-		if (dev->srLastUse < 0 || dev->srLastUse > 100000000) {
-			/* Reset the cache usages */
-			int i;
-			for (i = 1; i < dev->param.nShortOpCaches; i++)
-				dev->srCache[i].lastUse = 0;
-
-			dev->srLastUse = 0;
-		}
-
-		dev->srLastUse++;
-
-		cache->lastUse = dev->srLastUse;
+		ylist_del(&cache->lruLink);
+		ylist_add_tail(&cache->lruLink, &dev->srLru);
 
 		if (isAWrite)
-			cache->dirty = 1;
+			yaffs_DirtyChunkCache(dev, cache);
 	}
 }
 
@@ -4451,7 +4865,7 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
 		yaffs_ChunkCache *cache = yaffs_FindChunkCache(object, chunkId);
 
 		if (cache)
-			cache->object = NULL;
+			yaffs_ReleaseChunkCache(object->myDev, cache);
 	}
 }
 
@@ -4460,14 +4874,17 @@ static void yaffs_InvalidateChunkCache(yaffs_Object *object, int chunkId)
  */
 static void yaffs_InvalidateWholeChunkCache(yaffs_Object *in)
 {
-	int i;
+	struct ylist_head *i;
+	struct ylist_head *n;
+	yaffs_ChunkCache *cache;
 	yaffs_Device *dev = in->myDev;
 
 	if (dev->param.nShortOpCaches > 0) {
 		/* Invalidate it. */
-		for (i = 0; i < dev->param.nShortOpCaches; i++) {
-			if (dev->srCache[i].object == in)
-				dev->srCache[i].object = NULL;
+		ylist_for_each_safe(i, n, &dev->srLru) {
+			cache = ylist_entry(i, yaffs_ChunkCache, lruLink);
+			if (cache->object == in)
+				yaffs_ReleaseChunkCache(dev, cache);
 		}
 	}
 }
@@ -4512,6 +4929,7 @@ static void yaffs_DeviceToCheckpointDevice(yaffs_CheckpointDevice *cp,
 	cp->allocationBlock = dev->allocationBlock;
 	cp->allocationPage = dev->allocationPage;
 	cp->nFreeChunks = dev->nFreeChunks;
+	cp->chunksPerSummary = dev->chunksPerSummary;
 
 	cp->nDeletedFiles = dev->nDeletedFiles;
 	cp->nUnlinkedFiles = dev->nUnlinkedFiles;
@@ -4579,6 +4997,9 @@ static int yaffs_ReadCheckpointDevice(yaffs_Device *dev)
 	if (cp.structType != sizeof(cp))
 		return 0;
 
+	/* The free space was counted with another block capacity */
+	if (cp.chunksPerSummary != dev->chunksPerSummary)
+		return 0;
 
 	yaffs_CheckpointDeviceToDevice(dev, &cp);
 
@@ -4676,13 +5097,53 @@ static int yaffs_CheckpointObjectToObject(yaffs_Object *obj, yaffs_CheckpointObj
 
 
 
+/*
+ * Level 0 tnodes are checkpointed in a packed form rather than as raw
+ * tnodes. Each record is a varint holding the distance (+1) from the
+ * previous record's base chunk, then one varint per entry: 0 for a hole,
+ * otherwise 1 + the zigzag encoded difference from the chunk group one
+ * past the last non-hole entry. Files written in order have their chunks
+ * mostly in order on NAND, so most entries take a single byte. A varint
+ * of 0 in place of a record ends the file.
+ */
+#define YAFFS_CHECKPOINT_TNODE_MAX_BYTES (5 * (YAFFS_NTNODES_LEVEL0 + 1))
+
+static int yaffs_PutVarint(__u8 *buf, __u32 val)
+{
+	int n = 0;
+
+	while (val >= 0x80) {
+		buf[n++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	buf[n++] = val;
+	return n;
+}
+
+static int yaffs_CheckpointReadVarint(yaffs_Device *dev, __u32 *val)
+{
+	__u8 b;
+	int shift = 0;
+
+	*val = 0;
+	do {
+		if (shift > 28 ||
+		    yaffs_CheckpointRead(dev, &b, 1) != 1)
+			return 0;
+		*val |= (__u32)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	return 1;
+}
+
 static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
-					__u32 level, int chunkOffset)
+					__u32 level, int chunkOffset,
+					__u32 *lastBase)
 {
 	int i;
 	yaffs_Device *dev = in->myDev;
 	int ok = 1;
-	int tnodeSize = yaffs_CalcTnodeSize(dev);
 
 	if (tn) {
 		if (level > 0) {
@@ -4692,14 +5153,36 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 					ok = yaffs_CheckpointTnodeWorker(in,
 							tn->internal[i],
 							level - 1,
-							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i);
+							(chunkOffset<<YAFFS_TNODES_INTERNAL_BITS) + i,
+							lastBase);
 				}
 			}
 		} else if (level == 0) {
 			__u32 baseOffset = chunkOffset <<  YAFFS_TNODES_LEVEL0_BITS;
-			ok = (yaffs_CheckpointWrite(dev, &baseOffset, sizeof(baseOffset)) == sizeof(baseOffset));
-			if (ok)
-				ok = (yaffs_CheckpointWrite(dev, tn, tnodeSize) == tnodeSize);
+			__u8 buf[YAFFS_CHECKPOINT_TNODE_MAX_BYTES];
+			__u32 expected = 0;
+			__u32 val;
+			int n;
+
+			/* The tree is walked in order, so bases only go up */
+			n = yaffs_PutVarint(buf, baseOffset - *lastBase + 1);
+			*lastBase = baseOffset;
+
+			for (i = 0; i < YAFFS_NTNODES_LEVEL0; i++) {
+				val = yaffs_GetChunkGroupBase(dev, tn, i) >>
+					dev->chunkGroupBits;
+				if (!val) {
+					buf[n++] = 0;
+					continue;
+				}
+				/* zigzag, so small steps back stay small */
+				n += yaffs_PutVarint(buf + n,
+					(((val - expected) << 1) ^
+					 (__u32)((__s32)(val - expected) >> 31)) + 1);
+				expected = val + 1;
+			}
+
+			ok = (yaffs_CheckpointWrite(dev, buf, n) == n);
 		}
 	}
 
@@ -4709,14 +5192,15 @@ static int yaffs_CheckpointTnodeWorker(yaffs_Object *in, yaffs_Tnode *tn,
 
 static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
 {
-	__u32 endMarker = ~0;
+	__u8 endMarker = 0;
+	__u32 lastBase = 0;
 	int ok = 1;
 
 	if (obj->variantType == YAFFS_OBJECT_TYPE_FILE) {
 		ok = yaffs_CheckpointTnodeWorker(obj,
 					    obj->variant.fileVariant.top,
 					    obj->variant.fileVariant.topLevel,
-					    0);
+					    0, &lastBase);
 		if (ok)
 			ok = (yaffs_CheckpointWrite(obj->myDev, &endMarker, sizeof(endMarker)) ==
 				sizeof(endMarker));
@@ -4727,35 +5211,54 @@ static int yaffs_WriteCheckpointTnodes(yaffs_Object *obj)
 
 static int yaffs_ReadCheckpointTnodes(yaffs_Object *obj)
 {
-	__u32 baseChunk;
+	__u32 baseChunk = 0;
+	__u32 delta;
+	__u32 code;
+	__u32 expected;
+	__u32 val;
 	int ok = 1;
+	int i;
 	yaffs_Device *dev = obj->myDev;
 	yaffs_FileStructure *fileStructPtr = &obj->variant.fileVariant;
 	yaffs_Tnode *tn;
 	int nread = 0;
-	int tnodeSize = yaffs_CalcTnodeSize(dev);
 
-	ok = (yaffs_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
+	ok = yaffs_CheckpointReadVarint(dev, &delta);
 
-	while (ok && (~baseChunk)) {
+	while (ok && delta) {
 		nread++;
-		/* Read level 0 tnode */
-
+		baseChunk += delta - 1;
 
-		tn = yaffs_GetTnodeRaw(dev);
-		if (tn)
-			ok = (yaffs_CheckpointRead(dev, tn, tnodeSize) == tnodeSize);
-		else
+		/* Read level 0 tnode */
+		tn = yaffs_GetTnode(dev);
+		if (!tn)
 			ok = 0;
 
-		if (tn && ok)
+		expected = 0;
+		for (i = 0; ok && i < YAFFS_NTNODES_LEVEL0; i++) {
+			ok = yaffs_CheckpointReadVarint(dev, &code);
+			if (!ok || !code)
+				continue;
+			code--;
+			val = expected + ((code >> 1) ^ -(code & 1));
+			yaffs_LoadLevel0Tnode(dev, tn, i,
+					val << dev->chunkGroupBits);
+			expected = val + 1;
+		}
+
+		if (tn && ok) {
 			ok = yaffs_AddOrFindLevel0Tnode(dev,
 							fileStructPtr,
 							baseChunk,
 							tn) ? 1 : 0;
+			if (ok)
+				yaffs_CollapseLevel0Tnode(dev, fileStructPtr,
+							baseChunk);
+		} else if (tn)
+			yaffs_FreeTnode(dev, tn);
 
 		if (ok)
-			ok = (yaffs_CheckpointRead(dev, &baseChunk, sizeof(baseChunk)) == sizeof(baseChunk));
+			ok = yaffs_CheckpointReadVarint(dev, &delta);
 
 	}
 
@@ -4780,7 +5283,7 @@ static int yaffs_WriteCheckpointObjects(yaffs_Device *dev)
 	 * dumping them to the checkpointing stream.
 	 */
 
-	for (i = 0; ok &&  i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; ok &&  i < dev->nObjectBuckets; i++) {
 		ylist_for_each(lh, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -5080,15 +5583,10 @@ int yaffs_ReadDataFromFile(yaffs_Object *in, __u8 *buffer, loff_t offset,
 				/* If we can't find the data in the cache, then load it up. */
 
 				if (!cache) {
-					cache = yaffs_GrabChunkCache(in->myDev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					cache = yaffs_GrabChunkCache(in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->
 								      data);
-					cache->nBytes = 0;
 				}
 
 				yaffs_UseChunkCache(dev, cache, 0);
@@ -5207,11 +5705,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 
 				if (!cache
 				    && yaffs_CheckSpaceForAllocation(dev, 1)) {
-					cache = yaffs_GrabChunkCache(dev);
-					cache->object = in;
-					cache->chunkId = chunk;
-					cache->dirty = 0;
-					cache->locked = 0;
+					cache = yaffs_GrabChunkCache(in, chunk);
 					yaffs_ReadChunkDataFromObject(in, chunk,
 								      cache->data);
 				} else if (cache &&
@@ -5242,7 +5736,7 @@ int yaffs_DoWriteDataToFile(yaffs_Object *in, const __u8 *buffer, loff_t offset,
 						     cache->chunkId,
 						     cache->data, cache->nBytes,
 						     1);
-						cache->dirty = 0;
+						yaffs_CleanChunkCache(dev, cache);
 					}
 
 				} else {
@@ -5976,7 +6470,7 @@ static void yaffs_FixHangingObjects(yaffs_Device *dev)
 	 * Make sure it is rooted.
 	 */
 
-	for (i = 0; i <  YAFFS_NOBJECT_BUCKETS; i++) {
+	for (i = 0; i < dev->nObjectBuckets; i++) {
 		ylist_for_each_safe(lh, n, &dev->objectBucket[i].list) {
 			if (lh) {
 				obj = ylist_entry(lh, yaffs_Object, hashLink);
@@ -6118,7 +6612,7 @@ static int yaffs_Scan(yaffs_Device *dev)
 			T(YAFFS_TRACE_SCAN_DEBUG,
 			  (TSTR("Block empty " TENDSTR)));
 			dev->nErasedBlocks++;
-			dev->nFreeChunks += dev->param.nChunksPerBlock;
+			dev->nFreeChunks += dev->chunksPerSummary;
 		}
 		bi++;
 	}
@@ -6183,7 +6677,7 @@ static int yaffs_Scan(yaffs_Device *dev)
 
 				}
 
-				dev->nFreeChunks += (dev->param.nChunksPerBlock - c);
+				dev->nFreeChunks += (dev->chunksPerSummary - c);
 			} else if (tags.chunkId > 0) {
 				/* chunkId > 0 so it is a data chunk... */
 				unsigned int endpos;
@@ -6581,6 +7075,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	int foundChunksInBlock;
 	int equivalentObjectId;
 	int alloc_failed = 0;
+	__u8 *summary = NULL;
+	int useSummary;
 
 
 	yaffs_BlockIndex *blockIndex = NULL;
@@ -6616,6 +7112,8 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 	dev->blocksInCheckpoint = 0;
 
 	chunkData = yaffs_GetTempBuffer(dev, __LINE__);
+	if (dev->chunksPerSummary < dev->param.nChunksPerBlock)
+		summary = yaffs_GetTempBuffer(dev, __LINE__);
 
 	/* Scan all the blocks to determine their state */
 	bi = dev->blockInfo;
@@ -6649,7 +7147,7 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 			T(YAFFS_TRACE_SCAN_DEBUG,
 			  (TSTR("Block empty " TENDSTR)));
 			dev->nErasedBlocks++;
-			dev->nFreeChunks += dev->param.nChunksPerBlock;
+			dev->nFreeChunks += dev->chunksPerSummary;
 		} else if (state == YAFFS_BLOCK_STATE_NEEDS_SCANNING) {
 
 			/* Determine the highest sequence number */
@@ -6733,6 +7231,13 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 		deleted = 0;
 
+		/* A full block with a valid summary needs only that read */
+		useSummary = summary &&
+			state == YAFFS_BLOCK_STATE_NEEDS_SCANNING &&
+			yaffs_SummaryRead(dev, blk, summary) == YAFFS_OK;
+		if (useSummary)
+			dev->nSummaryScans++;
+
 		/* For each chunk in each block that needs scanning.... */
 		foundChunksInBlock = 0;
 		for (c = dev->param.nChunksPerBlock - 1;
@@ -6745,8 +7250,11 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 			chunk = blk * dev->param.nChunksPerBlock + c;
 
-			result = yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL,
-							&tags);
+			if (useSummary)
+				yaffs_SummaryGetTags(dev, summary, blk, c, &tags);
+			else
+				result = yaffs_ReadChunkWithTagsFromNAND(dev,
+							chunk, NULL, &tags);
 
 			/* Let's have a good look at this chunk... */
 
@@ -6793,14 +7301,23 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 					}
 				}
 
-				dev->nFreeChunks++;
+				/* the summary slot is not free space */
+				if (c < dev->chunksPerSummary)
+					dev->nFreeChunks++;
 
 			} else if (tags.eccResult == YAFFS_ECC_RESULT_UNFIXED) {
 				T(YAFFS_TRACE_SCAN,
 				  (TSTR(" Unfixed ECC in chunk(%d:%d), chunk ignored"TENDSTR),
 				  blk, c));
 
-				  dev->nFreeChunks++;
+				if (c < dev->chunksPerSummary)
+					dev->nFreeChunks++;
+
+			} else if (tags.objectId == YAFFS_OBJECTID_SUMMARY) {
+				/* The block summary. It is never in use and
+				 * takes the slot that is not counted as free.
+				 */
+				foundChunksInBlock = 1;
 
 			} else if (tags.chunkId > 0) {
 				/* chunkId > 0 so it is a data chunk... */
@@ -7191,11 +7708,14 @@ static int yaffs_ScanBackwards(yaffs_Device *dev)
 
 
 	yaffs_ReleaseTempBuffer(dev, chunkData, __LINE__);
+	if (summary)
+		yaffs_ReleaseTempBuffer(dev, summary, __LINE__);
 
 	if (alloc_failed)
 		return YAFFS_FAIL;
 
-	T(YAFFS_TRACE_SCAN, (TSTR("yaffs_ScanBackwards ends" TENDSTR)));
+	T(YAFFS_TRACE_SCAN, (TSTR("yaffs_ScanBackwards ends, %d blocks from summaries" TENDSTR),
+		dev->nSummaryScans));
 
 	return YAFFS_OK;
 }
@@ -7781,6 +8301,138 @@ static int yaffs_CreateInitialDirectories(yaffs_Device *dev)
 	return YAFFS_FAIL;
 }
 
+#ifdef CONFIG_YAFFS_TNODE_EXTENT_TEST
+
+#define YAFFS_EXTENT_TEST_CHUNKS	0x10000	/* 128MB with 2k chunks */
+
+static __u32 yaffs_ExtentTestLookup(yaffs_Object *obj, __u32 chunkId)
+{
+	yaffs_Tnode *tn;
+
+	tn = yaffs_FindLevel0Tnode(obj->myDev, &obj->variant.fileVariant,
+				chunkId);
+
+	return tn ? yaffs_GetChunkGroupBase(obj->myDev, tn, chunkId) : 0;
+}
+
+/* Takes chunks from chunkId up out of the tree, the way truncation does */
+static const char *yaffs_ExtentTestTruncate(yaffs_Object *obj, __u32 chunkId,
+					__u32 nChunks)
+{
+	yaffs_Device *dev = obj->myDev;
+	yaffs_Tnode *tn;
+	__u32 i;
+
+	for (i = nChunks; i >= chunkId; i--) {
+		tn = yaffs_AddOrFindLevel0Tnode(dev, &obj->variant.fileVariant,
+						i, NULL);
+		if (!tn)
+			return "out of tnodes";
+		yaffs_LoadLevel0Tnode(dev, tn, i, 0);
+	}
+	yaffs_PruneFileStructure(dev, &obj->variant.fileVariant);
+
+	return NULL;
+}
+
+/*
+ * Maps a large file written in order onto a scratch object, without
+ * touching NAND, and checks every chunk while its level 0 tnodes become
+ * extents and are rewritten, truncated and freed.
+ */
+static void yaffs_TestTnodeExtents(yaffs_Device *dev)
+{
+	yaffs_Object *obj;
+	__u32 nChunks = YAFFS_EXTENT_TEST_CHUNKS;
+	__u32 first = 5;
+	__u32 moved;
+	__u32 i;
+	int tnodes = dev->nTnodesCreated - dev->nFreeTnodes;
+	int extents = dev->nTnodeExtents;
+	int fullLeaves;
+	int used = 0;
+	const char *fail = NULL;
+
+	if (dev->chunkGroupBits) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: tnode extent test skipped, chunk groups in use"
+			TENDSTR)));
+		return;
+	}
+
+	/* Chunks first + 1 .. first + nChunks + 1 must fit in an entry */
+	if (nChunks > dev->tnodeMask - first - 1)
+		nChunks = dev->tnodeMask - first - 1;
+	fullLeaves = (nChunks + 1) / YAFFS_NTNODES_LEVEL0;
+	moved = nChunks / 2;
+
+	obj = YMALLOC(sizeof(yaffs_Object));
+	if (!obj)
+		return;
+	memset(obj, 0, sizeof(yaffs_Object));
+	obj->myDev = dev;
+	obj->variantType = YAFFS_OBJECT_TYPE_FILE;
+	obj->variant.fileVariant.top = yaffs_GetTnode(dev);
+	if (!obj->variant.fileVariant.top) {
+		YFREE(obj);
+		return;
+	}
+
+	for (i = 1; !fail && i <= nChunks; i++) {
+		if (!yaffs_PutChunkIntoFile(obj, i, first + i, 0))
+			fail = "out of tnodes";
+	}
+	for (i = 1; !fail && i <= nChunks; i++) {
+		if (yaffs_ExtentTestLookup(obj, i) != first + i)
+			fail = "sequential lookup";
+	}
+	if (!fail && dev->nTnodeExtents - extents != fullLeaves)
+		fail = "sequential extent count";
+	used = dev->nTnodesCreated - dev->nFreeTnodes - tnodes;
+
+	/* Rewriting a chunk turns its extent back into a tnode, and back */
+	if (!fail && !yaffs_PutChunkIntoFile(obj, moved, first + nChunks + 1, 0))
+		fail = "out of tnodes";
+	for (i = moved & ~YAFFS_TNODES_LEVEL0_MASK;
+	     !fail && i <= (moved | YAFFS_TNODES_LEVEL0_MASK); i++) {
+		if (i && yaffs_ExtentTestLookup(obj, i) !=
+				(i == moved ? first + nChunks + 1 : first + i))
+			fail = "rewritten lookup";
+	}
+	if (!fail && dev->nTnodeExtents - extents != fullLeaves - 1)
+		fail = "rewritten extent count";
+	if (!fail && !yaffs_PutChunkIntoFile(obj, moved, first + moved, 0))
+		fail = "out of tnodes";
+	if (!fail && dev->nTnodeExtents - extents != fullLeaves)
+		fail = "restored extent count";
+
+	/* Truncate into the middle of an extent */
+	if (!fail)
+		fail = yaffs_ExtentTestTruncate(obj, moved + 3, nChunks);
+	for (i = 1; !fail && i <= nChunks; i++) {
+		if (yaffs_ExtentTestLookup(obj, i) !=
+				(i < moved + 3 ? first + i : 0))
+			fail = "truncated lookup";
+	}
+
+	if (!fail)
+		fail = yaffs_ExtentTestTruncate(obj, 1, moved + 2);
+	yaffs_FreeTnode(dev, obj->variant.fileVariant.top);
+	YFREE(obj);
+
+	if (!fail && (dev->nTnodesCreated - dev->nFreeTnodes != tnodes ||
+			dev->nTnodeExtents != extents))
+		fail = "tnodes leaked";
+
+	T(YAFFS_TRACE_ALWAYS,
+	  (TSTR("yaffs: tnode extent test %s%s: %u chunks in %d tnodes,"
+		" %d without extents" TENDSTR),
+	   fail ? "FAILED on " : "passed", fail ? fail : "",
+	   nChunks, used, used + fullLeaves));
+}
+
+#endif
+
 int yaffs_GutsInitialise(yaffs_Device *dev)
 {
 	int init_failed = 0;
@@ -7935,7 +8587,11 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->passiveGCs = 0;
 	dev->oldestDirtyGCs = 0;
 	dev->backgroundGCs = 0;
+	dev->indexedGCs = 0;
 	dev->gcBlockFinder = 0;
+	dev->gcScore = 0;
+	memset(dev->gcIndex, 0, sizeof(dev->gcIndex));
+	memset(dev->gcIndexScore, 0, sizeof(dev->gcIndexScore));
 	dev->bufferedBlock = -1;
 	dev->doingBufferedBlockRewrite = 0;
 	dev->nDeletedFiles = 0;
@@ -7961,32 +8617,54 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	dev->gcCleanupList = NULL;
 
 
+	dev->srHash = NULL;
+	dev->srFlushList = NULL;
+	YINIT_LIST_HEAD(&dev->srLru);
+	YINIT_LIST_HEAD(&dev->srFree);
+	YINIT_LIST_HEAD(&dev->srDirty);
+	dev->srNDirty = 0;
+
 	if (!init_failed &&
 	    dev->param.nShortOpCaches > 0) {
 		int i;
 		void *buf;
-		int srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		int srCacheBytes;
+		int nBuckets = 1;
 
 		if (dev->param.nShortOpCaches > YAFFS_MAX_SHORT_OP_CACHES)
 			dev->param.nShortOpCaches = YAFFS_MAX_SHORT_OP_CACHES;
 
-		dev->srCache =  YMALLOC(srCacheBytes);
+		/* About two entries per hash bucket */
+		while (nBuckets * 2 < dev->param.nShortOpCaches)
+			nBuckets <<= 1;
+		dev->srHashMask = nBuckets - 1;
+
+		srCacheBytes = dev->param.nShortOpCaches * sizeof(yaffs_ChunkCache);
+		dev->srCache = YMALLOC_ALT(srCacheBytes);
+		dev->srHash = YMALLOC(nBuckets * sizeof(struct ylist_head));
+		dev->srFlushList = YMALLOC_ALT(dev->param.nShortOpCaches *
+					sizeof(yaffs_ChunkCache *));
 
 		buf = (__u8 *) dev->srCache;
+		if (!dev->srHash || !dev->srFlushList)
+			buf = NULL;
 
 		if (dev->srCache)
 			memset(dev->srCache, 0, srCacheBytes);
 
+		for (i = 0; i < nBuckets && buf; i++)
+			YINIT_LIST_HEAD(&dev->srHash[i]);
+
 		for (i = 0; i < dev->param.nShortOpCaches && buf; i++) {
 			dev->srCache[i].object = NULL;
-			dev->srCache[i].lastUse = 0;
 			dev->srCache[i].dirty = 0;
+			YINIT_LIST_HEAD(&dev->srCache[i].hashLink);
+			YINIT_LIST_HEAD(&dev->srCache[i].dirtyLink);
+			ylist_add_tail(&dev->srCache[i].lruLink, &dev->srFree);
 			dev->srCache[i].data = buf = YMALLOC_DMA(dev->param.totalBytesPerChunk);
 		}
 		if (!buf)
 			init_failed = 1;
-
-		dev->srLastUse = 0;
 	}
 
 	dev->cacheHits = 0;
@@ -7997,6 +8675,13 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 			init_failed = 1;
 	}
 
+	dev->nSummaryWrites = 0;
+	dev->nSummaryScans = 0;
+	dev->nObjectLookups = 0;
+	dev->nObjectProbes = 0;
+	if (!init_failed && !yaffs_SummaryInit(dev))
+		init_failed = 1;
+
 	if (dev->param.isYaffs2)
 		dev->param.useHeaderFileSize = 1;
 
@@ -8004,7 +8689,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 		init_failed = 1;
 
 	yaffs_InitialiseTnodes(dev);
-	yaffs_InitialiseObjects(dev);
+	if (!init_failed && !yaffs_InitialiseObjects(dev))
+		init_failed = 1;
 
 	if (!init_failed && !yaffs_CreateInitialDirectories(dev))
 		init_failed = 1;
@@ -8039,7 +8725,8 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 					init_failed = 1;
 
 				yaffs_InitialiseTnodes(dev);
-				yaffs_InitialiseObjects(dev);
+				if (!init_failed && !yaffs_InitialiseObjects(dev))
+					init_failed = 1;
 
 				if (!init_failed && !yaffs_CreateInitialDirectories(dev))
 					init_failed = 1;
@@ -8077,6 +8764,10 @@ int yaffs_GutsInitialise(yaffs_Device *dev)
 	yaffs_VerifyFreeChunks(dev);
 	yaffs_VerifyBlocks(dev);
 
+#ifdef CONFIG_YAFFS_TNODE_EXTENT_TEST
+	yaffs_TestTnodeExtents(dev);
+#endif
+
 	/* Clean up any aborted checkpoint data */
 	if(!dev->isCheckpointed && dev->blocksInCheckpoint > 0)
 		yaffs_InvalidateCheckpoint(dev);
@@ -8104,12 +8795,20 @@ void yaffs_Deinitialise(yaffs_Device *dev)
 				dev->srCache[i].data = NULL;
 			}
 
-			YFREE(dev->srCache);
+			YFREE_ALT(dev->srCache);
 			dev->srCache = NULL;
 		}
+		if (dev->srHash)
+			YFREE(dev->srHash);
+		dev->srHash = NULL;
+		if (dev->srFlushList)
+			YFREE_ALT(dev->srFlushList);
+		dev->srFlushList = NULL;
 
 		YFREE(dev->gcCleanupList);
 
+		yaffs_SummaryDeinit(dev);
+
 		for (i = 0; i < YAFFS_N_TEMP_BUFFERS; i++)
 			YFREE(dev->tempBuffer[i].buffer);
 
@@ -8135,7 +8834,7 @@ static int yaffs_CountFreeChunks(yaffs_Device *dev)
 		case YAFFS_BLOCK_STATE_COLLECTING:
 		case YAFFS_BLOCK_STATE_FULL:
 			nFree +=
-			    (dev->param.nChunksPerBlock - blk->pagesInUse +
+			    (dev->chunksPerSummary - blk->pagesInUse +
 			     blk->softDeletions);
 			break;
 		default:
@@ -8147,6 +8846,16 @@ static int yaffs_CountFreeChunks(yaffs_Device *dev)
 	return nFree;
 }
 
+/* Average bytes of object and tnode memory for each object in use */
+int yaffs_GetRamPerObject(yaffs_Device *dev)
+{
+	int nObjects = dev->nObjectsCreated - dev->nFreeObjects;
+	int ram = dev->nObjectsCreated * sizeof(yaffs_Object) +
+		dev->nTnodesCreated * yaffs_CalcTnodeSize(dev);
+
+	return nObjects > 0 ? ram / nObjects : 0;
+}
+
 int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 {
 	/* This is what we report to the outside world */
@@ -8154,7 +8863,6 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 	int nFree;
 	int nDirtyCacheChunks;
 	int blocksForCheckpoint;
-	int i;
 
 #if 1
 	nFree = dev->nFreeChunks;
@@ -8166,21 +8874,18 @@ int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev)
 
 	/* Now count the number of dirty chunks in the cache and subtract those */
 
-	for (nDirtyCacheChunks = 0, i = 0; i < dev->param.nShortOpCaches; i++) {
-		if (dev->srCache[i].dirty)
-			nDirtyCacheChunks++;
-	}
+	nDirtyCacheChunks = dev->srNDirty;
 
 	nFree -= nDirtyCacheChunks;
 
-	nFree -= ((dev->param.nReservedBlocks + 1) * dev->param.nChunksPerBlock);
+	nFree -= ((dev->param.nReservedBlocks + 1) * dev->chunksPerSummary);
 
 	/* Now we figure out how much to reserve for the checkpoint and report that... */
 	blocksForCheckpoint = yaffs_CalcCheckpointBlocksRequired(dev) - dev->blocksInCheckpoint;
 	if (blocksForCheckpoint < 0)
 		blocksForCheckpoint = 0;
 
-	nFree -= (blocksForCheckpoint * dev->param.nChunksPerBlock);
+	nFree -= (blocksForCheckpoint * dev->chunksPerSummary);
 
 	if (nFree < 0)
 		nFree = 0;
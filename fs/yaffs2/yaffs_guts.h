@@ -58,12 +58,14 @@
 #define YAFFS_ALLOCATION_NTNODES	100
 #define YAFFS_ALLOCATION_NLINKS		100
 
-#define YAFFS_NOBJECT_BUCKETS		256
+#define YAFFS_NOBJECT_BUCKETS		256	/* initial number of buckets */
+#define YAFFS_MAX_OBJECT_BUCKETS	4096
+#define YAFFS_OBJECT_BUCKET_LOAD	4	/* objects per bucket before growing */
 
 
 #define YAFFS_OBJECT_SPACE		0x40000
 
-#define YAFFS_CHECKPOINT_VERSION 	4
+#define YAFFS_CHECKPOINT_VERSION 	5
 
 #ifdef CONFIG_YAFFS_UNICODE
 #define YAFFS_MAX_NAME_LENGTH		127
@@ -86,11 +88,17 @@
 #define YAFFS_OBJECTID_CHECKPOINT_DATA	0x20
 #define YAFFS_SEQUENCE_CHECKPOINT_DATA  0x21
 
+/* Pseudo object id for block summary chunks, see yaffs_summary.h */
+#define YAFFS_OBJECTID_SUMMARY		0x30
 
-#define YAFFS_MAX_SHORT_OP_CACHES	20
+
+#define YAFFS_MAX_SHORT_OP_CACHES	4096
 
 #define YAFFS_N_TEMP_BUFFERS		6
 
+/* Number of gc candidates kept in the gc index */
+#define YAFFS_GC_INDEX_SIZE		16
+
 /* We limit the number attempts at sucessfully saving a chunk of data.
  * Small-page devices have 32 pages per block; large-page devices have 64.
  * Default to something in the order of 5 to 10 blocks worth of chunks.
@@ -112,9 +120,11 @@
 
 /* ChunkCache is used for short read/write operations.*/
 typedef struct {
+	struct ylist_head hashLink;	/* Hash bucket for object and chunkId */
+	struct ylist_head lruLink;	/* LRU list, or free list if unused */
+	struct ylist_head dirtyLink;	/* Dirty list, while dirty */
 	struct yaffs_ObjectStruct *object;
 	int chunkId;
-	int lastUse;
 	int dirty;
 	int nBytes;		/* Only valid if the cache is dirty */
 	int locked;		/* Can't push out or flush while locked. */
@@ -564,6 +574,8 @@ struct yaffs_DeviceParamStruct {
 	__u8 skipCheckpointRead;
 	__u8 skipCheckpointWrite;
 
+	int blockSummary;	/* yaffs2: write a tags summary at the end of each block */
+
 	/* NAND access functions (Must be set before calling YAFFS)*/
 
 	int (*writeChunkToNAND) (struct yaffs_DeviceStruct *dev,
@@ -684,10 +696,17 @@ struct yaffs_DeviceStruct {
 	__u32 allocationPage;
 	int allocationBlockFinder;	/* Used to search for next allocation block */
 
+	/* Block summaries */
+	int chunksPerSummary;	/* Chunks per block available for data */
+	struct yaffs_SummaryTagsStruct *sumTags; /* Tags written so far to sumBlock */
+	int sumBlock;
+	int sumCount;		/* Chunks recorded in sumTags, or -1 */
+
 	int nTnodesCreated;
 	yaffs_Tnode *freeTnodes;
 	int nFreeTnodes;
 	yaffs_TnodeList *allocatedTnodeList;
+	int nTnodeExtents;	/* Level 0 tnodes held as extents */
 
 	int nObjectsCreated;
 	yaffs_Object *freeObjects;
@@ -697,7 +716,9 @@ struct yaffs_DeviceStruct {
 
 	yaffs_ObjectList *allocatedObjectList;
 
-	yaffs_ObjectBucket objectBucket[YAFFS_NOBJECT_BUCKETS];
+	yaffs_ObjectBucket *objectBucket;
+	int nObjectBuckets;	/* always a power of 2 */
+	int nHashedObjects;
 	__u32 bucketFinder;
 
 	int nFreeChunks;
@@ -710,11 +731,18 @@ struct yaffs_DeviceStruct {
 	unsigned gcBlockFinder;
 	unsigned gcDirtiest;
 	unsigned gcPagesInUse;
+	__u32 gcScore;		/* cost-benefit score of gcDirtiest */
 	unsigned gcNotDone;
 	unsigned gcBlock;
 	unsigned gcChunk;
 	unsigned gcSkip;
 
+	/* Full blocks that have had chunks deleted, with their last known
+	 * cost-benefit score. Saves searching the whole array for a victim.
+	 */
+	int gcIndex[YAFFS_GC_INDEX_SIZE];
+	__u32 gcIndexScore[YAFFS_GC_INDEX_SIZE];
+
 	/* Special directories */
 	yaffs_Object *rootDir;
 	yaffs_Object *lostNFoundDir;
@@ -728,7 +756,13 @@ struct yaffs_DeviceStruct {
 	int doingBufferedBlockRewrite;
 
 	yaffs_ChunkCache *srCache;
-	int srLastUse;
+	struct ylist_head *srHash;	/* Cache entries hashed by object and chunk */
+	unsigned srHashMask;
+	struct ylist_head srLru;	/* Cache entries in use, least recently used first */
+	struct ylist_head srFree;	/* Unused cache entries */
+	struct ylist_head srDirty;	/* Dirty cache entries */
+	int srNDirty;
+	yaffs_ChunkCache **srFlushList;	/* Scratch space for ordering a flush */
 
 	/* Stuff for background deletion and unlinked files.*/
 	yaffs_Object *unlinkedDir;	/* Directory where unlinked and deleted files live. */
@@ -767,6 +801,7 @@ struct yaffs_DeviceStruct {
 	__u32 passiveGCs;
 	__u32 oldestDirtyGCs;
 	__u32 backgroundGCs;
+	__u32 indexedGCs;	/* GC victims taken from the gc index */
 	__u32 nRetriedWrites;
 	__u32 nRetiredBlocks;
 	__u32 eccFixed;
@@ -777,6 +812,10 @@ struct yaffs_DeviceStruct {
 	__u32 nUnmarkedDeletions;
 	__u32 refreshCount;
 	__u32 cacheHits;
+	__u32 nSummaryWrites;
+	__u32 nSummaryScans;	/* Blocks scanned from their summary */
+	__u32 nObjectLookups;
+	__u32 nObjectProbes;	/* Hash chain entries looked at by lookups */
 
 };
 
@@ -802,6 +841,7 @@ typedef struct {
 	int allocationBlock;	/* Current block being allocated off */
 	__u32 allocationPage;
 	int nFreeChunks;
+	int chunksPerSummary;		/* Data chunks per block nFreeChunks counts */
 
 	int nDeletedFiles;		/* Count of files awaiting deletion;*/
 	int nUnlinkedFiles;		/* Count of unlinked files. */
@@ -827,6 +867,7 @@ int yaffs_GutsInitialise(yaffs_Device *dev);
 void yaffs_Deinitialise(yaffs_Device *dev);
 
 int yaffs_GetNumberOfFreeChunks(yaffs_Device *dev);
+int yaffs_GetRamPerObject(yaffs_Device *dev);
 
 int yaffs_RenameObject(yaffs_Object *oldDir, const YCHAR *oldName,
 		       yaffs_Object *newDir, const YCHAR *newName);
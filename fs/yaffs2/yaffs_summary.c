@@ -0,0 +1,212 @@
+/*
+ * YAFFS: Yet Another Flash File System. A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "yportenv.h"
+#include "yaffs_trace.h"
+#include "yaffs_summary.h"
+#include "yaffs_nand.h"
+#include "yaffs_tagsvalidity.h"
+#include "yaffs_getblockinfo.h"
+
+static __u32 yaffs_SummarySum(const yaffs_SummaryTags *st, int n)
+{
+	const __u32 *p = (const __u32 *)st;
+	__u32 sum = 0;
+	int i;
+
+	for (i = 0; i < n * sizeof(yaffs_SummaryTags) / sizeof(__u32); i++)
+		sum = ((sum << 1) | (sum >> 31)) ^ p[i];
+	return sum;
+}
+
+/*
+ * Reserve the last chunk of each block for the summary if the device
+ * wants summaries and the tags of a whole block fit in one chunk.
+ */
+int yaffs_SummaryInit(yaffs_Device *dev)
+{
+	int nBytes = sizeof(yaffs_SummaryHeader) +
+		dev->param.nChunksPerBlock * sizeof(yaffs_SummaryTags);
+
+	dev->chunksPerSummary = dev->param.nChunksPerBlock;
+	dev->sumTags = NULL;
+	dev->sumBlock = -1;
+	dev->sumCount = 0;
+
+	if (!dev->param.isYaffs2 || !dev->param.blockSummary)
+		return YAFFS_OK;
+
+	if (nBytes > dev->nDataBytesPerChunk) {
+		T(YAFFS_TRACE_ALWAYS,
+		  (TSTR("yaffs: block too large for a summary chunk" TENDSTR)));
+		return YAFFS_OK;
+	}
+
+	dev->sumTags = YMALLOC(dev->param.nChunksPerBlock *
+				sizeof(yaffs_SummaryTags));
+	if (!dev->sumTags)
+		return YAFFS_FAIL;
+
+	dev->chunksPerSummary = dev->param.nChunksPerBlock - 1;
+	return YAFFS_OK;
+}
+
+void yaffs_SummaryDeinit(yaffs_Device *dev)
+{
+	if (dev->sumTags)
+		YFREE(dev->sumTags);
+	dev->sumTags = NULL;
+	dev->chunksPerSummary = dev->param.nChunksPerBlock;
+}
+
+static void yaffs_SummaryWrite(yaffs_Device *dev, int blk)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr;
+	yaffs_ExtendedTags tags;
+	__u8 *buffer;
+	int chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+	int nBytes = sizeof(yaffs_SummaryHeader) +
+		dev->chunksPerSummary * sizeof(yaffs_SummaryTags);
+
+	/* The summary takes the sequence number the NAND layer writes with */
+	if (bi->sequenceNumber != dev->sequenceNumber)
+		return;
+
+	buffer = yaffs_GetTempBuffer(dev, __LINE__);
+	memset(buffer, 0xFF, dev->nDataBytesPerChunk);
+
+	hdr = (yaffs_SummaryHeader *)buffer;
+	hdr->magic = YAFFS_SUMMARY_MAGIC;
+	hdr->block = blk;
+	hdr->sequenceNumber = bi->sequenceNumber;
+	hdr->nChunks = dev->chunksPerSummary;
+	hdr->sum = yaffs_SummarySum(dev->sumTags, dev->chunksPerSummary);
+	memcpy(hdr + 1, dev->sumTags,
+		dev->chunksPerSummary * sizeof(yaffs_SummaryTags));
+
+	yaffs_InitialiseTags(&tags);
+	tags.objectId = YAFFS_OBJECTID_SUMMARY;
+	tags.chunkId = 1;
+	tags.byteCount = nBytes;
+
+	/* The chunk is not allocated and never enters pagesInUse, so a
+	 * failed write only costs us the summary for this block. */
+	if (yaffs_WriteChunkWithTagsToNAND(dev, chunk, buffer, &tags) == YAFFS_OK)
+		dev->nSummaryWrites++;
+	else
+		T(YAFFS_TRACE_ERROR,
+		  (TSTR("yaffs: summary write failed for block %d" TENDSTR),
+		  blk));
+
+	yaffs_ReleaseTempBuffer(dev, buffer, __LINE__);
+}
+
+/*
+ * Record the tags of a chunk that has just been written. Chunks must
+ * arrive in order from the start of the block; a block that was only
+ * partly written by us (eg. after a write error or a remount) gets no
+ * summary.
+ */
+void yaffs_SummaryAdd(yaffs_Device *dev, yaffs_ExtendedTags *tags,
+			int chunkInNAND)
+{
+	int blk = chunkInNAND / dev->param.nChunksPerBlock;
+	int c = chunkInNAND % dev->param.nChunksPerBlock;
+	yaffs_SummaryTags *st;
+
+	if (!dev->sumTags)
+		return;
+
+	if (blk != dev->sumBlock) {
+		dev->sumBlock = blk;
+		dev->sumCount = 0;
+	}
+
+	if (dev->sumCount < 0 || c != dev->sumCount) {
+		dev->sumCount = -1;
+		return;
+	}
+
+	st = &dev->sumTags[c];
+	st->objectId = tags->objectId;
+	st->chunkId = tags->chunkId;
+	st->byteCount = tags->byteCount;
+
+	if (++dev->sumCount == dev->chunksPerSummary) {
+		yaffs_SummaryWrite(dev, blk);
+		dev->sumCount = -1;
+	}
+}
+
+/*
+ * Read the summary of a block into buffer. Returns YAFFS_OK if it is
+ * valid for the block as we know it.
+ */
+int yaffs_SummaryRead(yaffs_Device *dev, int blk, __u8 *buffer)
+{
+	yaffs_BlockInfo *bi = yaffs_GetBlockInfo(dev, blk);
+	yaffs_SummaryHeader *hdr = (yaffs_SummaryHeader *)buffer;
+	yaffs_ExtendedTags tags;
+	int chunk = blk * dev->param.nChunksPerBlock + dev->chunksPerSummary;
+
+	yaffs_ReadChunkWithTagsFromNAND(dev, chunk, buffer, &tags);
+
+	if (!tags.chunkUsed ||
+	    tags.eccResult > YAFFS_ECC_RESULT_FIXED ||
+	    tags.objectId != YAFFS_OBJECTID_SUMMARY ||
+	    hdr->magic != YAFFS_SUMMARY_MAGIC ||
+	    hdr->block != blk ||
+	    hdr->sequenceNumber != bi->sequenceNumber ||
+	    hdr->nChunks != dev->chunksPerSummary ||
+	    hdr->sum != yaffs_SummarySum((yaffs_SummaryTags *)(hdr + 1),
+					hdr->nChunks))
+		return YAFFS_FAIL;
+
+	return YAFFS_OK;
+}
+
+/*
+ * Make up the tags of chunk c of a block from its summary. Object
+ * headers carry extra information in their tags that the summary does
+ * not keep, so their tags are still read from NAND.
+ */
+void yaffs_SummaryGetTags(yaffs_Device *dev, const __u8 *buffer,
+			int blk, int c, yaffs_ExtendedTags *tags)
+{
+	const yaffs_SummaryHeader *hdr = (const yaffs_SummaryHeader *)buffer;
+	const yaffs_SummaryTags *st = (const yaffs_SummaryTags *)(hdr + 1);
+	int chunk = blk * dev->param.nChunksPerBlock + c;
+
+	yaffs_InitialiseTags(tags);
+
+	if (c >= hdr->nChunks) {
+		tags->chunkUsed = 1;
+		tags->objectId = YAFFS_OBJECTID_SUMMARY;
+		tags->chunkId = 1;
+		return;
+	}
+
+	st += c;
+	if (st->chunkId == 0) {
+		yaffs_ReadChunkWithTagsFromNAND(dev, chunk, NULL, tags);
+		return;
+	}
+
+	tags->chunkUsed = 1;
+	tags->eccResult = YAFFS_ECC_RESULT_NO_ERROR;
+	tags->objectId = st->objectId;
+	tags->chunkId = st->chunkId;
+	tags->byteCount = st->byteCount;
+	tags->sequenceNumber = hdr->sequenceNumber;
+}
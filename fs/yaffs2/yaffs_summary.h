@@ -0,0 +1,55 @@
+/*
+ * YAFFS: Yet another Flash File System . A NAND-flash specific file system.
+ *
+ * Copyright (C) 2002-2010 Aleph One Ltd.
+ *   for Toby Churchill Ltd and Brightstar Engineering
+ *
+ * Created by Charles Manning <charles@aleph1.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2.1 as
+ * published by the Free Software Foundation.
+ *
+ * Note: Only YAFFS headers are LGPL, YAFFS C code is covered by GPL.
+ */
+
+#ifndef __YAFFS_SUMMARY_H__
+#define __YAFFS_SUMMARY_H__
+
+#include "yaffs_guts.h"
+
+/*
+ * Block summaries (yaffs2 only).
+ * Once the data chunks of a block have all been written, the tags of each
+ * chunk are written to the last chunk of the block. A scan can then read
+ * that one chunk instead of the tags of every chunk in the block.
+ * Blocks without a valid summary are scanned chunk by chunk as before.
+ */
+
+#define YAFFS_SUMMARY_MAGIC	0x5953554D	/* "YSUM" */
+
+typedef struct {
+	__u32 magic;
+	__u32 block;
+	__u32 sequenceNumber;
+	__u32 nChunks;		/* number of summarised chunks */
+	__u32 sum;		/* checksum over the tags that follow */
+} yaffs_SummaryHeader;
+
+typedef struct yaffs_SummaryTagsStruct {
+	__u32 objectId;
+	__u32 chunkId;
+	__u32 byteCount;
+} yaffs_SummaryTags;
+
+int yaffs_SummaryInit(yaffs_Device *dev);
+void yaffs_SummaryDeinit(yaffs_Device *dev);
+
+void yaffs_SummaryAdd(yaffs_Device *dev, yaffs_ExtendedTags *tags,
+			int chunkInNAND);
+
+int yaffs_SummaryRead(yaffs_Device *dev, int blk, __u8 *buffer);
+void yaffs_SummaryGetTags(yaffs_Device *dev, const __u8 *buffer,
+			int blk, int c, yaffs_ExtendedTags *tags);
+
+#endif
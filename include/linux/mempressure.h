@@ -0,0 +1,18 @@
+#ifndef _LINUX_MEMPRESSURE_H
+#define _LINUX_MEMPRESSURE_H
+
+/*
+ * Reclaim reports how many pages it scanned and reclaimed so that the
+ * Android memory pressure device can grade the pressure for userspace.
+ */
+#ifdef CONFIG_ANDROID_MEM_PRESSURE
+extern void mempressure_reclaim(unsigned long scanned,
+				unsigned long reclaimed);
+#else
+static inline void mempressure_reclaim(unsigned long scanned,
+				       unsigned long reclaimed)
+{
+}
+#endif
+
+#endif /* _LINUX_MEMPRESSURE_H */
@@ -1037,6 +1037,11 @@ struct net_device {
 	struct netpoll_info	*npinfo;
 #endif
 
+#ifdef CONFIG_NET_ACTIVITY_STATS
+	/* net/activity_stats.c entry for this name, set on first transmit */
+	void			*activity_entry;
+#endif
+
 #ifdef CONFIG_NET_NS
 	/* Network namespace this network device is inside */
 	struct net		*nd_net;
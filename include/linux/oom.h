@@ -68,6 +68,33 @@ extern unsigned long badness(struct task_struct *p, struct mem_cgroup *mem,
 
 extern struct task_struct *find_lock_task_mm(struct task_struct *p);
 
+/*
+ * The lowmemorykiller keeps thread group leaders indexed by oom_adj. Callers
+ * hold tasklist_lock for writing (fork, exit, exec) or the task's siglock
+ * (oom_adj writes).
+ */
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+extern void oom_adj_index_add(struct task_struct *p);
+extern void oom_adj_index_del(struct task_struct *p);
+extern void oom_adj_index_replace(struct task_struct *old,
+				  struct task_struct *new);
+extern void oom_adj_index_update(struct task_struct *p);
+#else
+static inline void oom_adj_index_add(struct task_struct *p)
+{
+}
+static inline void oom_adj_index_del(struct task_struct *p)
+{
+}
+static inline void oom_adj_index_replace(struct task_struct *old,
+					 struct task_struct *new)
+{
+}
+static inline void oom_adj_index_update(struct task_struct *p)
+{
+}
+#endif
+
 /* sysctls */
 extern int sysctl_oom_dump_tasks;
 extern int sysctl_oom_kill_allocating_task;
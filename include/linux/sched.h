@@ -80,6 +80,7 @@ struct sched_param {
 #include <linux/seccomp.h>
 #include <linux/rcupdate.h>
 #include <linux/rculist.h>
+#include <linux/list_nulls.h>
 #include <linux/rtmutex.h>
 
 #include <linux/time.h>
@@ -1220,6 +1221,10 @@ struct task_struct {
 #endif
 
 	struct list_head tasks;
+#ifdef CONFIG_ANDROID_LOW_MEMORY_KILLER
+	/* lowmemorykiller per-oom_adj index, thread group leaders only */
+	struct hlist_nulls_node oom_adj_node;
+#endif
 	struct plist_node pushable_tasks;
 
 	struct mm_struct *mm, *active_mm;
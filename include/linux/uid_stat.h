@@ -18,12 +18,23 @@
 
 /* Contains definitions for resource tracking per uid. */
 
+/* Protocol breakdown of the per-uid byte counts in /proc/uid_stat/<uid>/ */
+enum {
+	UID_STAT_TCP,
+	UID_STAT_UDP,
+	UID_STAT_OTHER,	/* any other inet protocol: raw, icmp, ... */
+	UID_STAT_PROTO_COUNT
+};
+
 #ifdef CONFIG_UID_STAT
-int uid_stat_tcp_snd(uid_t uid, int size);
-int uid_stat_tcp_rcv(uid_t uid, int size);
+int uid_stat_snd(uid_t uid, int proto, int size);
+int uid_stat_rcv(uid_t uid, int proto, int size);
 #else
-#define uid_stat_tcp_snd(uid, size) do {} while (0);
-#define uid_stat_tcp_rcv(uid, size) do {} while (0);
+#define uid_stat_snd(uid, proto, size) do {} while (0);
+#define uid_stat_rcv(uid, proto, size) do {} while (0);
 #endif
 
+#define uid_stat_tcp_snd(uid, size) uid_stat_snd(uid, UID_STAT_TCP, size)
+#define uid_stat_tcp_rcv(uid, size) uid_stat_rcv(uid, UID_STAT_TCP, size)
+
 #endif /* _LINUX_UID_STAT_H */
@@ -16,7 +16,9 @@
 #ifndef _LINUX_WAKELOCK_H
 #define _LINUX_WAKELOCK_H
 
+#include <linux/types.h>
 #include <linux/list.h>
+#include <linux/rbtree.h>
 #include <linux/ktime.h>
 
 /* A wake_lock prevents the system from entering suspend or other low power
@@ -32,9 +34,43 @@ enum {
 	WAKE_LOCK_TYPE_COUNT
 };
 
+/* Binary stats in /proc/wakelock_stats, with CONFIG_WAKELOCK_STAT.
+ * A read at offset 0 takes a new snapshot, so a reader can poll with
+ * pread(fd, buf, size, 0). The file is a wake_lock_stat_header followed
+ * by nr_records records of record_size bytes. Histogram bucket 0 counts
+ * durations below 2^20 ns (about 1 ms), bucket n counts durations in
+ * [2^(n+19), 2^(n+20)) ns and the last bucket everything longer.
+ */
+#define WAKE_LOCK_STAT_VERSION		1
+#define WAKE_LOCK_STAT_NAME_LEN		40
+#define WAKE_LOCK_STAT_BUCKETS		20
+
+struct wake_lock_stat_header {
+	__u32 version;
+	__u32 record_size;
+	__u32 nr_records;
+	__u32 nr_buckets;
+};
+
+struct wake_lock_stat_record {
+	char  name[WAKE_LOCK_STAT_NAME_LEN];	/* may be truncated */
+	__u32 count;
+	__u32 expire_count;
+	__u32 wakeup_count;
+	__u32 suspend_abort_count;	/* times this lock blocked suspend */
+	__s64 active_time;		/* all times in ns */
+	__s64 total_time;
+	__s64 prevent_suspend_time;
+	__s64 max_time;
+	__s64 last_time;
+	__u32 hold_hist[WAKE_LOCK_STAT_BUCKETS];
+	__u32 prevent_suspend_hist[WAKE_LOCK_STAT_BUCKETS];
+};
+
 struct wake_lock {
 #ifdef CONFIG_HAS_WAKELOCK
 	struct list_head    link;
+	struct rb_node      expire_node; /* in expiry order while AUTO_EXPIRE */
 	int                 flags;
 	const char         *name;
 	unsigned long       expires;
@@ -43,10 +79,15 @@ struct wake_lock {
 		int             count;
 		int             expire_count;
 		int             wakeup_count;
+		int             suspend_abort_count;
 		ktime_t         total_time;
 		ktime_t         prevent_suspend_time;
 		ktime_t         max_time;
 		ktime_t         last_time;
+		/* prevent_suspend_time when the current hold started */
+		ktime_t         hold_prevent_suspend_time;
+		u32             hold_hist[WAKE_LOCK_STAT_BUCKETS];
+		u32             prevent_suspend_hist[WAKE_LOCK_STAT_BUCKETS];
 	} stat;
 #endif
 #endif
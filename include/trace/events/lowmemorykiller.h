@@ -0,0 +1,47 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_TRACE_LOWMEMORYKILLER_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_LOWMEMORYKILLER_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_select,
+
+	TP_PROTO(int min_adj, int scanned, pid_t pid, int oom_adj,
+		 int tasksize, s64 time_ns),
+
+	TP_ARGS(min_adj, scanned, pid, oom_adj, tasksize, time_ns),
+
+	TP_STRUCT__entry(
+		__field(	int,	min_adj		)
+		__field(	int,	scanned		)
+		__field(	pid_t,	pid		)
+		__field(	int,	oom_adj		)
+		__field(	int,	tasksize	)
+		__field(	s64,	time_ns		)
+	),
+
+	TP_fast_assign(
+		__entry->min_adj	= min_adj;
+		__entry->scanned	= scanned;
+		__entry->pid		= pid;
+		__entry->oom_adj	= oom_adj;
+		__entry->tasksize	= tasksize;
+		__entry->time_ns	= time_ns;
+	),
+
+	TP_printk("min_adj=%d scanned=%d pid=%d oom_adj=%d tasksize=%d time_ns=%lld",
+		__entry->min_adj,
+		__entry->scanned,
+		__entry->pid,
+		__entry->oom_adj,
+		__entry->tasksize,
+		(long long)__entry->time_ns)
+);
+
+#endif /* _TRACE_LOWMEMORYKILLER_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
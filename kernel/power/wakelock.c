@@ -21,6 +21,8 @@
 #include <linux/wakelock.h>
 #ifdef CONFIG_WAKELOCK_STAT
 #include <linux/proc_fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
 #endif
 #include "power.h"
 
@@ -43,6 +45,13 @@ module_param_named(debug_mask, debug_mask, int, S_IRUGO | S_IWUSR | S_IWGRP);
 static DEFINE_SPINLOCK(list_lock);
 static LIST_HEAD(inactive_locks);
 static struct list_head active_wake_locks[WAKE_LOCK_TYPE_COUNT];
+/*
+ * Active locks without a timeout are only counted, locks with a timeout
+ * are also kept in an rbtree sorted by expiry, so has_wake_lock_locked()
+ * does not have to walk active_wake_locks.
+ */
+static int nr_active_locks[WAKE_LOCK_TYPE_COUNT];
+static struct rb_root expire_locks[WAKE_LOCK_TYPE_COUNT];
 static int current_event_num;
 struct workqueue_struct *suspend_work_queue;
 struct workqueue_struct *sync_work_queue;
@@ -55,6 +64,7 @@ static struct wake_lock unknown_wakeup;
 static struct wake_lock deleted_wake_locks;
 static ktime_t last_sleep_time_update;
 static int wait_for_wakeup;
+static int nr_wake_locks;
 
 int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 {
@@ -83,7 +93,9 @@ int get_expired_time(struct wake_lock *lock, ktime_t *expire_time)
 }
 
 
-static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
+/* Caller must acquire the list_lock spinlock. Does not fill in r->name. */
+static void get_lock_stat(struct wake_lock *lock,
+			  struct wake_lock_stat_record *r)
 {
 	int lock_count = lock->stat.count;
 	int expire_count = lock->stat.expire_count;
@@ -111,13 +123,30 @@ static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
 			max_time = add_time;
 	}
 
+	r->count = lock_count;
+	r->expire_count = expire_count;
+	r->wakeup_count = lock->stat.wakeup_count;
+	r->suspend_abort_count = lock->stat.suspend_abort_count;
+	r->active_time = ktime_to_ns(active_time);
+	r->total_time = ktime_to_ns(total_time);
+	r->prevent_suspend_time = ktime_to_ns(prevent_suspend_time);
+	r->max_time = ktime_to_ns(max_time);
+	r->last_time = ktime_to_ns(lock->stat.last_time);
+	memcpy(r->hold_hist, lock->stat.hold_hist, sizeof(r->hold_hist));
+	memcpy(r->prevent_suspend_hist, lock->stat.prevent_suspend_hist,
+	       sizeof(r->prevent_suspend_hist));
+}
+
+static int print_lock_stat(struct seq_file *m, struct wake_lock *lock)
+{
+	struct wake_lock_stat_record r;
+
+	get_lock_stat(lock, &r);
 	return seq_printf(m,
-		     "\"%s\"\t%d\t%d\t%d\t%lld\t%lld\t%lld\t%lld\t%lld\n",
-		     lock->name, lock_count, expire_count,
-		     lock->stat.wakeup_count, ktime_to_ns(active_time),
-		     ktime_to_ns(total_time),
-		     ktime_to_ns(prevent_suspend_time), ktime_to_ns(max_time),
-		     ktime_to_ns(lock->stat.last_time));
+		     "\"%s\"\t%u\t%u\t%u\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+		     lock->name, r.count, r.expire_count, r.wakeup_count,
+		     r.active_time, r.total_time, r.prevent_suspend_time,
+		     r.max_time, r.last_time);
 }
 
 static int wakelock_stats_show(struct seq_file *m, void *unused)
@@ -141,16 +170,26 @@ static int wakelock_stats_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
-static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
+/* histogram bucket of a duration, bucket i ends at 2^i (binary) ms */
+static int stat_bucket(ktime_t t)
+{
+	s64 ns = ktime_to_ns(t);
+
+	if (ns <= 0)
+		return 0;
+	return min(fls64((u64)ns >> 20), WAKE_LOCK_STAT_BUCKETS - 1);
+}
+
+/* now is sampled by the caller, before taking list_lock */
+static void wake_unlock_stat_locked(struct wake_lock *lock, int expired,
+				    ktime_t now)
 {
 	ktime_t duration;
-	ktime_t now;
+	ktime_t last_time = now;
 	if (!(lock->flags & WAKE_LOCK_ACTIVE))
 		return;
 	if (get_expired_time(lock, &now))
 		expired = 1;
-	else
-		now = ktime_get();
 	lock->stat.count++;
 	if (expired)
 		lock->stat.expire_count++;
@@ -158,13 +197,21 @@ static void wake_unlock_stat_locked(struct wake_lock *lock, int expired)
 	lock->stat.total_time = ktime_add(lock->stat.total_time, duration);
 	if (ktime_to_ns(duration) > ktime_to_ns(lock->stat.max_time))
 		lock->stat.max_time = duration;
-	lock->stat.last_time = ktime_get();
+	lock->stat.hold_hist[stat_bucket(duration)]++;
+	lock->stat.last_time = last_time;
 	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND) {
 		duration = ktime_sub(now, last_sleep_time_update);
 		lock->stat.prevent_suspend_time = ktime_add(
 			lock->stat.prevent_suspend_time, duration);
 		lock->flags &= ~WAKE_LOCK_PREVENTING_SUSPEND;
 	}
+	duration = ktime_sub(lock->stat.prevent_suspend_time,
+			     lock->stat.hold_prevent_suspend_time);
+	if (ktime_to_ns(duration) > 0)
+		lock->stat.prevent_suspend_hist[stat_bucket(duration)]++;
+	/* prevent_suspend_time only grows while active, so this is where
+	 * the next hold starts from */
+	lock->stat.hold_prevent_suspend_time = lock->stat.prevent_suspend_time;
 }
 
 static void update_sleep_wait_stats_locked(int done)
@@ -192,16 +239,62 @@ static void update_sleep_wait_stats_locked(int done)
 	}
 	last_sleep_time_update = now;
 }
+
+/*
+ * A suspend lock taken while main_wake_lock is released starts preventing
+ * suspend now. Rather than walking every active lock to move
+ * last_sleep_time_update forward, back-date this lock's prevent_suspend_time
+ * so that it only gets credited from now on.
+ */
+static void start_prevent_suspend_locked(struct wake_lock *lock, ktime_t now)
+{
+	if (lock->flags & WAKE_LOCK_PREVENTING_SUSPEND)
+		return;
+	lock->stat.prevent_suspend_time = ktime_sub(
+		lock->stat.prevent_suspend_time,
+		ktime_sub(now, last_sleep_time_update));
+	lock->flags |= WAKE_LOCK_PREVENTING_SUSPEND;
+}
 #endif
 
+static void enqueue_expire_lock_locked(struct wake_lock *lock, int type)
+{
+	struct rb_node **p = &expire_locks[type].rb_node;
+	struct rb_node *parent = NULL;
+	struct wake_lock *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct wake_lock, expire_node);
+		if (time_before(lock->expires, entry->expires))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&lock->expire_node, parent, p);
+	rb_insert_color(&lock->expire_node, &expire_locks[type]);
+}
+
+/* Must be called before WAKE_LOCK_ACTIVE or WAKE_LOCK_AUTO_EXPIRE change */
+static void dequeue_wake_lock_locked(struct wake_lock *lock, int type)
+{
+	if (lock->flags & WAKE_LOCK_ACTIVE) {
+		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE)
+			rb_erase(&lock->expire_node, &expire_locks[type]);
+		else
+			nr_active_locks[type]--;
+	}
+	list_del(&lock->link);
+}
+
 
 static void expire_wake_lock(struct wake_lock *lock)
 {
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 1);
+	wake_unlock_stat_locked(lock, 1, ktime_get());
 #endif
+	dequeue_wake_lock_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
 	if (debug_mask & (DEBUG_WAKE_LOCK | DEBUG_EXPIRE))
 		pr_info("expired wake lock %s\n", lock->name);
@@ -232,22 +325,46 @@ static void print_active_locks(int type)
 
 static long has_wake_lock_locked(int type)
 {
-	struct wake_lock *lock, *n;
-	long max_timeout = 0;
+	struct rb_node *node;
+	struct wake_lock *lock;
+	unsigned long now = jiffies;
 
 	BUG_ON(type >= WAKE_LOCK_TYPE_COUNT);
-	list_for_each_entry_safe(lock, n, &active_wake_locks[type], link) {
-		if (lock->flags & WAKE_LOCK_AUTO_EXPIRE) {
-			long timeout = lock->expires - jiffies;
-			if (timeout <= 0)
-				expire_wake_lock(lock);
-			else if (timeout > max_timeout)
-				max_timeout = timeout;
-		} else
-			return -1;
+	if (nr_active_locks[type])
+		return -1;
+	while ((node = rb_first(&expire_locks[type]))) {
+		lock = rb_entry(node, struct wake_lock, expire_node);
+		if ((long)(lock->expires - now) > 0)
+			break;
+		expire_wake_lock(lock);
 	}
-	return max_timeout;
+	node = rb_last(&expire_locks[type]);
+	if (!node)
+		return 0;
+	lock = rb_entry(node, struct wake_lock, expire_node);
+	return lock->expires - now;
+}
+
+#ifdef CONFIG_WAKELOCK_STAT
+/*
+ * Charge a suspend abort to the lock that blocked it: a lock without a
+ * timeout if there is one (those are at the head of the list), otherwise
+ * the lock that expires last.
+ */
+static void suspend_abort_stat_locked(void)
+{
+	struct wake_lock *lock = NULL;
+	struct rb_node *node;
+
+	if (nr_active_locks[WAKE_LOCK_SUSPEND])
+		lock = list_first_entry(&active_wake_locks[WAKE_LOCK_SUSPEND],
+					struct wake_lock, link);
+	else if ((node = rb_last(&expire_locks[WAKE_LOCK_SUSPEND])))
+		lock = rb_entry(node, struct wake_lock, expire_node);
+	if (lock)
+		lock->stat.suspend_abort_count++;
 }
+#endif
 
 long has_wake_lock(int type)
 {
@@ -255,6 +372,10 @@ long has_wake_lock(int type)
 	unsigned long irqflags;
 	spin_lock_irqsave(&list_lock, irqflags);
 	ret = has_wake_lock_locked(type);
+#ifdef CONFIG_WAKELOCK_STAT
+	if (ret && type == WAKE_LOCK_SUSPEND)
+		suspend_abort_stat_locked();
+#endif
 	if (ret && (debug_mask & DEBUG_SUSPEND) && type == WAKE_LOCK_SUSPEND)
 		print_active_locks(type);
 	spin_unlock_irqrestore(&list_lock, irqflags);
@@ -350,16 +471,25 @@ void wake_lock_init(struct wake_lock *lock, int type, const char *name)
 	lock->stat.count = 0;
 	lock->stat.expire_count = 0;
 	lock->stat.wakeup_count = 0;
+	lock->stat.suspend_abort_count = 0;
 	lock->stat.total_time = ktime_set(0, 0);
 	lock->stat.prevent_suspend_time = ktime_set(0, 0);
 	lock->stat.max_time = ktime_set(0, 0);
 	lock->stat.last_time = ktime_set(0, 0);
+	lock->stat.hold_prevent_suspend_time = ktime_set(0, 0);
+	memset(lock->stat.hold_hist, 0, sizeof(lock->stat.hold_hist));
+	memset(lock->stat.prevent_suspend_hist, 0,
+	       sizeof(lock->stat.prevent_suspend_hist));
 #endif
 	lock->flags = (type & WAKE_LOCK_TYPE_MASK) | WAKE_LOCK_INITIALIZED;
 
 	INIT_LIST_HEAD(&lock->link);
+	RB_CLEAR_NODE(&lock->expire_node);
 	spin_lock_irqsave(&list_lock, irqflags);
 	list_add(&lock->link, &inactive_locks);
+#ifdef CONFIG_WAKELOCK_STAT
+	nr_wake_locks++;
+#endif
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_init);
@@ -372,7 +502,17 @@ void wake_lock_destroy(struct wake_lock *lock)
 	spin_lock_irqsave(&list_lock, irqflags);
 	lock->flags &= ~WAKE_LOCK_INITIALIZED;
 #ifdef CONFIG_WAKELOCK_STAT
+	nr_wake_locks--;
 	if (lock->stat.count) {
+		int i;
+		for (i = 0; i < WAKE_LOCK_STAT_BUCKETS; i++) {
+			deleted_wake_locks.stat.hold_hist[i] +=
+				lock->stat.hold_hist[i];
+			deleted_wake_locks.stat.prevent_suspend_hist[i] +=
+				lock->stat.prevent_suspend_hist[i];
+		}
+		deleted_wake_locks.stat.suspend_abort_count +=
+			lock->stat.suspend_abort_count;
 		deleted_wake_locks.stat.count += lock->stat.count;
 		deleted_wake_locks.stat.expire_count += lock->stat.expire_count;
 		deleted_wake_locks.stat.total_time =
@@ -386,7 +526,7 @@ void wake_lock_destroy(struct wake_lock *lock)
 				  lock->stat.max_time);
 	}
 #endif
-	list_del(&lock->link);
+	dequeue_wake_lock_locked(lock, lock->flags & WAKE_LOCK_TYPE_MASK);
 	spin_unlock_irqrestore(&list_lock, irqflags);
 }
 EXPORT_SYMBOL(wake_lock_destroy);
@@ -397,6 +537,9 @@ static void wake_lock_internal(
 	int type;
 	unsigned long irqflags;
 	long expire_in;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now = ktime_get();
+#endif
 
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
@@ -410,18 +553,16 @@ static void wake_lock_internal(
 		lock->stat.wakeup_count++;
 	}
 	if ((lock->flags & WAKE_LOCK_AUTO_EXPIRE) &&
-	    (long)(lock->expires - jiffies) <= 0) {
-		wake_unlock_stat_locked(lock, 0);
-		lock->stat.last_time = ktime_get();
-	}
+	    (long)(lock->expires - jiffies) <= 0)
+		wake_unlock_stat_locked(lock, 0, now);
 #endif
+	dequeue_wake_lock_locked(lock, type);
 	if (!(lock->flags & WAKE_LOCK_ACTIVE)) {
 		lock->flags |= WAKE_LOCK_ACTIVE;
 #ifdef CONFIG_WAKELOCK_STAT
-		lock->stat.last_time = ktime_get();
+		lock->stat.last_time = now;
 #endif
 	}
-	list_del(&lock->link);
 	if (has_timeout) {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d, timeout %ld.%03lu\n",
@@ -430,12 +571,14 @@ static void wake_lock_internal(
 		lock->expires = jiffies + timeout;
 		lock->flags |= WAKE_LOCK_AUTO_EXPIRE;
 		list_add_tail(&lock->link, &active_wake_locks[type]);
+		enqueue_expire_lock_locked(lock, type);
 	} else {
 		if (debug_mask & DEBUG_WAKE_LOCK)
 			pr_info("wake_lock: %s, type %d\n", lock->name, type);
 		lock->expires = LONG_MAX;
 		lock->flags &= ~WAKE_LOCK_AUTO_EXPIRE;
 		list_add(&lock->link, &active_wake_locks[type]);
+		nr_active_locks[type]++;
 	}
 	if (type == WAKE_LOCK_SUSPEND) {
 		current_event_num++;
@@ -443,7 +586,7 @@ static void wake_lock_internal(
 		if (lock == &main_wake_lock)
 			update_sleep_wait_stats_locked(1);
 		else if (!wake_lock_active(&main_wake_lock))
-			update_sleep_wait_stats_locked(0);
+			start_prevent_suspend_locked(lock, now);
 #endif
 		if (has_timeout)
 			expire_in = has_wake_lock_locked(type);
@@ -482,15 +625,18 @@ void wake_unlock(struct wake_lock *lock)
 {
 	int type;
 	unsigned long irqflags;
+#ifdef CONFIG_WAKELOCK_STAT
+	ktime_t now = ktime_get();
+#endif
 	spin_lock_irqsave(&list_lock, irqflags);
 	type = lock->flags & WAKE_LOCK_TYPE_MASK;
 #ifdef CONFIG_WAKELOCK_STAT
-	wake_unlock_stat_locked(lock, 0);
+	wake_unlock_stat_locked(lock, 0, now);
 #endif
 	if (debug_mask & DEBUG_WAKE_LOCK)
 		pr_info("wake_unlock: %s\n", lock->name);
+	dequeue_wake_lock_locked(lock, type);
 	lock->flags &= ~(WAKE_LOCK_ACTIVE | WAKE_LOCK_AUTO_EXPIRE);
-	list_del(&lock->link);
 	list_add(&lock->link, &inactive_locks);
 	if (type == WAKE_LOCK_SUSPEND) {
 		long has_lock = has_wake_lock_locked(type);
@@ -538,13 +684,125 @@ static const struct file_operations wakelock_stats_fops = {
 	.release = single_release,
 };
 
+#ifdef CONFIG_WAKELOCK_STAT
+/* lock serializes reads of one open file, which reuse its buffer */
+struct wakelock_stats_snapshot {
+	struct mutex lock;
+	void *data;
+	size_t size;
+	size_t len;
+};
+
+static void fill_stat_record(struct wake_lock_stat_record *r,
+			     struct wake_lock *lock)
+{
+	get_lock_stat(lock, r);
+	strlcpy(r->name, lock->name, sizeof(r->name));
+}
+
+static int take_stats_snapshot(struct wakelock_stats_snapshot *snap)
+{
+	struct wake_lock_stat_header *hdr;
+	struct wake_lock_stat_record *r;
+	struct wake_lock *lock;
+	unsigned long irqflags;
+	size_t size;
+	int n, type;
+
+retry:
+	/* leave some room for locks created while we allocate */
+	n = ACCESS_ONCE(nr_wake_locks) + 16;
+	size = sizeof(*hdr) + n * sizeof(*r);
+	if (size > snap->size) {
+		vfree(snap->data);
+		snap->data = vmalloc(size);
+		if (!snap->data) {
+			snap->size = 0;
+			snap->len = 0;
+			return -ENOMEM;
+		}
+		snap->size = size;
+	}
+	hdr = snap->data;
+	r = (struct wake_lock_stat_record *)(hdr + 1);
+	n = (snap->size - sizeof(*hdr)) / sizeof(*r);
+
+	spin_lock_irqsave(&list_lock, irqflags);
+	if (nr_wake_locks > n) {
+		spin_unlock_irqrestore(&list_lock, irqflags);
+		goto retry;
+	}
+	list_for_each_entry(lock, &inactive_locks, link)
+		fill_stat_record(r++, lock);
+	for (type = 0; type < WAKE_LOCK_TYPE_COUNT; type++) {
+		list_for_each_entry(lock, &active_wake_locks[type], link)
+			fill_stat_record(r++, lock);
+	}
+	spin_unlock_irqrestore(&list_lock, irqflags);
+
+	hdr->version = WAKE_LOCK_STAT_VERSION;
+	hdr->record_size = sizeof(*r);
+	hdr->nr_records = r - (struct wake_lock_stat_record *)(hdr + 1);
+	hdr->nr_buckets = WAKE_LOCK_STAT_BUCKETS;
+	snap->len = (char *)r - (char *)hdr;
+	return 0;
+}
+
+static int wakelock_stats_bin_open(struct inode *inode, struct file *file)
+{
+	struct wakelock_stats_snapshot *snap;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+	mutex_init(&snap->lock);
+	file->private_data = snap;
+	return 0;
+}
+
+static ssize_t wakelock_stats_bin_read(struct file *file, char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct wakelock_stats_snapshot *snap = file->private_data;
+	ssize_t ret = 0;
+
+	mutex_lock(&snap->lock);
+	if (*ppos == 0)
+		ret = take_stats_snapshot(snap);
+	if (!ret)
+		ret = simple_read_from_buffer(buf, count, ppos, snap->data,
+					      snap->len);
+	mutex_unlock(&snap->lock);
+	return ret;
+}
+
+static int wakelock_stats_bin_release(struct inode *inode, struct file *file)
+{
+	struct wakelock_stats_snapshot *snap = file->private_data;
+
+	vfree(snap->data);
+	kfree(snap);
+	return 0;
+}
+
+static const struct file_operations wakelock_stats_bin_fops = {
+	.owner = THIS_MODULE,
+	.open = wakelock_stats_bin_open,
+	.read = wakelock_stats_bin_read,
+	.llseek = default_llseek,
+	.release = wakelock_stats_bin_release,
+};
+#endif
+
 static int __init wakelocks_init(void)
 {
 	int ret;
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++)
+	for (i = 0; i < ARRAY_SIZE(active_wake_locks); i++) {
 		INIT_LIST_HEAD(&active_wake_locks[i]);
+		expire_locks[i] = RB_ROOT;
+	}
 
 #ifdef CONFIG_WAKELOCK_STAT
 	wake_lock_init(&deleted_wake_locks, WAKE_LOCK_SUSPEND,
@@ -580,6 +838,7 @@ static int __init wakelocks_init(void)
 
 #ifdef CONFIG_WAKELOCK_STAT
 	proc_create("wakelocks", S_IRUGO, NULL, &wakelock_stats_fops);
+	proc_create("wakelock_stats", S_IRUGO, NULL, &wakelock_stats_bin_fops);
 #endif
 
 	return 0;
@@ -603,6 +862,7 @@ err_platform_device_register:
 static void  __exit wakelocks_exit(void)
 {
 #ifdef CONFIG_WAKELOCK_STAT
+	remove_proc_entry("wakelock_stats", NULL);
 	remove_proc_entry("wakelocks", NULL);
 #endif
 	destroy_workqueue(suspend_work_queue);
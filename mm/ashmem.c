@@ -27,6 +27,8 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,43 +39,52 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned;	/* unpinned ranges, by address */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
+	struct mutex mutex;		/* protects this area and its ranges */
 };
 
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' by `ashmem_lru_lock'
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* entry in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and lru_count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
+ *
+ * The shrinker walks the LRU under ashmem_lru_lock and only trylocks the
+ * areas it finds there, so reclaim never waits for a pin or unpin and an
+ * allocation made under an area's mutex can't deadlock against it.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/* most pages ashmem_shrink() takes from one area per lock round trip */
+#define ASHMEM_SHRINK_BATCH	256
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -100,35 +111,84 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 #define range_before_page(range, page) \
   ((range)->pgend < (page))
 
+#define range_adjacent(range, start, end) \
+  ((range)->pgend + 1 == (start) || (range)->pgstart == (end) + 1)
+
+/* most ranges ASHMEM_PIN_BATCH and ASHMEM_UNPIN_BATCH copy in at a time */
+#define ASHMEM_PIN_BATCH_CHUNK	32
+
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
 static inline void lru_add(struct ashmem_range *range)
 {
+	spin_lock(&ashmem_lru_lock);
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
+	spin_unlock(&ashmem_lru_lock);
 }
 
-static inline void lru_del(struct ashmem_range *range)
+/* Caller must hold ashmem_lru_lock. */
+static inline void __lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+static inline void lru_del(struct ashmem_range *range)
+{
+	spin_lock(&ashmem_lru_lock);
+	__lru_del(range);
+	spin_unlock(&ashmem_lru_lock);
+}
+
+/* range_next - the next unpinned range of the same area, or NULL */
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->node);
+
+	return n ? rb_entry(n, struct ashmem_range, node) : NULL;
+}
+
+/*
+ * range_first - returns the first unpinned range of 'asma' ending at or
+ * after 'page', or NULL. Unpinned ranges never overlap, so ordering them by
+ * start orders them by end as well.
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *n = asma->unpinned.rb_node;
+	struct ashmem_range *range, *first = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, node);
+		if (range_before_page(range, page))
+			n = n->rb_right;
+		else {
+			first = range;
+			n = n->rb_left;
+		}
+	}
+
+	return first;
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
 	struct ashmem_range *range;
 
 	range = kmem_cache_zalloc(ashmem_range_cachep, GFP_KERNEL);
@@ -140,7 +200,15 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	while (*p) {
+		parent = *p;
+		if (start < rb_entry(parent, struct ashmem_range, node)->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
 
 	if (range_on_lru(range))
 		lru_add(range);
@@ -150,7 +218,7 @@ static int range_alloc(struct ashmem_area *asma,
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
@@ -159,7 +227,7 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
@@ -169,8 +237,11 @@ static inline void range_shrink(struct ashmem_range *range,
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,7 +257,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned = RB_ROOT;
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -197,12 +269,12 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *node;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((node = rb_first(&asma->unpinned)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +289,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +310,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +319,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +340,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +357,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,7 +400,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -344,12 +416,17 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise until we hit 'nr_to_scan' pages freed.
+ * Areas that are busy are skipped. Once an area is locked, the ranges of it
+ * that follow on the LRU are taken along, up to ASHMEM_SHRINK_BATCH pages,
+ * and truncated with the LRU lock dropped.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct ashmem_range *range, *next;
+	struct ashmem_area *asma;
+	LIST_HEAD(batch);
+	int batched;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
@@ -357,21 +434,46 @@ static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	if (!nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	while (nr_to_scan > 0) {
+		asma = NULL;
+
+		spin_lock(&ashmem_lru_lock);
+		list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
+			if (!asma) {
+				if (!mutex_trylock(&range->asma->mutex))
+					continue;
+				asma = range->asma;
+				batched = 0;
+			} else if (range->asma != asma)
+				break;
+
+			__lru_del(range);
+			range->purged = ASHMEM_WAS_PURGED;
+			list_add_tail(&range->lru, &batch);
+
+			batched += range_size(range);
+			if (batched >= nr_to_scan ||
+			    batched >= ASHMEM_SHRINK_BATCH)
+				break;
+		}
+		spin_unlock(&ashmem_lru_lock);
 
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
+		/* everything left on the LRU belongs to busy areas */
+		if (!asma)
 			break;
+
+		list_for_each_entry_safe(range, next, &batch, lru) {
+			struct inode *inode = asma->file->f_dentry->d_inode;
+			loff_t start = range->pgstart * PAGE_SIZE;
+			loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+
+			list_del(&range->lru);
+			vmtruncate_range(inode, start, end);
+		}
+		mutex_unlock(&asma->mutex);
+
+		nr_to_scan -= batched;
 	}
-	mutex_unlock(&ashmem_mutex);
 
 	return lru_count;
 }
@@ -385,7 +487,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +502,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +510,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +524,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +533,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +550,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,16 +559,18 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
+	for (range = range_first(asma, pgstart); range; range = next) {
+		next = range_next(range);
+
 		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
+		if (range->pgstart > pgend)
 			break;
 
 		/*
@@ -510,7 +614,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
+			range_alloc(asma, range->purged,
 				    pgend + 1, range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
@@ -523,17 +627,25 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * The newly unpinned pages are resident, so they only merge with unpinned
+ * ranges that were not purged either, overlapping or neighbouring, so that
+ * an area unpinned piece by piece ends up with one range per contiguous
+ * region. Purged ranges are left alone; the pages around them get ranges
+ * of their own.
+ *
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
-	unsigned int purged = ASHMEM_NOT_PURGED;
+	int ret;
+
+	for (range = range_first(asma, pgstart ? pgstart - 1 : 0); range;
+	     range = next) {
+		next = range_next(range);
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
+		/* short circuit: nothing further can touch us */
+		if (range->pgstart > pgend + 1)
 			break;
 
 		/*
@@ -542,37 +654,125 @@ restart:
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
+		if (range->purged == ASHMEM_NOT_PURGED) {
+			if (page_range_in_range(range, pgstart, pgend) ||
+			    range_adjacent(range, pgstart, pgend)) {
+				pgstart = min_t(size_t, range->pgstart, pgstart),
+				pgend = max_t(size_t, range->pgend, pgend);
+				range_del(range);
+			}
+			continue;
 		}
+
+		if (!page_range_in_range(range, pgstart, pgend))
+			continue;
+		if (range->pgstart > pgstart) {
+			ret = range_alloc(asma, ASHMEM_NOT_PURGED, pgstart,
+					  range->pgstart - 1);
+			if (unlikely(ret))
+				return ret;
+		}
+		if (range->pgend >= pgend)
+			return 0;
+		pgstart = range->pgend + 1;
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, ASHMEM_NOT_PURGED, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
+
+	return ASHMEM_IS_PINNED;
+}
+
+/*
+ * pin_to_pages - checks 'pin' against the size of 'asma' and converts it to
+ * an inclusive page interval. Returns zero on success.
+ */
+static int pin_to_pages(struct ashmem_area *asma, struct ashmem_pin *pin,
+			size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
+
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
+		return -EINVAL;
+
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+
+	return 0;
+}
+
+/*
+ * ashmem_pin_unpin_batch - ASHMEM_PIN_BATCH and ASHMEM_UNPIN_BATCH: pin or
+ * unpin each range of a user array in turn. Pinning returns
+ * ASHMEM_WAS_PURGED if any of the ranges was purged. If a range is invalid,
+ * the ranges before it stay pinned or unpinned.
+ */
+static int ashmem_pin_unpin_batch(struct ashmem_area *asma, unsigned long cmd,
+				  void __user *p)
+{
+	struct ashmem_pin pins[ASHMEM_PIN_BATCH_CHUNK];
+	struct ashmem_pin_batch batch;
+	struct ashmem_pin __user *upins;
+	size_t pgstart, pgend;
+	__u32 done, i, n;
+	int ret = 0;
+
+	if (unlikely(!asma->file))
+		return -EINVAL;
+
+	if (unlikely(copy_from_user(&batch, p, sizeof(batch))))
+		return -EFAULT;
+
+	upins = (struct ashmem_pin __user *)(unsigned long) batch.pins;
+
+	for (done = 0; done < batch.count && ret >= 0; done += n) {
+		n = min_t(__u32, batch.count - done, ASHMEM_PIN_BATCH_CHUNK);
+		if (unlikely(copy_from_user(pins, upins + done,
+					    n * sizeof(*pins))))
+			return -EFAULT;
+
+		mutex_lock(&asma->mutex);
+		for (i = 0; i < n; i++) {
+			int err = pin_to_pages(asma, &pins[i], &pgstart, &pgend);
+
+			if (unlikely(err)) {
+				ret = err;
+				break;
+			}
+
+			if (cmd == ASHMEM_PIN_BATCH)
+				ret |= ashmem_pin(asma, pgstart, pgend);
+			else {
+				err = ashmem_unpin(asma, pgstart, pgend);
+				if (unlikely(err)) {
+					ret = err;
+					break;
+				}
+			}
 		}
+		mutex_unlock(&asma->mutex);
 	}
 
 	return ret;
@@ -591,23 +791,11 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
-		return -EINVAL;
-
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
+	ret = pin_to_pages(asma, &pin, &pgstart, &pgend);
+	if (unlikely(ret))
+		return ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -621,7 +809,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -659,6 +847,10 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_BATCH:
+	case ASHMEM_UNPIN_BATCH:
+		ret = ashmem_pin_unpin_batch(asma, cmd, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -40,6 +40,7 @@
 #include <linux/memcontrol.h>
 #include <linux/delayacct.h>
 #include <linux/sysctl.h>
+#include <linux/mempressure.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -1761,6 +1762,7 @@ static void shrink_zone(int priority, struct zone *zone,
 	enum lru_list l;
 	unsigned long nr_reclaimed = sc->nr_reclaimed;
 	unsigned long nr_to_reclaim = sc->nr_to_reclaim;
+	unsigned long nr_scanned = sc->nr_scanned;
 
 	get_scan_count(zone, sc, nr, priority);
 
@@ -1790,6 +1792,9 @@ static void shrink_zone(int priority, struct zone *zone,
 			break;
 	}
 
+	if (scanning_global_lru(sc))
+		mempressure_reclaim(sc->nr_scanned - nr_scanned,
+				    nr_reclaimed - sc->nr_reclaimed);
 	sc->nr_reclaimed = nr_reclaimed;
 
 	/*
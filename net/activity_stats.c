@@ -14,8 +14,15 @@
  * Author: Mike Chan (mike@android.com)
  */
 
+#include <linux/hash.h>
+#include <linux/netdevice.h>
 #include <linux/proc_fs.h>
+#include <linux/rculist.h>
+#include <linux/seqlock.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
 #include <linux/suspend.h>
+#include <net/activity_stats.h>
 #include <net/net_namespace.h>
 
 /*
@@ -24,66 +31,339 @@
  *
  * Buckets represent the count of network transmissions at least
  * N seconds apart, where N is 1 << bucket index.
+ *
+ * Besides the global buckets, each network interface (by name, so that
+ * an interface that goes down and up again keeps its history) and each
+ * uid doing socket I/O gets its own set of buckets.
  */
 #define BUCKET_MAX 10
 
+#define ACTIVITY_HASH_BITS	7
+/* Entries are never freed; stop adding new ones past this many */
+#define ACTIVITY_MAX_ENTRIES	4096
+
+struct activity_entry {
+	struct hlist_node hash;
+	union {
+		uid_t uid;
+		char name[IFNAMSIZ];
+	};
+	/*
+	 * Only written when a transmission starts a new bucket, so at most
+	 * about once a second, and the CPU that wins the cmpxchg on it is
+	 * the one that counts the transmission. The hot path only reads it.
+	 */
+	atomic64_t last_transmit;
+	/* jiffies when last_transmit was set, to skip the clock in between */
+	unsigned long last_jiffies;
+	atomic_long_t buckets[BUCKET_MAX];
+};
+
+struct activity_table {
+	spinlock_t lock;	/* serializes inserts */
+	int nr_entries;
+	struct hlist_head hash[1 << ACTIVITY_HASH_BITS];
+};
+
 /* Track network activity frequency */
-static unsigned long activity_stats[BUCKET_MAX];
-static ktime_t last_transmit;
+static struct activity_entry global_activity;
+static struct activity_table iface_activity = {
+	.lock = __SPIN_LOCK_UNLOCKED(iface_activity.lock),
+};
+static struct activity_table uid_activity = {
+	.lock = __SPIN_LOCK_UNLOCKED(uid_activity.lock),
+};
+
+/*
+ * Time spent in suspend, added to the monotonic clock. Only the PM
+ * notifier writes it; the seqcount keeps 32-bit readers from seeing half
+ * an update.
+ */
+static s64 suspend_offset;
+static seqcount_t suspend_offset_seq = SEQCNT_ZERO;
 static ktime_t suspend_time;
-static DEFINE_SPINLOCK(activity_lock);
+/* jiffies do not count the suspend, see activity_entry_due() */
+static unsigned long resume_jiffies;
 
-void activity_stats_update(void)
+static inline s64 activity_now(void)
 {
-	int i;
-	unsigned long flags;
-	ktime_t now;
-	s64 delta;
+	unsigned seq;
+	s64 offset;
 
-	spin_lock_irqsave(&activity_lock, flags);
-	now = ktime_get();
-	delta = ktime_to_ns(ktime_sub(now, last_transmit));
+	do {
+		seq = read_seqcount_begin(&suspend_offset_seq);
+		offset = suspend_offset;
+	} while (read_seqcount_retry(&suspend_offset_seq, seq));
+
+	return ktime_to_ns(ktime_get()) + offset;
+}
+
+/*
+ * An entry counted less than a second ago, with no suspend since, cannot
+ * start a new bucket yet; checking that on jiffies spares the clock read.
+ */
+static inline int activity_entry_due(struct activity_entry *entry)
+{
+	unsigned long last = ACCESS_ONCE(entry->last_jiffies);
+
+	return !time_in_range(jiffies, last, last + HZ - 2) ||
+	       time_before(last, ACCESS_ONCE(resume_jiffies));
+}
+
+static void activity_entry_update(struct activity_entry *entry, s64 now)
+{
+	s64 last = atomic64_read(&entry->last_transmit);
+	s64 delta = now - last;
+	int i;
 
 	for (i = BUCKET_MAX - 1; i >= 0; i--) {
 		/*
 		 * Check if the time delta between network activity is within the
 		 * minimum bucket range.
 		 */
-		if (delta < (1000000000ULL << i))
+		if (delta < (1000000000LL << i))
 			continue;
 
-		activity_stats[i]++;
-		last_transmit = now;
+		if (atomic64_cmpxchg(&entry->last_transmit, last, now) == last) {
+			entry->last_jiffies = jiffies;
+			atomic_long_inc(&entry->buckets[i]);
+		}
 		break;
 	}
-	spin_unlock_irqrestore(&activity_lock, flags);
 }
 
-static int activity_stats_read_proc(char *page, char **start, off_t off,
-					int count, int *eof, void *data)
+static unsigned long activity_hash(uid_t uid, const char *name)
+{
+	unsigned long hash = uid;
+
+	if (name)
+		hash = full_name_hash((const unsigned char *)name,
+				      strnlen(name, IFNAMSIZ));
+	return hash_long(hash, ACTIVITY_HASH_BITS);
+}
+
+static struct activity_entry *activity_find(struct activity_table *table,
+					    unsigned long hash, uid_t uid,
+					    const char *name)
+{
+	struct activity_entry *entry;
+	struct hlist_node *node;
+
+	hlist_for_each_entry_rcu(entry, node, &table->hash[hash], hash) {
+		if (name ? !strncmp(entry->name, name, IFNAMSIZ) :
+			   entry->uid == uid)
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * Look up the entry for a uid, or an interface if name is set, and create
+ * it if needed. Called under rcu_read_lock(), possibly from softirq context.
+ */
+static struct activity_entry *activity_get(struct activity_table *table,
+					   uid_t uid, const char *name)
+{
+	struct activity_entry *entry;
+	unsigned long hash = activity_hash(uid, name);
+	unsigned long flags;
+
+	entry = activity_find(table, hash, uid, name);
+	if (entry)
+		return entry;
+
+	spin_lock_irqsave(&table->lock, flags);
+	entry = activity_find(table, hash, uid, name);
+	if (entry || table->nr_entries >= ACTIVITY_MAX_ENTRIES)
+		goto out;
+	entry = kzalloc(sizeof(*entry), GFP_ATOMIC);
+	if (!entry)
+		goto out;
+	if (name)
+		strlcpy(entry->name, name, IFNAMSIZ);
+	else
+		entry->uid = uid;
+	hlist_add_head_rcu(&entry->hash, &table->hash[hash]);
+	table->nr_entries++;
+out:
+	spin_unlock_irqrestore(&table->lock, flags);
+	return entry;
+}
+
+void activity_stats_update(uid_t uid)
+{
+	struct activity_entry *entry;
+	s64 now = 0;
+
+	if (activity_entry_due(&global_activity)) {
+		now = activity_now();
+		activity_entry_update(&global_activity, now);
+	}
+
+	rcu_read_lock();
+	entry = activity_get(&uid_activity, uid, NULL);
+	if (entry && activity_entry_due(entry)) {
+		if (!now)
+			now = activity_now();
+		activity_entry_update(entry, now);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Called for every transmitted packet. Entries are never freed, so the
+ * one found for the device name is cached in the net_device; a rename
+ * clears it (see activity_stats_netdev_event()).
+ */
+void activity_stats_dev_xmit(struct net_device *dev)
+{
+	struct activity_entry *entry;
+
+	if (dev->flags & IFF_LOOPBACK)
+		return;
+
+	entry = ACCESS_ONCE(dev->activity_entry);
+	if (unlikely(!entry)) {
+		rcu_read_lock();
+		entry = activity_get(&iface_activity, 0, dev->name);
+		rcu_read_unlock();
+		if (!entry)
+			return;
+		dev->activity_entry = entry;
+	}
+	if (activity_entry_due(entry))
+		activity_entry_update(entry, activity_now());
+}
+
+static int activity_stats_show(struct seq_file *m, void *unused)
 {
 	int i;
-	int len;
-	char *p = page;
 
-	/* Only print if offset is 0, or we have enough buffer space */
-	if (off || count < (30 * BUCKET_MAX + 22))
-		return -ENOMEM;
+	seq_puts(m, "Min Bucket(sec) Count\n");
+	for (i = 0; i < BUCKET_MAX; i++)
+		seq_printf(m, "%15d %lu\n", 1 << i,
+			   atomic_long_read(&global_activity.buckets[i]));
+	return 0;
+}
+
+static int activity_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, activity_stats_show, NULL);
+}
 
-	len = snprintf(p, count, "Min Bucket(sec) Count\n");
-	count -= len;
-	p += len;
+static const struct file_operations activity_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = activity_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	for (i = 0; i < BUCKET_MAX; i++) {
-		len = snprintf(p, count, "%15d %lu\n", 1 << i, activity_stats[i]);
-		count -= len;
-		p += len;
+/*
+ * /proc/net/stat/activity_iface and activity_uid print one line per
+ * entry: its name or uid followed by the count for each bucket.
+ */
+static void *activity_table_seq_start(struct seq_file *m, loff_t *pos)
+	__acquires(RCU)
+{
+	struct activity_table *table = m->private;
+	struct activity_entry *entry;
+	struct hlist_node *node;
+	loff_t n = *pos;
+	int i;
+
+	rcu_read_lock();
+	if (!n)
+		return SEQ_START_TOKEN;
+	for (i = 0; i < ARRAY_SIZE(table->hash); i++) {
+		hlist_for_each_entry_rcu(entry, node, &table->hash[i], hash) {
+			if (!--n)
+				return entry;
+		}
 	}
-	*eof = 1;
+	return NULL;
+}
 
-	return p - page;
+static void *activity_table_seq_next(struct seq_file *m, void *v,
+				     loff_t *pos)
+{
+	struct activity_table *table = m->private;
+	struct activity_entry *entry = v;
+	struct hlist_node *node;
+	int i = 0;
+
+	++*pos;
+	if (v != SEQ_START_TOKEN) {
+		node = rcu_dereference(entry->hash.next);
+		if (node)
+			return hlist_entry(node, struct activity_entry, hash);
+		if (table == &uid_activity)
+			i = activity_hash(entry->uid, NULL) + 1;
+		else
+			i = activity_hash(0, entry->name) + 1;
+	}
+	for (; i < ARRAY_SIZE(table->hash); i++) {
+		node = rcu_dereference(table->hash[i].first);
+		if (node)
+			return hlist_entry(node, struct activity_entry, hash);
+	}
+	return NULL;
 }
 
+static void activity_table_seq_stop(struct seq_file *m, void *v)
+	__releases(RCU)
+{
+	rcu_read_unlock();
+}
+
+static int activity_table_seq_show(struct seq_file *m, void *v)
+{
+	struct activity_entry *entry = v;
+	int i;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(m, m->private == &uid_activity ? "uid" : "iface");
+		for (i = 0; i < BUCKET_MAX; i++)
+			seq_printf(m, " %d", 1 << i);
+		seq_putc(m, '\n');
+		return 0;
+	}
+
+	if (m->private == &uid_activity)
+		seq_printf(m, "%u", entry->uid);
+	else
+		seq_printf(m, "%s", entry->name);
+	for (i = 0; i < BUCKET_MAX; i++)
+		seq_printf(m, " %lu", atomic_long_read(&entry->buckets[i]));
+	seq_putc(m, '\n');
+	return 0;
+}
+
+static const struct seq_operations activity_table_seq_ops = {
+	.start = activity_table_seq_start,
+	.next = activity_table_seq_next,
+	.stop = activity_table_seq_stop,
+	.show = activity_table_seq_show,
+};
+
+static int activity_table_open(struct inode *inode, struct file *file)
+{
+	int ret = seq_open(file, &activity_table_seq_ops);
+
+	if (!ret)
+		((struct seq_file *)file->private_data)->private =
+			PDE(inode)->data;
+	return ret;
+}
+
+static const struct file_operations activity_table_fops = {
+	.owner = THIS_MODULE,
+	.open = activity_table_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
 static int activity_stats_notifier(struct notifier_block *nb,
 					unsigned long event, void *dummy)
 {
@@ -94,7 +374,13 @@ static int activity_stats_notifier(struct notifier_block *nb,
 
 		case PM_POST_SUSPEND:
 			suspend_time = ktime_sub(ktime_get_real(), suspend_time);
-			last_transmit = ktime_sub(last_transmit, suspend_time);
+			/* readers run in softirq context too */
+			local_bh_disable();
+			write_seqcount_begin(&suspend_offset_seq);
+			suspend_offset += ktime_to_ns(suspend_time);
+			write_seqcount_end(&suspend_offset_seq);
+			local_bh_enable();
+			resume_jiffies = jiffies;
 	}
 
 	return 0;
@@ -104,12 +390,31 @@ static struct notifier_block activity_stats_notifier_block = {
 	.notifier_call = activity_stats_notifier,
 };
 
+/* A device can only be renamed while it is down, so no xmit races this */
+static int activity_stats_netdev_event(struct notifier_block *nb,
+				       unsigned long event, void *ptr)
+{
+	struct net_device *dev = ptr;
+
+	if (event == NETDEV_CHANGENAME)
+		dev->activity_entry = NULL;
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block activity_stats_netdev_notifier = {
+	.notifier_call = activity_stats_netdev_event,
+};
+
 static int  __init activity_stats_init(void)
 {
-	create_proc_read_entry("activity", S_IRUGO,
-			init_net.proc_net_stat, activity_stats_read_proc, NULL);
+	proc_create("activity", S_IRUGO, init_net.proc_net_stat,
+		    &activity_stats_fops);
+	proc_create_data("activity_iface", S_IRUGO, init_net.proc_net_stat,
+			 &activity_table_fops, &iface_activity);
+	proc_create_data("activity_uid", S_IRUGO, init_net.proc_net_stat,
+			 &activity_table_fops, &uid_activity);
+	register_netdevice_notifier(&activity_stats_netdev_notifier);
 	return register_pm_notifier(&activity_stats_notifier_block);
 }
 
 subsys_initcall(activity_stats_init);
-
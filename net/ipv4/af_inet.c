@@ -113,6 +113,7 @@
 #include <net/inet_common.h>
 #include <net/xfrm.h>
 #include <net/net_namespace.h>
+#include <linux/uid_stat.h>
 #ifdef CONFIG_IP_MROUTE
 #include <linux/mroute.h>
 #endif
@@ -736,10 +737,20 @@ int inet_getname(struct socket *sock, struct sockaddr *uaddr,
 }
 EXPORT_SYMBOL(inet_getname);
 
+/* TCP traffic is accounted in tcp.c, which also sees splice and read_sock */
+static inline int inet_uid_stat_proto(struct sock *sk)
+{
+	if (sk->sk_protocol == IPPROTO_UDP ||
+	    sk->sk_protocol == IPPROTO_UDPLITE)
+		return UID_STAT_UDP;
+	return UID_STAT_OTHER;
+}
+
 int inet_sendmsg(struct kiocb *iocb, struct socket *sock, struct msghdr *msg,
 		 size_t size)
 {
 	struct sock *sk = sock->sk;
+	int err;
 
 	sock_rps_record_flow(sk);
 
@@ -748,7 +759,10 @@ int inet_sendmsg(struct kiocb *iocb, struct socket *sock, struct msghdr *msg,
 	    inet_autobind(sk))
 		return -EAGAIN;
 
-	return sk->sk_prot->sendmsg(iocb, sk, msg, size);
+	err = sk->sk_prot->sendmsg(iocb, sk, msg, size);
+	if (err > 0 && sk->sk_protocol != IPPROTO_TCP)
+		uid_stat_snd(current_uid(), inet_uid_stat_proto(sk), err);
+	return err;
 }
 EXPORT_SYMBOL(inet_sendmsg);
 
@@ -783,6 +797,8 @@ int inet_recvmsg(struct kiocb *iocb, struct socket *sock, struct msghdr *msg,
 				   flags & ~MSG_DONTWAIT, &addr_len);
 	if (err >= 0)
 		msg->msg_namelen = addr_len;
+	if (err > 0 && sk->sk_protocol != IPPROTO_TCP)
+		uid_stat_rcv(current_uid(), inet_uid_stat_proto(sk), err);
 	return err;
 }
 EXPORT_SYMBOL(inet_recvmsg);